@@ -16,82 +16,263 @@
 
 #include "ALooper.h"
 
-#include "ASensorEventQueue.h"
-
 #define LOG_TAG "libsensorndkbridge"
-#include <android/looper.h>
 #include <android-base/logging.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 using android::Mutex;
-using android::sp;
-using android::wp;
 
-ALooper::ALooper()
-    : mAwoken(false) {
+static uint32_t toEpollEvents(int events) {
+    uint32_t epollEvents = 0;
+    if (events & ALOOPER_EVENT_INPUT) epollEvents |= EPOLLIN;
+    if (events & ALOOPER_EVENT_OUTPUT) epollEvents |= EPOLLOUT;
+    return epollEvents;
 }
 
-void ALooper::signalSensorEvents(wp<ASensorEventQueue> queue) {
-    Mutex::Autolock autoLock(mLock);
-    mReadyQueues.insert(queue);
-    mCondition.signal();
+static int fromEpollEvents(uint32_t epollEvents) {
+    int events = 0;
+    if (epollEvents & EPOLLIN) events |= ALOOPER_EVENT_INPUT;
+    if (epollEvents & EPOLLOUT) events |= ALOOPER_EVENT_OUTPUT;
+    if (epollEvents & EPOLLERR) events |= ALOOPER_EVENT_ERROR;
+    if (epollEvents & EPOLLHUP) events |= ALOOPER_EVENT_HANGUP;
+    return events;
+}
+
+ALooper::ALooper(bool allowNonCallbacks)
+    : mAllowNonCallbacks(allowNonCallbacks),
+      mOwnerTid(gettid()),
+      mEpollFd(epoll_create1(EPOLL_CLOEXEC)),
+      mWakeEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      mResponseCount(0),
+      mResponseIndex(0) {
+    CHECK(mEpollFd.ok()) << "Could not create epoll instance";
+    CHECK(mWakeEventFd.ok()) << "Could not create wake event fd";
+
+    struct epoll_event eventItem = {};
+    eventItem.events = EPOLLIN;
+    eventItem.data.ptr = NULL;
+    CHECK_EQ(epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, mWakeEventFd.get(), &eventItem), 0)
+            << "Could not add wake event fd to epoll instance";
+}
+
+bool ALooper::getAllowNonCallbacks() const {
+    return mAllowNonCallbacks;
 }
 
 void ALooper::wake() {
-    Mutex::Autolock autoLock(mLock);
-    mAwoken = true;
-    mCondition.signal();
+    uint64_t inc = 1;
+    if (TEMP_FAILURE_RETRY(write(mWakeEventFd.get(), &inc, sizeof(inc))) != sizeof(inc)
+            && errno != EAGAIN) {
+        PLOG(ERROR) << "Could not write wake signal";
+    }
 }
 
-int ALooper::pollOnce(
-        int timeoutMillis, int *outFd, int *outEvents, void **outData) {
-    if (outFd) { *outFd = 0; }
-    if (outEvents) { *outEvents = 0; }
-    if (outData) { *outData = NULL; }
+void ALooper::awoken() {
+    uint64_t counter;
+    TEMP_FAILURE_RETRY(read(mWakeEventFd.get(), &counter, sizeof(counter)));
+}
 
-    int64_t waitUntilNs;
-    if (timeoutMillis < 0) {
-        waitUntilNs = -1;
+int ALooper::addFd(
+        int fd, int ident, int events, ALooper_callbackFunc callback, void *data) {
+    if (callback == NULL) {
+        if (!mAllowNonCallbacks) {
+            LOG(ERROR) << "Invalid attempt to set NULL callback but not allowed for this looper";
+            return -1;
+        }
+
+        if (ident < 0) {
+            LOG(ERROR) << "Invalid attempt to set NULL callback with ident < 0";
+            return -1;
+        }
     } else {
-        waitUntilNs = systemTime(SYSTEM_TIME_MONOTONIC) + timeoutMillis * 1000000LL;
+        ident = ALOOPER_POLL_CALLBACK;
     }
 
     Mutex::Autolock autoLock(mLock);
-    int64_t nowNs;
-    while ((timeoutMillis < 0
-                || (nowNs = systemTime(SYSTEM_TIME_MONOTONIC)) < waitUntilNs)
-            && mReadyQueues.empty()
-            && !mAwoken) {
-        if (timeoutMillis < 0) {
-            mCondition.wait(mLock);
-        } else {
-            mCondition.waitRelative(mLock, waitUntilNs - nowNs);
+    auto it = mRequests.find(fd);
+    if (it != mRequests.end()) {
+        // Update the existing registration in place. Its epoll data keeps
+        // pointing at the same request.
+        Request *request = it->second.get();
+        struct epoll_event eventItem = {};
+        eventItem.events = toEpollEvents(events);
+        eventItem.data.ptr = request;
+        if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_MOD, fd, &eventItem) < 0) {
+            PLOG(ERROR) << "Could not modify fd " << fd << " in epoll instance";
+            return -1;
         }
+
+        request->ident = ident;
+        request->events = events;
+        request->callback = callback;
+        request->data = data;
+        return 1;
     }
 
-    int result = ALOOPER_POLL_TIMEOUT;
+    std::unique_ptr<Request> request(new Request);
+    request->fd = fd;
+    request->ident = ident;
+    request->events = events;
+    request->callback = callback;
+    request->data = data;
+    request->removed = false;
 
-    if (!mReadyQueues.empty()) {
-        result = ALOOPER_POLL_CALLBACK;
+    struct epoll_event eventItem = {};
+    eventItem.events = toEpollEvents(events);
+    eventItem.data.ptr = request.get();
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &eventItem) < 0) {
+        PLOG(ERROR) << "Could not add fd " << fd << " to epoll instance";
+        return -1;
+    }
+
+    mRequests.emplace(fd, std::move(request));
+    return 1;
+}
+
+int ALooper::removeFd(int fd) {
+    return removeRequest(fd, NULL /* request */);
+}
 
-        for (auto& queue : mReadyQueues) {
-            sp<ASensorEventQueue> promotedQueue = queue.promote();
-            if (promotedQueue != nullptr) {
-                promotedQueue->dispatchCallback();
+int ALooper::removeRequest(int fd, const Request *request) {
+    Mutex::Autolock autoLock(mLock);
+    auto it = mRequests.find(fd);
+    if (it == mRequests.end()) {
+        return 0;
+    }
+
+    // When removing on behalf of a callback, the callback may have removed its
+    // fd itself and the number may already have been reused for a new
+    // registration, which must be left alone.
+    if (request != NULL && it->second.get() != request) {
+        return 0;
+    }
+
+    it->second->removed = true;
+    mRemovedRequests.push_back(std::move(it->second));
+    mRequests.erase(it);
+
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, NULL) < 0) {
+        PLOG(ERROR) << "Could not remove fd " << fd << " from epoll instance";
+        return -1;
+    }
+
+    return 1;
+}
+
+int ALooper::pollOnce(
+        int timeoutMillis, int *outFd, int *outEvents, void **outData) {
+    if (gettid() != mOwnerTid) {
+        LOG(ERROR) << "pollOnce called from thread " << gettid()
+                   << " on a looper owned by thread " << mOwnerTid;
+        return ALOOPER_POLL_ERROR;
+    }
+
+    int result = 0;
+    for (;;) {
+        // Hand out any pending non-callback events from the previous epoll
+        // wait first, one per call.
+        while (mResponseIndex < mResponseCount) {
+            const Response &response = mResponses[mResponseIndex++];
+            int ident = response.ident;
+            if (ident >= 0) {
+                if (outFd) { *outFd = response.request->fd; }
+                if (outEvents) { *outEvents = response.events; }
+                if (outData) { *outData = response.data; }
+                return ident;
             }
         }
 
-        mReadyQueues.clear();
-    } else if (mAwoken) {
-        result = ALOOPER_POLL_WAKE;
-        mAwoken = false;
-    }
+        if (result != 0) {
+            if (outFd) { *outFd = 0; }
+            if (outEvents) { *outEvents = 0; }
+            if (outData) { *outData = NULL; }
 
-    LOG(VERBOSE) << "pollOnce returning " << result;
+            LOG(VERBOSE) << "pollOnce returning " << result;
+            return result;
+        }
 
-    return result;
+        result = pollInner(timeoutMillis);
+    }
 }
 
-void ALooper::invalidateSensorQueue(wp<ASensorEventQueue> queue) {
-    Mutex::Autolock autoLock(mLock);
-    mReadyQueues.erase(queue);
+int ALooper::pollInner(int timeoutMillis) {
+    mResponseCount = 0;
+    mResponseIndex = 0;
+
+    {
+        // Nothing from the previous batch refers to these anymore, and fds
+        // removed from the epoll instance are never reported again.
+        Mutex::Autolock autoLock(mLock);
+        mRemovedRequests.clear();
+    }
+
+    struct epoll_event eventItems[kEpollMaxEvents];
+    int eventCount = epoll_wait(mEpollFd.get(), eventItems, kEpollMaxEvents, timeoutMillis);
+
+    if (eventCount < 0) {
+        if (errno == EINTR) {
+            return ALOOPER_POLL_WAKE;
+        }
+        PLOG(ERROR) << "epoll_wait failed";
+        return ALOOPER_POLL_ERROR;
+    }
+
+    if (eventCount == 0) {
+        return ALOOPER_POLL_TIMEOUT;
+    }
+
+    int result = ALOOPER_POLL_WAKE;
+
+    {
+        // Snapshot the registrations under the lock, addFd may modify them.
+        Mutex::Autolock autoLock(mLock);
+        for (int i = 0; i < eventCount; ++i) {
+            Request *request = static_cast<Request *>(eventItems[i].data.ptr);
+            if (request == NULL) {
+                awoken();
+                continue;
+            }
+
+            if (request->removed) {
+                continue;
+            }
+
+            Response &response = mResponses[mResponseCount++];
+            response.request = request;
+            response.ident = request->ident;
+            response.events = fromEpollEvents(eventItems[i].events);
+            response.callback = request->callback;
+            response.data = request->data;
+        }
+    }
+
+    // Invoke callbacks without holding mLock so that they are free to add and
+    // remove file descriptors, including their own. epoll moves each reported
+    // level-triggered fd that is still ready to the back of its ready list, so
+    // a queue that keeps receiving events can't starve the others even when
+    // more than kEpollMaxEvents of them are ready.
+    for (size_t i = 0; i < mResponseCount; ++i) {
+        const Response &response = mResponses[i];
+        if (response.ident != ALOOPER_POLL_CALLBACK) {
+            continue;
+        }
+
+        // An earlier callback of this batch may have removed this fd.
+        if (response.request->removed) {
+            continue;
+        }
+
+        int fd = response.request->fd;
+        int callbackResult = (*response.callback)(fd, response.events, response.data);
+        if (callbackResult == 0) {
+            removeRequest(fd, response.request);
+        }
+
+        result = ALOOPER_POLL_CALLBACK;
+    }
+
+    return result;
 }
@@ -18,31 +18,81 @@
 
 #define A_LOOPER_H_
 
+#include <android/looper.h>
 #include <android-base/macros.h>
-#include <utils/Condition.h>
+#include <android-base/unique_fd.h>
 #include <utils/Mutex.h>
 #include <utils/RefBase.h>
 
-#include <set>
+#include <sys/types.h>
 
-struct ASensorEventQueue;
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
-struct ALooper {
-    ALooper();
+// An epoll based looper. Sensor event queues are registered with it through
+// their eventfd like any other file descriptor, so a single thread can wait on
+// sensors, sockets and timers at once.
+//
+// A looper belongs to the thread that prepared it: only that thread may poll
+// it, so callbacks of the queues created against it are never dispatched on
+// another thread.
+struct ALooper : public android::RefBase {
+    explicit ALooper(bool allowNonCallbacks);
+
+    bool getAllowNonCallbacks() const;
 
-    void signalSensorEvents(android::wp<ASensorEventQueue> queue);
     void wake();
 
     int pollOnce(int timeoutMillis, int *outFd, int *outEvents, void **outData);
 
-    void invalidateSensorQueue(android::wp<ASensorEventQueue> queue);
+    // Same semantics as ALooper_addFd / ALooper_removeFd.
+    int addFd(int fd, int ident, int events, ALooper_callbackFunc callback, void *data);
+    int removeFd(int fd);
 
 private:
+    static constexpr int kEpollMaxEvents = 16;
+
+    // One per registered fd. The epoll instance hands back a pointer to the
+    // request itself, so dispatching an event needs no lookup and no
+    // allocation. Removed requests are only freed by the next pollInner, since
+    // the current batch of epoll events may still point at them.
+    struct Request {
+        int fd;
+        int ident;
+        int events;
+        ALooper_callbackFunc callback;
+        void *data;
+        std::atomic_bool removed;
+    };
+
+    struct Response {
+        Request *request;
+        int ident;
+        int events;
+        ALooper_callbackFunc callback;
+        void *data;
+    };
+
+    const bool mAllowNonCallbacks;
+    const pid_t mOwnerTid;
+
+    android::base::unique_fd mEpollFd;
+    android::base::unique_fd mWakeEventFd;
+
     android::Mutex mLock;
-    android::Condition mCondition;
+    std::unordered_map<int, std::unique_ptr<Request>> mRequests;  // guarded by mLock
+    std::vector<std::unique_ptr<Request>> mRemovedRequests;  // guarded by mLock
+
+    // Only touched by the thread calling pollOnce.
+    Response mResponses[kEpollMaxEvents];
+    size_t mResponseCount;
+    size_t mResponseIndex;
 
-    std::set<android::wp<ASensorEventQueue>> mReadyQueues;
-    bool mAwoken;
+    int pollInner(int timeoutMillis);
+    void awoken();
+    int removeRequest(int fd, const Request *request);
 
     DISALLOW_COPY_AND_ASSIGN(ALooper);
 };
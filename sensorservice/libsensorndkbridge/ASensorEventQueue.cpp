@@ -17,58 +17,358 @@
 #include "ASensorEventQueue.h"
 
 #include "ALooper.h"
+#include "EventConversion.h"
+#include "SensorCatalog.h"
 
 #define LOG_TAG "libsensorndkbridge"
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <sensorndkbridge/sensor_bridge.h>
+
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <utils/SystemClock.h>
+#include <utils/Timers.h>
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
 
 using android::sp;
 using android::frameworks::sensorservice::V1_0::Result;
-using android::hardware::sensors::V1_0::SensorInfo;
+using android::frameworks::sensorservice::V1_1::EventQueueFlagBits;
+using android::hardware::sensors::V1_0::SensorFlagBits;
 using android::OK;
 using android::BAD_VALUE;
 using android::Mutex;
+using android::hardware::EventFlag;
+using android::hardware::hidl_vec;
+using android::hardware::MQDescriptorSync;
 using android::hardware::Return;
 
-ASensorEventQueue::ASensorEventQueue(ALooper* looper, ALooper_callbackFunc callback, void* data)
+static constexpr uint32_t kReadAndProcess =
+        static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS);
+static constexpr uint32_t kEventsRead = static_cast<uint32_t>(EventQueueFlagBits::EVENTS_READ);
+
+// How long invalidate() waits for producers before it complains.
+static constexpr nsecs_t kDrainWarningNs = 1000000000;  // 1 s
+
+ASensorEventQueue::ASensorEventQueue(ALooper* looper, size_t capacity)
     : mLooper(looper),
-      mCallback(callback),
-      mData(data),
+      mEventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      mQueue(capacity),
+      mSignaled(false),
+      mWakeupCount(0),
       mRequestAdditionalInfo(false),
-      mValid(true) {}
+      mDecimating(false),
+      mHeldCount(0),
+      mLatencyStats(NULL),
+      mLatencyTracked(false),
+      mRecording(false),
+      mWaitThreshold(0),
+      mState(0),
+      mEventFlag(NULL),
+      mHasScheduling(false),
+      mScheduling(),
+      mStopEventQueueThread(false),
+      mUsesEventQueue(false) {
+    CHECK(mEventFd.ok()) << "Could not create sensor event queue event fd";
+}
+
+ASensorEventQueue::~ASensorEventQueue() {
+    Mutex::Autolock autoLock(mEventQueueLock);
+    stopEventQueueThreadLocked();
+    if (mEventFlag != NULL) {
+        EventFlag::deleteEventFlag(&mEventFlag);
+    }
+}
+
+int ASensorEventQueue::getFd() const {
+    return mEventFd.get();
+}
 
 void ASensorEventQueue::setImpl(const sp<IEventQueue> &queueImpl) {
+    Mutex::Autolock autoLock(mImplLock);
+    // Don't let a reconnection revive a queue that was destroyed. invalidate()
+    // clears the impl after marking the queue invalid, under the same lock.
+    if (queueImpl != NULL && !isValid()) {
+        return;
+    }
     mQueueImpl = queueImpl;
 }
 
+sp<ASensorEventQueue::IEventQueue> ASensorEventQueue::getImpl() {
+    Mutex::Autolock autoLock(mImplLock);
+    return mQueueImpl;
+}
+
+android::status_t ASensorEventQueue::setEventQueue(const MQDescriptorSync<Event> &desc) {
+    // Leave the pointers alone, the service owns the queue and may already
+    // have written to it.
+    std::unique_ptr<EventMessageQueue> eventQueue(
+            new EventMessageQueue(desc, false /* resetPointers */));
+    if (!eventQueue->isValid() || eventQueue->getEventFlagWord() == NULL) {
+        LOG(ERROR) << "Invalid sensor event message queue";
+        return BAD_VALUE;
+    }
+
+    EventFlag *eventFlag;
+    if (EventFlag::createEventFlag(eventQueue->getEventFlagWord(), &eventFlag) != OK) {
+        LOG(ERROR) << "Could not create event flag of sensor event message queue";
+        return BAD_VALUE;
+    }
+
+    Mutex::Autolock autoLock(mEventQueueLock);
+    // Same as in setImpl, invalidate() stops the thread under this lock.
+    if (!isValid()) {
+        EventFlag::deleteEventFlag(&eventFlag);
+        return android::INVALID_OPERATION;
+    }
+
+    // Events still in the message queue of a dead service are lost.
+    stopEventQueueThreadLocked();
+    if (mEventFlag != NULL) {
+        EventFlag::deleteEventFlag(&mEventFlag);
+    }
+
+    mEventQueue = std::move(eventQueue);
+    mEventFlag = eventFlag;
+    mUsesEventQueue.store(true, std::memory_order_release);
+    mStopEventQueueThread = false;
+    mEventQueueThread = std::thread(&ASensorEventQueue::eventQueueThreadLoop, this, eventFlag,
+                                    mHasScheduling, mScheduling);
+    return OK;
+}
+
+void ASensorEventQueue::clearEventQueue() {
+    Mutex::Autolock autoLock(mEventQueueLock);
+    stopEventQueueThreadLocked();
+    if (mEventFlag != NULL) {
+        EventFlag::deleteEventFlag(&mEventFlag);
+    }
+    mUsesEventQueue.store(false, std::memory_order_release);
+    mEventQueue.reset();
+}
+
+// Same limits as the service applies.
+static int32_t clampSamplingPeriodUs(ASensorRef sensor, int32_t samplingPeriodUs) {
+    const SensorRecord *info = asSensorRecord(sensor);
+    if (info->minDelay > 0 && samplingPeriodUs < info->minDelay) {
+        return info->minDelay;
+    }
+    if (info->maxDelay > 0 && samplingPeriodUs > info->maxDelay) {
+        return info->maxDelay;
+    }
+    return samplingPeriodUs;
+}
+
+bool ASensorEventQueue::getSubscription(int32_t sensorHandle, Subscription *subscription) {
+    Mutex::Autolock autoLock(mImplLock);
+    auto it = mSubscriptions.find(sensorHandle);
+    if (it == mSubscriptions.end()) {
+        return false;
+    }
+    *subscription = it->second;
+    return true;
+}
+
+int ASensorEventQueue::updateSubscription(
+        int32_t sensorHandle, const Subscription &subscription) {
+    // Record the subscription together with picking the IEventQueue, so that
+    // it is either sent to the current service or, if that one is dead, to
+    // the next one by restoreSensors.
+    sp<IEventQueue> queueImpl;
+    Subscription previous = {};
+    bool hadPrevious = false;
+    {
+        Mutex::Autolock autoLock(mImplLock);
+        if (mQueueImpl == NULL) {
+            return android::NO_INIT;
+        }
+
+        auto it = mSubscriptions.find(sensorHandle);
+        hadPrevious = it != mSubscriptions.end();
+        if (hadPrevious) {
+            previous = it->second;
+            if (previous == subscription) {
+                return OK;
+            }
+        }
+
+        mSubscriptions[sensorHandle] = subscription;
+
+        // The service doesn't know about sensors that aren't enabled.
+        if (!subscription.enabled && !(hadPrevious && previous.enabled)) {
+            updateGapDetection(sensorHandle, subscription);
+            return OK;
+        }
+
+        queueImpl = mQueueImpl;
+    }
+
+    Return<Result> ret = subscription.enabled
+            ? queueImpl->enableSensor(
+                    sensorHandle, subscription.samplingPeriodUs,
+                    subscription.maxBatchReportLatencyUs)
+            : queueImpl->disableSensor(sensorHandle);
+
+    if (!ret.isOk()) {
+        // The service died, the subscription takes effect once reconnected.
+        LOG(WARNING) << "Sensor service unavailable, deferring update of sensor "
+                     << sensorHandle;
+        updateGapDetection(sensorHandle, subscription);
+        return OK;
+    }
+
+    if (static_cast<Result>(ret) != Result::OK) {
+        Mutex::Autolock autoLock(mImplLock);
+        if (hadPrevious) {
+            mSubscriptions[sensorHandle] = previous;
+        } else {
+            mSubscriptions.erase(sensorHandle);
+        }
+        return BAD_VALUE;
+    }
+
+    updateGapDetection(sensorHandle, subscription);
+    return OK;
+}
+
+void ASensorEventQueue::updateGapDetection(
+        int32_t sensorHandle, const Subscription &subscription) {
+    // Only continuous sensors report at their sampling period.
+    const SensorRecord *info = asSensorRecord(subscription.sensor);
+    bool continuous = (info->flags & static_cast<uint32_t>(SensorFlagBits::MASK_REPORTING_MODE))
+            == static_cast<uint32_t>(SensorFlagBits::CONTINUOUS_MODE);
+    int64_t periodNs = subscription.enabled && continuous
+            ? static_cast<int64_t>(subscription.samplingPeriodUs) * 1000
+            : 0;
+    mStats.setSamplingPeriod(sensorHandle, periodNs);
+}
+
 int ASensorEventQueue::registerSensor(
         ASensorRef sensor,
         int32_t samplingPeriodUs,
         int64_t maxBatchReportLatencyUs) {
-    Return<Result> ret = mQueueImpl->enableSensor(
-            reinterpret_cast<const SensorInfo *>(sensor)->sensorHandle,
-            samplingPeriodUs,
-            maxBatchReportLatencyUs);
-
-    if (!ret.isOk()) {
+    if (samplingPeriodUs < 0 || maxBatchReportLatencyUs < 0) {
         return BAD_VALUE;
     }
 
-    return OK;
+    Subscription subscription;
+    subscription.sensor = sensor;
+    subscription.samplingPeriodUs = clampSamplingPeriodUs(sensor, samplingPeriodUs);
+    subscription.maxBatchReportLatencyUs = maxBatchReportLatencyUs;
+    subscription.enabled = true;
+
+    return updateSubscription(asSensorRecord(sensor)->sensorHandle, subscription);
+}
+
+bool ASensorEventQueue::restoreSensors() {
+    sp<IEventQueue> queueImpl;
+    std::unordered_map<int32_t, Subscription> subscriptions;
+    {
+        Mutex::Autolock autoLock(mImplLock);
+        queueImpl = mQueueImpl;
+        subscriptions = mSubscriptions;
+    }
+
+    if (queueImpl == NULL) {
+        // Destroyed meanwhile.
+        return true;
+    }
+
+    for (const auto &entry : subscriptions) {
+        if (!entry.second.enabled) {
+            continue;
+        }
+
+        Return<Result> ret = queueImpl->enableSensor(
+                entry.first, entry.second.samplingPeriodUs,
+                entry.second.maxBatchReportLatencyUs);
+        if (!ret.isOk()) {
+            return false;
+        }
+
+        if (static_cast<Result>(ret) != Result::OK) {
+            LOG(ERROR) << "Could not enable sensor " << entry.first << " again: "
+                       << toString(static_cast<Result>(ret));
+        }
+    }
+
+    return true;
 }
 
 int ASensorEventQueue::enableSensor(ASensorRef sensor) {
     static constexpr int32_t SENSOR_DELAY_NORMAL = 200000;
 
-    return registerSensor(
-            sensor, SENSOR_DELAY_NORMAL, 0 /* maxBatchReportLatencyUs */);
+    // Keep the rate and batching the sensor had, if any.
+    int32_t sensorHandle = asSensorRecord(sensor)->sensorHandle;
+    Subscription subscription;
+    if (!getSubscription(sensorHandle, &subscription)) {
+        subscription.sensor = sensor;
+        subscription.samplingPeriodUs = clampSamplingPeriodUs(sensor, SENSOR_DELAY_NORMAL);
+        subscription.maxBatchReportLatencyUs = 0;
+    }
+    subscription.enabled = true;
+
+    return updateSubscription(sensorHandle, subscription);
 }
 
 int ASensorEventQueue::setEventRate(
         ASensorRef sensor, int32_t samplingPeriodUs) {
-    // Technically this is not supposed to enable the sensor but using this
-    // API without enabling the sensor first is a no-op, so...
-    return registerSensor(
-            sensor, samplingPeriodUs, 0 /* maxBatchReportLatencyUs */);
+    if (samplingPeriodUs < 0) {
+        return BAD_VALUE;
+    }
+
+    // Keeps the batch latency. A sensor that isn't enabled is not enabled by
+    // this, the rate applies once it is.
+    int32_t sensorHandle = asSensorRecord(sensor)->sensorHandle;
+    Subscription subscription;
+    if (!getSubscription(sensorHandle, &subscription)) {
+        subscription.sensor = sensor;
+        subscription.maxBatchReportLatencyUs = 0;
+        subscription.enabled = false;
+    }
+    subscription.samplingPeriodUs = clampSamplingPeriodUs(sensor, samplingPeriodUs);
+
+    return updateSubscription(sensorHandle, subscription);
+}
+
+void ASensorEventQueue::dump(int fd) {
+    std::unordered_map<int32_t, Subscription> subscriptions;
+    {
+        Mutex::Autolock autoLock(mImplLock);
+        subscriptions = mSubscriptions;
+    }
+
+    std::string out = android::base::StringPrintf(
+            "ASensorEventQueue %p: %zu subscriptions\n", this, subscriptions.size());
+    for (const auto &entry : subscriptions) {
+        const Subscription &subscription = entry.second;
+        out += android::base::StringPrintf(
+                "  0x%08x %-24s %-8s period %d us, max batch latency %" PRId64 " us\n",
+                entry.first, ASensor_getName(subscription.sensor),
+                subscription.enabled ? "enabled" : "disabled", subscription.samplingPeriodUs,
+                subscription.maxBatchReportLatencyUs);
+    }
+
+    mStats.dump(mQueue.overflowCount(), &out);
+
+    {
+        Mutex::Autolock autoLock(mLatencyStatsLock);
+        if (mLatencyStatsStorage != NULL) {
+            mLatencyStatsStorage->dump(&out);
+        }
+    }
+
+    if (!android::base::WriteStringToFd(out, fd)) {
+        PLOG(ERROR) << "Could not dump sensor event queue";
+    }
 }
 
 int ASensorEventQueue::requestAdditionalInfoEvents(bool enable) {
@@ -76,90 +376,759 @@ int ASensorEventQueue::requestAdditionalInfoEvents(bool enable) {
     return OK;
 }
 
+int ASensorEventQueue::setDecimation(ASensorRef sensor, int mode, int32_t factor) {
+    EventDecimator::Mode decimatorMode;
+    switch (mode) {
+        case ASENSOR_DECIMATION_NONE:
+            decimatorMode = EventDecimator::NONE;
+            break;
+        case ASENSOR_DECIMATION_KEEP_NTH:
+            decimatorMode = EventDecimator::KEEP_NTH;
+            break;
+        case ASENSOR_DECIMATION_AVERAGE:
+            decimatorMode = EventDecimator::AVERAGE;
+            break;
+        case ASENSOR_DECIMATION_LATEST:
+            decimatorMode = EventDecimator::LATEST;
+            break;
+        default:
+            return BAD_VALUE;
+    }
+
+    if (factor < 0) {
+        return BAD_VALUE;
+    }
+
+    const SensorRecord *info = asSensorRecord(sensor);
+    Mutex::Autolock autoLock(mDecimatorLock);
+    if (mDecimatedEvents.capacity() < mQueue.capacity()) {
+        mDecimatedEvents.reserve(mQueue.capacity());
+    }
+
+    // The event kept back for LATEST is the newest of its sensor so far, it
+    // goes into the ring ahead of whatever the new mode lets through. While
+    // it is held mDecimating is set, so producers only write the ring under
+    // mDecimatorLock.
+    const Event *held = decimatorMode != EventDecimator::LATEST
+            ? mDecimator.takeHeld(info->sensorHandle)
+            : NULL;
+    if (held != NULL) {
+        mHeldCount = mDecimator.heldCount();
+        ProducerScope scope(this);
+        if (scope.entered()) {
+            writeEvents(held, 1);
+        }
+    }
+    android::status_t res = mDecimator.setMode(
+            info->sensorHandle, info->type, decimatorMode, factor);
+    mHeldCount = mDecimator.heldCount();
+    mDecimating = !mDecimator.empty();
+    return res;
+}
+
+int ASensorEventQueue::setLatencyTracking(bool enable) {
+    Mutex::Autolock autoLock(mLatencyStatsLock);
+    if (!enable) {
+        mLatencyStats = NULL;
+        return OK;
+    }
+
+    if (mLatencyStatsStorage == NULL) {
+        mLatencyStatsStorage.reset(new SensorLatencyStats);
+    } else {
+        mLatencyStatsStorage->reset();
+    }
+    mLatencyStats = mLatencyStatsStorage.get();
+    mLatencyTracked = true;
+    return OK;
+}
+
+void ASensorEventQueue::setRecorder(std::unique_ptr<SensorTraceWriter> recorder) {
+    std::unique_ptr<SensorTraceWriter> previous;
+    {
+        Mutex::Autolock autoLock(mRecorderLock);
+        previous = std::move(mRecorder);
+        mRecorder = std::move(recorder);
+        mRecording = mRecorder != NULL;
+    }
+
+    // Closing the trace truncates the file, keep that out of the lock.
+    if (previous != NULL && previous->getDroppedCount() > 0) {
+        LOG(WARNING) << "Sensor trace full, " << previous->getDroppedCount()
+                     << " events weren't recorded";
+    }
+}
+
+void ASensorEventQueue::record(const Event *events, size_t count, int64_t arrivalNs) {
+    Mutex::Autolock autoLock(mRecorderLock);
+    if (mRecorder != NULL) {
+        mRecorder->append(events, count, arrivalNs);
+    }
+}
+
+int ASensorEventQueue::getLatencyStats(
+        ASensorRef sensor, ASensorLatencySummary *arrival, ASensorLatencySummary *drain) const {
+    Mutex::Autolock autoLock(mLatencyStatsLock);
+    if (mLatencyStatsStorage == NULL
+            || !mLatencyStatsStorage->getSummaries(
+                    asSensorRecord(sensor)->sensorHandle, arrival, drain)) {
+        return android::NAME_NOT_FOUND;
+    }
+    return OK;
+}
+
+// Events waiting in the ring carry the time they arrived in their reserved
+// words, which the service leaves zero and which are cleared again before
+// the client sees them.
+static void setArrivalTime(sensors_event_t *event, int64_t arrivalNs) {
+    static_assert(sizeof(event->reserved1) >= sizeof(arrivalNs), "no room for arrival time");
+    memcpy(event->reserved1, &arrivalNs, sizeof(arrivalNs));
+}
+
+static int64_t takeArrivalTime(ASensorEvent *event) {
+    int64_t arrivalNs;
+    memcpy(&arrivalNs, event->reserved1, sizeof(arrivalNs));
+    memset(event->reserved1, 0, sizeof(arrivalNs));
+    return arrivalNs;
+}
+
+static bool hasSensorTimestamp(int32_t type) {
+    return type != SENSOR_TYPE_META_DATA && type != ASENSOR_TYPE_ADDITIONAL_INFO;
+}
+
+void ASensorEventQueue::recordArrival(
+        SensorLatencyStats *stats, sensors_event_t *event, int64_t nowNs, bool stamp) {
+    if (!hasSensorTimestamp(event->type)) {
+        return;
+    }
+    stats->recordArrival(event->sensor, nowNs - event->timestamp);
+    if (stamp) {
+        setArrivalTime(event, nowNs);
+    }
+}
+
+void ASensorEventQueue::recordDrain(
+        SensorLatencyStats *stats, ASensorEvent *events, size_t count) {
+    int64_t nowNs = android::elapsedRealtimeNano();
+    for (size_t i = 0; i < count; ++i) {
+        int64_t arrivalNs = takeArrivalTime(&events[i]);
+        // Events that arrived before tracking started carry no time.
+        if (stats != NULL && arrivalNs != 0) {
+            stats->recordDrain(events[i].sensor, nowNs - arrivalNs);
+        }
+    }
+}
+
+int ASensorEventQueue::setOverflowPolicy(int policy) {
+    switch (policy) {
+        case ASENSOR_QUEUE_OVERFLOW_DROP_OLDEST:
+            mQueue.setOverflowPolicy(SensorEventRing::DROP_OLDEST);
+            return OK;
+        case ASENSOR_QUEUE_OVERFLOW_DROP_NEWEST:
+            mQueue.setOverflowPolicy(SensorEventRing::DROP_NEWEST);
+            return OK;
+        default:
+            return BAD_VALUE;
+    }
+}
+
+int64_t ASensorEventQueue::getOverflowCount() const {
+    return mQueue.overflowCount();
+}
+
+void ASensorEventQueue::getStats(ASensorEventQueueStats *stats) const {
+    mStats.getStats(stats);
+    stats->overflowed = mQueue.overflowCount();
+}
+
 int ASensorEventQueue::disableSensor(ASensorRef sensor) {
-    Return<Result> ret = mQueueImpl->disableSensor(
-            reinterpret_cast<const SensorInfo *>(sensor)->sensorHandle);
+    int32_t sensorHandle = asSensorRecord(sensor)->sensorHandle;
+    Subscription subscription;
+    if (!getSubscription(sensorHandle, &subscription) || !subscription.enabled) {
+        return OK;
+    }
+    subscription.enabled = false;
 
-    return ret.isOk() ? OK : BAD_VALUE;
+    return updateSubscription(sensorHandle, subscription);
 }
 
 ssize_t ASensorEventQueue::getEvents(ASensorEvent *events, size_t count) {
-    // XXX Should this block if there aren't any events in the queue?
-
-    Mutex::Autolock autoLock(mLock);
+    return getEventsBatch(events, count, NULL /* outPending */);
+}
 
+ssize_t ASensorEventQueue::getEventsBatch(
+        ASensorEvent *events, size_t count, size_t *outPending) {
     static_assert(
             sizeof(ASensorEvent) == sizeof(sensors_event_t), "mismatched size");
 
-    size_t copy = std::min(count, mQueue.size());
-    for (size_t i = 0; i < copy; ++i) {
-        reinterpret_cast<sensors_event_t *>(events)[i] = mQueue[i];
+    // Reset the fd before clearing mSignaled and before draining: an event
+    // arriving after the reset either still sees mSignaled set and is picked
+    // up by the drain below, or sees it clear and signals the fd again.
+    if (mSignaled.load(std::memory_order_relaxed)) {
+        uint64_t counter;
+        (void)TEMP_FAILURE_RETRY(read(mEventFd.get(), &counter, sizeof(counter)));
+        mSignaled.exchange(false, std::memory_order_acq_rel);
+    }
+
+    size_t copy = 0;
+    size_t pending = 0;
+    bool fromRing = !mUsesEventQueue.load(std::memory_order_acquire);
+    if (!fromRing) {
+        Mutex::Autolock autoLock(mEventQueueLock);
+        if (mEventQueue != NULL) {
+            copy = readEventQueueLocked(events, count);
+            pending = mEventQueue->availableToRead();
+        } else {
+            fromRing = true;
+        }
+    }
+    if (fromRing) {
+        copy = mQueue.read(reinterpret_cast<sensors_event_t *>(events), count);
+        // Tracking may have been stopped while events carried their
+        // arrival time, clear it in any case.
+        SensorLatencyStats *stats = mLatencyStats.load();
+        if (stats != NULL || mLatencyTracked.load()) {
+            recordDrain(stats, events, copy);
+        }
+        pending = mQueue.size() + mHeldCount.load();
+    }
+
+    // Events held back by decimation are the newest of their sensors, they
+    // go last.
+    if (fromRing && copy < count && mHeldCount.load() > 0) {
+        size_t taken = takeHeldEvents(&events[copy], count - copy);
+        copy += taken;
+        pending -= std::min(pending, taken);
+    }
+
+    mStats.onDelivered(copy);
+
+    if (pending > 0) {
+        signalIfNeeded();
     }
-    mQueue.erase(mQueue.begin(), mQueue.begin() + copy);
 
     LOG(VERBOSE) << "ASensorEventQueue::getEvents() returned " << copy << " events.";
 
+    if (outPending != NULL) {
+        *outPending = pending;
+    }
     return copy;
 }
 
+ssize_t ASensorEventQueue::getEventsTimeout(
+        ASensorEvent *events, size_t count, size_t minCount, int64_t timeoutNs) {
+    minCount = std::min(minCount, count);
+    if (minCount > 0 && timeoutNs != 0) {
+        waitForEvents(minCount, timeoutNs);
+    }
+    return getEvents(events, count);
+}
+
+void ASensorEventQueue::waitForEvents(size_t minCount, int64_t timeoutNs) {
+    nsecs_t deadline = timeoutNs > 0 ? systemTime(SYSTEM_TIME_MONOTONIC) + timeoutNs : 0;
+
+    Mutex::Autolock autoLock(mWaitLock);
+    mWaitThreshold = minCount;
+    // Pairs with the fence in wakeWaiterIfNeeded: either the producer sees
+    // the threshold, or we see its events below.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for (;;) {
+        if (getPendingCount() >= minCount) {
+            break;
+        }
+        if (!isValid()) {
+            break;
+        }
+
+        if (timeoutNs < 0) {
+            mWaitCondition.wait(mWaitLock);
+            continue;
+        }
+
+        nsecs_t remaining = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+        if (remaining <= 0) {
+            break;
+        }
+        mWaitCondition.waitRelative(mWaitLock, remaining);
+    }
+
+    mWaitThreshold = 0;
+}
+
+void ASensorEventQueue::wakeWaiterIfNeeded(size_t pending) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    size_t threshold = mWaitThreshold.load(std::memory_order_relaxed);
+    if (threshold == 0 || pending < threshold) {
+        return;
+    }
+
+    // The waiter holds the lock until it waits, so this can't slip in
+    // between it checking for events and waiting.
+    Mutex::Autolock autoLock(mWaitLock);
+    mWaitCondition.broadcast();
+}
+
+size_t ASensorEventQueue::readEventQueueLocked(ASensorEvent *events, size_t count) {
+    // Events wait in the message queue until read, which is when they
+    // count as received.
+    size_t pending = mEventQueue->availableToRead();
+    mStats.onQueued(pending);
+    size_t available = std::min(count, pending);
+    EventMessageQueue::MemTransaction tx;
+    if (available == 0 || !mEventQueue->beginRead(available, &tx)) {
+        return 0;
+    }
+
+    // Convert in place, the events are in at most two contiguous regions of
+    // the shared memory.
+    bool acceptAdditionalInfo = mRequestAdditionalInfo.load();
+    auto regions = {tx.getFirstRegion(), tx.getSecondRegion()};
+    for (const auto &region : regions) {
+        mStats.onReceived(region.getAddress(), region.getLength());
+    }
+    if (mRecording.load()) {
+        int64_t nowNs = android::elapsedRealtimeNano();
+        for (const auto &region : regions) {
+            record(region.getAddress(), region.getLength(), nowNs);
+        }
+    }
+    size_t copied = 0;
+    size_t filtered = 0;
+    if (!mDecimating.load() && acceptAdditionalInfo) {
+        for (const auto &region : regions) {
+            convertSensorEvents(region.getAddress(), region.getLength(),
+                                reinterpret_cast<sensors_event_t *>(&events[copied]));
+            copied += region.getLength();
+        }
+    } else if (!mDecimating.load()) {
+        for (const auto &region : regions) {
+            const Event *regionEvents = region.getAddress();
+            for (size_t i = 0; i < region.getLength(); ++i) {
+                if (!acceptAdditionalInfo &&
+                        static_cast<int32_t>(regionEvents[i].sensorType)
+                                == ASENSOR_TYPE_ADDITIONAL_INFO) {
+                    ++filtered;
+                    continue;
+                }
+                convertSensorEvent(
+                        regionEvents[i], reinterpret_cast<sensors_event_t *>(&events[copied++]));
+            }
+        }
+    } else {
+        Mutex::Autolock decimatorLock(mDecimatorLock);
+        size_t index = 0;
+        for (const auto &region : regions) {
+            for (size_t i = 0; i < region.getLength(); ++i) {
+                mDecimator.scan(region.getAddress()[i], index++);
+            }
+        }
+
+        index = 0;
+        for (const auto &region : regions) {
+            const Event *regionEvents = region.getAddress();
+            for (size_t i = 0; i < region.getLength(); ++i, ++index) {
+                if (!acceptAdditionalInfo &&
+                        static_cast<int32_t>(regionEvents[i].sensorType)
+                                == ASENSOR_TYPE_ADDITIONAL_INFO) {
+                    ++filtered;
+                    continue;
+                }
+                const Event *event = mDecimator.process(regionEvents[i], index);
+                if (event == NULL) {
+                    mStats.onDecimated(1);
+                    continue;
+                }
+                convertSensorEvent(*event, reinterpret_cast<sensors_event_t *>(&events[copied++]));
+            }
+        }
+    }
+
+    if (filtered > 0) {
+        mStats.onFiltered(filtered);
+    }
+
+    SensorLatencyStats *stats = mLatencyStats.load();
+    if (stats != NULL) {
+        int64_t nowNs = android::elapsedRealtimeNano();
+        for (size_t i = 0; i < copied; ++i) {
+            recordArrival(stats, reinterpret_cast<sensors_event_t *>(&events[i]), nowNs,
+                          false /* stamp */);
+        }
+    }
+
+    mEventQueue->commitRead(available);
+    mEventFlag->wake(kEventsRead);
+
+    return copied;
+}
+
+size_t ASensorEventQueue::getPendingCount() const {
+    if (mUsesEventQueue.load(std::memory_order_acquire)) {
+        Mutex::Autolock autoLock(mEventQueueLock);
+        if (mEventQueue != NULL) {
+            return mEventQueue->availableToRead();
+        }
+    }
+    return mQueue.size() + mHeldCount.load();
+}
+
+size_t ASensorEventQueue::takeHeldEvents(ASensorEvent *events, size_t count) {
+    Mutex::Autolock decimatorLock(mDecimatorLock);
+    size_t taken = 0;
+    const Event *event;
+    while (taken < count && (event = mDecimator.takeHeld()) != NULL) {
+        convertSensorEvent(*event, reinterpret_cast<sensors_event_t *>(&events[taken++]));
+    }
+    mHeldCount = mDecimator.heldCount();
+    return taken;
+}
+
 int ASensorEventQueue::hasEvents() const {
-    return !mQueue.empty();
+    return getPendingCount() > 0;
 }
 
 Return<void> ASensorEventQueue::onEvent(const Event &event) {
     LOG(VERBOSE) << "ASensorEventQueue::onEvent";
 
+    ProducerScope scope(this);
+    if (!scope.entered()) {
+        return android::hardware::Void();
+    }
+
+    mStats.onReceived(&event, 1);
+    if (mRecording.load()) {
+        record(&event, 1, android::elapsedRealtimeNano());
+    }
+
+    if (mDecimating.load()) {
+        Mutex::Autolock decimatorLock(mDecimatorLock);
+        mDecimator.scan(event, 0);
+        const Event *decimated = mDecimator.process(event, 0);
+        bool replaced = false;
+        if (decimated == NULL) {
+            mStats.onDecimated(1);
+        } else if (mDecimator.hold(*decimated, &replaced)) {
+            // Every event is a batch of its own here, LATEST only thins
+            // them out by holding the newest until the client reads it.
+            if (replaced) {
+                mStats.onDecimated(1);
+            }
+            publishHeldEventsLocked();
+        } else {
+            writeEvents(decimated, 1);
+        }
+        return android::hardware::Void();
+    }
+
     if (static_cast<int32_t>(event.sensorType) != ASENSOR_TYPE_ADDITIONAL_INFO ||
             mRequestAdditionalInfo.load()) {
-
-        {
-            // Only lock the mutex in this block to avoid the following deadlock scenario:
-            //
-            // ASensorEventQueue::onEvent is called which grabs ASensorEventQueue::mLock followed
-            // by ALooper::mLock via ALooper::signalSensorEvents.
-            //
-            // Meanwhile
-            //
-            // ASensorEventQueue::dispatchCallback is invoked from ALooper::pollOnce which has
-            // has ALooper::mLock locked and the dispatched callback invokes
-            // ASensorEventQueue::getEvents which would try to grab ASensorEventQueue::mLock
-            // resulting in a deadlock.
-            Mutex::Autolock autoLock(mLock);
-            mQueue.emplace_back();
-            sensors_event_t* sensorEvent = &mQueue[mQueue.size() - 1];
-            android::hardware::sensors::V1_0::implementation::convertToSensorEvent(event,
-                                                                                   sensorEvent);
+        // Convert straight into the ring slot.
+        sensors_event_t* sensorEvent = mQueue.beginWrite();
+        if (sensorEvent == NULL) {
+            LOG(VERBOSE) << "ASensorEventQueue::onEvent dropped event, queue is full";
+            return android::hardware::Void();
+        }
+        convertSensorEvent(event, sensorEvent);
+        SensorLatencyStats *stats = mLatencyStats.load();
+        if (stats != NULL) {
+            recordArrival(stats, sensorEvent, android::elapsedRealtimeNano(), true /* stamp */);
         }
+        mQueue.endWrite();
+
+        size_t pending = mQueue.size();
+        mStats.onQueued(pending);
+        signalIfNeeded();
+        wakeWaiterIfNeeded(pending);
+    } else {
+        mStats.onFiltered(1);
+    }
 
-        Mutex::Autolock autoLock(mValidLock);
-        if (mValid) {
-            mLooper->signalSensorEvents(this);
+    return android::hardware::Void();
+}
+
+Return<void> ASensorEventQueue::onEvents(const hidl_vec<Event> &events) {
+    LOG(VERBOSE) << "ASensorEventQueue::onEvents(" << events.size() << ")";
+
+    ProducerScope scope(this);
+    if (!scope.entered()) {
+        return android::hardware::Void();
+    }
+
+    mStats.onReceived(events.data(), events.size());
+    if (mRecording.load()) {
+        record(events.data(), events.size(), android::elapsedRealtimeNano());
+    }
+
+    if (!mDecimating.load()) {
+        writeEvents(events.data(), events.size());
+        return android::hardware::Void();
+    }
+
+    // Only the events that survive are copied, then written like any batch.
+    Mutex::Autolock decimatorLock(mDecimatorLock);
+    for (size_t i = 0; i < events.size(); ++i) {
+        mDecimator.scan(events[i], i);
+    }
+    mDecimatedEvents.clear();
+    size_t decimated = 0;
+    size_t held = 0;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const Event *event = mDecimator.process(events[i], i);
+        bool replaced = false;
+        if (event == NULL) {
+            ++decimated;
+            continue;
+        }
+        if (mDecimator.hold(*event, &replaced)) {
+            decimated += replaced ? 1 : 0;
+            ++held;
+            continue;
+        }
+        // A batch can't leave more than a ring's worth of events in the
+        // ring anyway, write it in chunks of that much and let the overflow
+        // policy pick which survive.
+        if (mDecimatedEvents.size() == mDecimatedEvents.capacity()) {
+            writeEvents(mDecimatedEvents.data(), mDecimatedEvents.size());
+            mDecimatedEvents.clear();
         }
+        mDecimatedEvents.push_back(*event);
+    }
+    mStats.onDecimated(decimated);
+    writeEvents(mDecimatedEvents.data(), mDecimatedEvents.size());
+    if (held > 0) {
+        publishHeldEventsLocked();
     }
 
     return android::hardware::Void();
 }
 
-void ASensorEventQueue::dispatchCallback() {
-    if (mCallback != NULL) {
-        int res = (*mCallback)(-1 /* fd */, ALOOPER_EVENT_INPUT, mData);
+void ASensorEventQueue::writeEvents(const Event *events, size_t count) {
+    bool acceptAdditionalInfo = mRequestAdditionalInfo.load();
+    auto accept = [acceptAdditionalInfo](const Event &event) {
+        return acceptAdditionalInfo ||
+                static_cast<int32_t>(event.sensorType) != ASENSOR_TYPE_ADDITIONAL_INFO;
+    };
+
+    size_t accepted = acceptAdditionalInfo
+            ? count
+            : static_cast<size_t>(std::count_if(events, events + count, accept));
+    if (accepted < count) {
+        mStats.onFiltered(count - accepted);
+    }
+    if (accepted == 0) {
+        return;
+    }
+
+    // Reserve room for the whole batch at once, then convert straight into
+    // the ring and publish everything with a single store.
+    size_t skip;
+    size_t reserved = mQueue.beginWriteBatch(accepted, &skip);
+
+    SensorLatencyStats *stats = mLatencyStats.load();
+    int64_t nowNs = stats != NULL ? android::elapsedRealtimeNano() : 0;
 
-        if (res == 0) {
-            mCallback = NULL;
-            mData = NULL;
+    size_t written = 0;
+    if (accepted == count) {
+        // Nothing to filter out, convert in bulk into at most two contiguous
+        // runs of slots.
+        while (written < reserved) {
+            size_t n = std::min(reserved - written, mQueue.contiguousSlotsAt(written));
+            convertSensorEvents(&events[skip + written], n, mQueue.slotAt(written));
+            written += n;
         }
+        if (stats != NULL) {
+            for (size_t i = 0; i < written; ++i) {
+                recordArrival(stats, mQueue.slotAt(i), nowNs, true /* stamp */);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < count && written < reserved; ++i) {
+            if (!accept(events[i])) {
+                continue;
+            }
+            if (skip > 0) {
+                --skip;
+                continue;
+            }
+            sensors_event_t *slot = mQueue.slotAt(written++);
+            convertSensorEvent(events[i], slot);
+            if (stats != NULL) {
+                recordArrival(stats, slot, nowNs, true /* stamp */);
+            }
+        }
+    }
+    mQueue.endWriteBatch(written);
+
+    if (written > 0) {
+        size_t pending = mQueue.size();
+        mStats.onQueued(pending);
+        signalIfNeeded();
+        wakeWaiterIfNeeded(pending);
+    }
+}
+
+void ASensorEventQueue::publishHeldEventsLocked() {
+    mHeldCount = mDecimator.heldCount();
+    signalIfNeeded();
+    wakeWaiterIfNeeded(mQueue.size() + mHeldCount.load());
+}
+
+void ASensorEventQueue::signalIfNeeded() {
+    // Only the first event after a drain needs to wake up the looper, the
+    // rest are picked up by the same drain.
+    if (mSignaled.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    // Producers got here inside a ProducerScope already, this is for the
+    // consumer signaling events it left behind.
+    if (isValid()) {
+        signal();
     }
 }
 
+void ASensorEventQueue::requestDrain() {
+    signalIfNeeded();
+}
+
+uint64_t ASensorEventQueue::getWakeupCount() const {
+    return mWakeupCount.load(std::memory_order_relaxed);
+}
+
+void ASensorEventQueue::signal() {
+    mWakeupCount.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t inc = 1;
+    if (TEMP_FAILURE_RETRY(write(mEventFd.get(), &inc, sizeof(inc))) != sizeof(inc)
+            && errno != EAGAIN) {
+        PLOG(ERROR) << "Could not signal sensor event queue";
+    }
+}
+
+void ASensorEventQueue::setScheduling(const ASensorEventQueueScheduling &scheduling) {
+    Mutex::Autolock autoLock(mEventQueueLock);
+    mHasScheduling = true;
+    mScheduling = scheduling;
+}
+
+// Applies to the calling thread only.
+static void applyScheduling(const ASensorEventQueueScheduling &scheduling) {
+    if (scheduling.cpuMask != 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; ++cpu) {
+            if (scheduling.cpuMask & (1ull << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        if (sched_setaffinity(0 /* pid */, sizeof(cpus), &cpus) != 0) {
+            PLOG(WARNING) << "Can't pin sensor event queue thread to CPUs 0x" << std::hex
+                          << scheduling.cpuMask;
+        }
+    }
+
+    struct sched_param param;
+    param.sched_priority = scheduling.policy == SCHED_OTHER ? 0 : scheduling.priority;
+    if (sched_setscheduler(0 /* pid */, scheduling.policy, &param) != 0) {
+        PLOG(WARNING) << "Can't set scheduling policy " << scheduling.policy
+                      << " with priority " << scheduling.priority;
+        return;
+    }
+
+    if (scheduling.policy == SCHED_OTHER &&
+            setpriority(PRIO_PROCESS, gettid(), scheduling.priority) != 0) {
+        PLOG(WARNING) << "Can't set nice value " << scheduling.priority;
+    }
+}
+
+void ASensorEventQueue::eventQueueThreadLoop(
+        EventFlag *eventFlag, bool hasScheduling, ASensorEventQueueScheduling scheduling) {
+    if (hasScheduling) {
+        applyScheduling(scheduling);
+    }
+
+    while (!mStopEventQueueThread.load()) {
+        // The service sets the bit after every write, and wait() clears it,
+        // so writes made while the looper hasn't drained the queue yet are
+        // coalesced by signalIfNeeded.
+        uint32_t state = 0;
+        android::status_t err = eventFlag->wait(kReadAndProcess, &state);
+        if (err != OK && err != -EAGAIN && err != -EINTR) {
+            LOG(ERROR) << "Waiting on sensor event message queue failed: " << err;
+            break;
+        }
+
+        if ((state & kReadAndProcess) && !mStopEventQueueThread.load()) {
+            ProducerScope scope(this);
+            if (!scope.entered()) {
+                break;
+            }
+            signalIfNeeded();
+            // Counting the events would need mEventQueueLock, let the waiter
+            // count them.
+            wakeWaiterIfNeeded(SIZE_MAX);
+        }
+    }
+}
+
+void ASensorEventQueue::stopEventQueueThreadLocked() {
+    if (!mEventQueueThread.joinable()) {
+        return;
+    }
+
+    mStopEventQueueThread = true;
+    mEventFlag->wake(kReadAndProcess);
+    mEventQueueThread.join();
+}
+
+ASensorEventQueue::ProducerScope::ProducerScope(ASensorEventQueue *queue)
+    : mQueue(queue),
+      mEntered(!(queue->mState.fetch_add(1, std::memory_order_acquire) & kInvalid)) {}
+
+ASensorEventQueue::ProducerScope::~ProducerScope() {
+    uint32_t state = mQueue->mState.fetch_sub(1, std::memory_order_release);
+    if (state == (kInvalid | 1)) {
+        // invalidate() may be waiting for us. The queue can't go away under
+        // us: the service holds a reference for the callback, and the event
+        // queue thread is only joined after the wait.
+        Mutex::Autolock autoLock(mQueue->mDrainLock);
+        mQueue->mDrainCondition.broadcast();
+    }
+}
+
+bool ASensorEventQueue::isValid() const {
+    return !(mState.load(std::memory_order_acquire) & kInvalid);
+}
+
 void ASensorEventQueue::invalidate() {
+    // kInvalid is never cleared, so once the producers that got in before it
+    // are out, none will touch the queue again. They can be held up by the
+    // consumer or a recording on one of the locks they take, so sleep until
+    // the last one is out.
+    mState.fetch_or(kInvalid, std::memory_order_acq_rel);
+    {
+        Mutex::Autolock autoLock(mDrainLock);
+        while ((mState.load(std::memory_order_acquire) & ~kInvalid) != 0) {
+            if (mDrainCondition.waitRelative(mDrainLock, kDrainWarningNs) == android::TIMED_OUT) {
+                LOG(WARNING) << "Still waiting for "
+                             << (mState.load(std::memory_order_relaxed) & ~kInvalid)
+                             << " producer(s) to leave the event queue";
+            }
+        }
+    }
+
+    {
+        Mutex::Autolock autoLock(mEventQueueLock);
+        stopEventQueueThreadLocked();
+    }
     {
-      // Only lock within this context to avoid locking while calling invalidateSensorQueue which
-      // also holds a lock. This is safe to do because mValid can't be made true after it's false
-      // so onEvent will never signal new sensor events after mValid is false.
-      Mutex::Autolock autoLock(mValidLock);
-      mValid = false;
+        // Don't leave a waiter blocked on a queue that will stay empty.
+        Mutex::Autolock autoLock(mWaitLock);
+        mWaitCondition.broadcast();
     }
-    mLooper->invalidateSensorQueue(this);
+    mLooper->removeFd(mEventFd.get());
     setImpl(nullptr);
+    setRecorder(nullptr);
 }
 
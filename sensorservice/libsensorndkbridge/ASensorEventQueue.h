@@ -18,32 +18,77 @@
 
 #define A_SENSOR_EVENT_QUEUE_H_
 
+#include "ALooper.h"
+#include "EventDecimator.h"
+#include "EventQueueStats.h"
+#include "LatencyStats.h"
+#include "SensorEventRing.h"
+#include "SensorTrace.h"
+
 #include <android/frameworks/sensorservice/1.0/IEventQueue.h>
-#include <android/frameworks/sensorservice/1.0/IEventQueueCallback.h>
+#include <android/frameworks/sensorservice/1.1/IEventQueueCallback.h>
+#include <android/frameworks/sensorservice/1.1/types.h>
 #include <android/looper.h>
 #include <android/sensor.h>
 #include <android-base/macros.h>
+#include <android-base/unique_fd.h>
+#include <fmq/EventFlag.h>
+#include <fmq/MessageQueue.h>
+#include <sensorndkbridge/sensor_bridge.h>
 #include <sensors/convert.h>
+#include <utils/Condition.h>
 #include <utils/Mutex.h>
 
 #include <atomic>
-
-struct ALooper;
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 struct ASensorEventQueue
-    : public android::frameworks::sensorservice::V1_0::IEventQueueCallback {
+    : public android::frameworks::sensorservice::V1_1::IEventQueueCallback {
     using Event = android::hardware::sensors::V1_0::Event;
     using IEventQueue = android::frameworks::sensorservice::V1_0::IEventQueue;
+    using EventMessageQueue =
+            android::hardware::MessageQueue<Event, android::hardware::kSynchronizedReadWrite>;
+
+    ASensorEventQueue(ALooper *looper, size_t capacity);
+    ~ASensorEventQueue();
 
-    ASensorEventQueue(
-            ALooper *looper,
-            ALooper_callbackFunc callback,
-            void *data);
+    // The eventfd that becomes readable while events are pending. The owning
+    // looper polls it like any other file descriptor.
+    int getFd() const;
 
     android::hardware::Return<void> onEvent(const Event &event) override;
+    android::hardware::Return<void> onEvents(
+            const android::hardware::hidl_vec<Event> &events) override;
 
     void setImpl(const android::sp<IEventQueue> &queueImpl);
 
+    // Makes the queue read its events from the message queue described by
+    // desc, as returned by ISensorManager::createFmqEventQueue, rather than
+    // receive them through onEvent / onEvents. Events are converted straight
+    // from the shared memory into the buffer passed to getEvents; the event
+    // ring and its overflow policy aren't used. Calling it again, after the
+    // service restarted, replaces the message queue.
+    android::status_t setEventQueue(const android::hardware::MQDescriptorSync<Event> &desc);
+    // Drops the message queue, for a restarted service that only delivers
+    // events through onEvent / onEvents. Events left in it are lost.
+    void clearEventQueue();
+
+    // Policy, priority and CPUs of the thread reading events from shared
+    // memory, applied whenever it starts. Without it, the thread keeps the
+    // scheduling it inherits.
+    void setScheduling(const ASensorEventQueueScheduling &scheduling);
+
+    // Enables the sensors that were enabled on the previous IEventQueue
+    // again, after reconnecting to a restarted service. Returns false if
+    // that failed.
+    bool restoreSensors();
+
+    // Writes the subscription table to fd, for diagnosis.
+    void dump(int fd);
+
     int registerSensor(
             ASensorRef sensor,
             int32_t samplingPeriodUs,
@@ -56,25 +101,208 @@ struct ASensorEventQueue
 
     int requestAdditionalInfoEvents(bool enable);
 
+    // Returns BAD_VALUE if mode isn't supported for the sensor.
+    int setDecimation(ASensorRef sensor, int mode, int32_t factor);
+
+    int setLatencyTracking(bool enable);
+
+    // Records the events the queue receives from now on to recorder, as
+    // they arrive and before anything is filtered out, replacing any
+    // recording in progress. NULL stops recording and closes the trace.
+    void setRecorder(std::unique_ptr<SensorTraceWriter> recorder);
+    // Returns NAME_NOT_FOUND if nothing was recorded for the sensor.
+    int getLatencyStats(ASensorRef sensor, ASensorLatencySummary *arrival,
+                        ASensorLatencySummary *drain) const;
+
+    int setOverflowPolicy(int policy);
+    int64_t getOverflowCount() const;
+
+    void getStats(ASensorEventQueueStats *stats) const;
+
     ssize_t getEvents(ASensorEvent *events, size_t count);
+
+    // Like getEvents, additionally reporting the number of events left in the
+    // queue after the drain.
+    ssize_t getEventsBatch(ASensorEvent *events, size_t count, size_t *outPending);
+
+    // Like getEvents, but first waits up to timeoutNs, or indefinitely if it
+    // is negative, for minCount events to be pending. Only one thread at a
+    // time may wait.
+    ssize_t getEventsTimeout(
+            ASensorEvent *events, size_t count, size_t minCount, int64_t timeoutNs);
+
     int hasEvents() const;
 
-    void dispatchCallback();
+    // Signals the fd again as if events had arrived, for a consumer such as
+    // ASensorEventStream that read events it couldn't hand out yet.
+    void requestDrain();
+
+    // Number of times the queue's fd has been signaled. Only the first event
+    // after a drain signals it.
+    uint64_t getWakeupCount() const;
 
     void invalidate();
 
 private:
-    ALooper *mLooper;
-    ALooper_callbackFunc mCallback;
-    void *mData;
-    android::sp<IEventQueue> mQueueImpl;
+    // What the client asked for a sensor on this queue. The entry is kept
+    // when the sensor is disabled, so that enabling it again or changing its
+    // rate doesn't lose the batch latency.
+    struct Subscription {
+        ASensorRef sensor;
+        int32_t samplingPeriodUs;
+        int64_t maxBatchReportLatencyUs;
+        bool enabled;
+
+        bool operator==(const Subscription &other) const {
+            return samplingPeriodUs == other.samplingPeriodUs
+                    && maxBatchReportLatencyUs == other.maxBatchReportLatencyUs
+                    && enabled == other.enabled;
+        }
+    };
+
+    android::sp<ALooper> mLooper;
+
+    android::Mutex mImplLock;
+    android::sp<IEventQueue> mQueueImpl;  // guarded by mImplLock
+    // By sensor handle.
+    std::unordered_map<int32_t, Subscription> mSubscriptions;  // guarded by mImplLock
+
+    android::base::unique_fd mEventFd;
+
+    SensorEventRing mQueue;
+
+    // Whether mEventFd has been signaled since the consumer last reset it.
+    std::atomic_bool mSignaled;
+    std::atomic<uint64_t> mWakeupCount;
 
-    android::Mutex mLock;
-    std::vector<sensors_event_t> mQueue;
+    EventQueueStats mStats;
 
     std::atomic_bool mRequestAdditionalInfo;
-    android::Mutex mValidLock;
-    bool mValid;
+
+    // Taken by whoever converts events, once per batch, while any sensor is
+    // decimated, and by the consumer to take held events. Nested inside
+    // mEventQueueLock.
+    android::Mutex mDecimatorLock;
+    EventDecimator mDecimator;  // guarded by mDecimatorLock
+    std::atomic_bool mDecimating;
+    // Events of the batch in onEvents that survived decimation. Reserved for
+    // a ring's worth of events when decimation is set, so producers never
+    // allocate.
+    std::vector<Event> mDecimatedEvents;  // guarded by mDecimatorLock
+    // Events mDecimator keeps back for LATEST decimation on the callback
+    // path, counted as pending. Written under mDecimatorLock.
+    std::atomic<size_t> mHeldCount;
+
+    // Allocated when tracking is first enabled and kept from then on, so the
+    // paths recording latencies only need to load the pointer.
+    mutable android::Mutex mLatencyStatsLock;
+    std::unique_ptr<SensorLatencyStats> mLatencyStatsStorage;  // guarded by mLatencyStatsLock
+    std::atomic<SensorLatencyStats *> mLatencyStats;  // NULL while not tracking
+    // Whether events in the ring may carry their arrival time.
+    std::atomic_bool mLatencyTracked;
+
+    // Taken by producers only while recording, nothing is taken under it.
+    android::Mutex mRecorderLock;
+    std::unique_ptr<SensorTraceWriter> mRecorder;  // guarded by mRecorderLock
+    std::atomic_bool mRecording;
+
+    // A thread blocked in getEventsTimeout waits on mWaitCondition for
+    // mWaitThreshold events. Producers check the threshold without the lock,
+    // so it costs them nothing while nobody waits. Taken before
+    // mEventQueueLock.
+    android::Mutex mWaitLock;
+    android::Condition mWaitCondition;
+    std::atomic<size_t> mWaitThreshold;  // 0 while nobody waits
+
+    // Lifecycle of the queue: kInvalid once it is destroyed, plus the number
+    // of producers (service callbacks and the event queue thread) currently
+    // inside it. Producers count themselves in with a single atomic add and
+    // back out if the queue is invalid; invalidate() sets kInvalid and then
+    // waits for the count to drain, like an RCU grace period. From then on no
+    // producer touches the queue. Producers inside may block for a while on
+    // mDecimatorLock, mRecorderLock or mWaitLock, so invalidate() sleeps on
+    // mDrainCondition rather than spinning. The last producer out of an
+    // invalid queue takes mDrainLock to signal it, the others don't.
+    static constexpr uint32_t kInvalid = 1u << 31;
+    std::atomic<uint32_t> mState;
+    android::Mutex mDrainLock;
+    android::Condition mDrainCondition;
+
+    // Counts a producer in for its scope.
+    struct ProducerScope {
+        explicit ProducerScope(ASensorEventQueue *queue);
+        ~ProducerScope();
+
+        // False if the queue is invalid, in which case it must be left alone.
+        bool entered() const { return mEntered; }
+
+    private:
+        ASensorEventQueue *mQueue;
+        bool mEntered;
+
+        DISALLOW_COPY_AND_ASSIGN(ProducerScope);
+    };
+
+    bool isValid() const;
+
+    // Only set for queues reading from shared memory. mEventQueueThread waits
+    // on the event flag for the service to write events and signals mEventFd.
+    // The lock is only contended while the service restarts.
+    mutable android::Mutex mEventQueueLock;
+    std::unique_ptr<EventMessageQueue> mEventQueue;  // guarded by mEventQueueLock
+    android::hardware::EventFlag *mEventFlag;  // guarded by mEventQueueLock
+    std::thread mEventQueueThread;  // guarded by mEventQueueLock
+    bool mHasScheduling;  // guarded by mEventQueueLock
+    ASensorEventQueueScheduling mScheduling;  // guarded by mEventQueueLock
+    std::atomic_bool mStopEventQueueThread;
+    // Set while mEventQueue is, so the consumer of a queue fed through
+    // callbacks reads the ring without taking mEventQueueLock. Checked again
+    // under the lock when set, the queue may have been cleared since.
+    std::atomic_bool mUsesEventQueue;
+
+    // Signals mEventFd unless it already is.
+    void signalIfNeeded();
+    void signal();
+
+    android::sp<IEventQueue> getImpl();
+
+    // Returns false if the client never enabled the sensor or set its rate.
+    bool getSubscription(int32_t sensorHandle, Subscription *subscription);
+
+    // Records subscription and tells the service about it, unless that
+    // doesn't change anything for the service.
+    int updateSubscription(int32_t sensorHandle, const Subscription &subscription);
+    // Tells mStats at which period to expect events of the sensor.
+    void updateGapDetection(int32_t sensorHandle, const Subscription &subscription);
+
+    // Records the arrival latency of event and, if it goes into the ring,
+    // when it arrived, for its drain latency.
+    static void recordArrival(
+            SensorLatencyStats *stats, sensors_event_t *event, int64_t nowNs, bool stamp);
+    void recordDrain(SensorLatencyStats *stats, ASensorEvent *events, size_t count);
+
+    // Converts and publishes a batch of events delivered by the service.
+    void writeEvents(const Event *events, size_t count);
+    // Called by producers under mDecimatorLock after mDecimator held events.
+    void publishHeldEventsLocked();
+    // Moves up to count events kept back by mDecimator into events.
+    size_t takeHeldEvents(ASensorEvent *events, size_t count);
+
+    size_t readEventQueueLocked(ASensorEvent *events, size_t count);
+    // Only takes mEventQueueLock for a queue reading from shared memory.
+    size_t getPendingCount() const;
+
+    // Also returns when the queue is destroyed.
+    void waitForEvents(size_t minCount, int64_t timeoutNs);
+    // Called by producers with the number of pending events after writing,
+    // SIZE_MAX if they don't know.
+    void wakeWaiterIfNeeded(size_t pending);
+
+    void record(const Event *events, size_t count, int64_t arrivalNs);
+
+    void eventQueueThreadLoop(android::hardware::EventFlag *eventFlag, bool hasScheduling,
+                              ASensorEventQueueScheduling scheduling);
+    void stopEventQueueThreadLocked();
 
     DISALLOW_COPY_AND_ASSIGN(ASensorEventQueue);
 };
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ASensorEventStream.h"
+
+#include "PowerOfTwo.h"
+
+#define LOG_TAG "libsensorndkbridge"
+#include <android-base/logging.h>
+#include <hardware/sensors.h>
+
+#include <algorithm>
+#include <limits>
+
+using android::Mutex;
+using android::OK;
+
+// Per sensor. Holds a reorder window worth of events of a fast sensor.
+static constexpr size_t kRingCapacity = 256;
+static constexpr size_t kPassThroughCapacity = 64;
+
+// Events read from the queue at a time.
+static constexpr size_t kDrainChunk = 32;
+
+static bool isSensorData(const ASensorEvent &event) {
+    return event.type != SENSOR_TYPE_META_DATA && event.type != ASENSOR_TYPE_ADDITIONAL_INFO;
+}
+
+ASensorEventStream::EventRing::EventRing(size_t capacity)
+    : mMask(roundUpToPowerOfTwo(capacity) - 1),
+      mSlots(new ASensorEvent[mMask + 1]),
+      mHead(0),
+      mTail(0) {}
+
+bool ASensorEventStream::EventRing::push(const ASensorEvent &event) {
+    bool dropped = false;
+    if (mTail - mHead > mMask) {
+        ++mHead;
+        dropped = true;
+    }
+    mSlots[mTail & mMask] = event;
+    ++mTail;
+    return !dropped;
+}
+
+ASensorEventStream::Source::Source(int32_t sensorHandle)
+    : handle(sensorHandle),
+      enabled(false),
+      lastTimestamp(std::numeric_limits<int64_t>::min()),
+      ring(kRingCapacity) {}
+
+ASensorEventStream::ASensorEventStream(
+        const android::sp<ASensorEventQueue> &queue, int64_t reorderWindowNs)
+    : mQueue(queue),
+      mReorderWindowNs(reorderWindowNs),
+      mPassThrough(kPassThroughCapacity),
+      mNewestTimestamp(std::numeric_limits<int64_t>::min()),
+      mLastDeliveredTimestamp(std::numeric_limits<int64_t>::min()),
+      mDroppedEventCount(0) {}
+
+ASensorEventStream::Source *ASensorEventStream::findSourceLocked(int32_t handle) {
+    for (const auto &source : mSources) {
+        if (source->handle == handle) {
+            return source.get();
+        }
+    }
+    return NULL;
+}
+
+int ASensorEventStream::registerSensor(
+        ASensorRef sensor,
+        int32_t samplingPeriodUs,
+        int64_t maxBatchReportLatencyUs) {
+    int32_t handle = ASensor_getHandle(sensor);
+    {
+        Mutex::Autolock autoLock(mLock);
+        Source *source = findSourceLocked(handle);
+        if (source == NULL) {
+            mSources.emplace_back(new Source(handle));
+            source = mSources.back().get();
+        }
+        source->enabled = true;
+    }
+
+    int res = mQueue->registerSensor(sensor, samplingPeriodUs, maxBatchReportLatencyUs);
+    if (res != OK) {
+        Mutex::Autolock autoLock(mLock);
+        findSourceLocked(handle)->enabled = false;
+    }
+    return res;
+}
+
+int ASensorEventStream::disableSensor(ASensorRef sensor) {
+    {
+        // Events still in the ring are delivered, but the merge no longer
+        // waits for the sensor, which may let events of others go.
+        Mutex::Autolock autoLock(mLock);
+        Source *source = findSourceLocked(ASensor_getHandle(sensor));
+        if (source == NULL) {
+            return OK;
+        }
+        source->enabled = false;
+        rearmIfReadyLocked();
+    }
+
+    return mQueue->disableSensor(sensor);
+}
+
+void ASensorEventStream::drainQueueLocked() {
+    ASensorEvent events[kDrainChunk];
+    for (;;) {
+        ssize_t n = mQueue->getEvents(events, kDrainChunk);
+        if (n <= 0) {
+            return;
+        }
+
+        for (ssize_t i = 0; i < n; ++i) {
+            const ASensorEvent &event = events[i];
+            if (!isSensorData(event)) {
+                if (!mPassThrough.push(event)) {
+                    LOG(WARNING) << "Dropped sensor event of type " << event.type;
+                }
+                continue;
+            }
+
+            Source *source = findSourceLocked(event.sensor);
+            if (source == NULL) {
+                // Registered on the queue behind our back.
+                continue;
+            }
+
+            if (event.timestamp < source->lastTimestamp) {
+                ++mDroppedEventCount;
+                continue;
+            }
+            source->lastTimestamp = event.timestamp;
+            mNewestTimestamp = std::max(mNewestTimestamp, event.timestamp);
+
+            if (!source->ring.push(event)) {
+                // The consumer fell behind, the stream skips ahead.
+                ++mDroppedEventCount;
+            }
+        }
+
+        if (static_cast<size_t>(n) < kDrainChunk) {
+            return;
+        }
+    }
+}
+
+ASensorEventStream::Source *ASensorEventStream::nextSourceLocked() {
+    Source *oldest = NULL;
+    bool complete = true;
+    for (const auto &source : mSources) {
+        if (source->ring.empty()) {
+            complete = complete && !source->enabled;
+            continue;
+        }
+        if (oldest == NULL || source->ring.front().timestamp < oldest->ring.front().timestamp) {
+            oldest = source.get();
+        }
+    }
+
+    if (oldest == NULL) {
+        return NULL;
+    }
+
+    int64_t timestamp = oldest->ring.front().timestamp;
+    if (complete || timestamp <= mNewestTimestamp - mReorderWindowNs) {
+        return oldest;
+    }
+    return NULL;
+}
+
+ssize_t ASensorEventStream::getEvents(ASensorEvent *events, size_t count) {
+    Mutex::Autolock autoLock(mLock);
+
+    drainQueueLocked();
+
+    size_t n = 0;
+    while (n < count && !mPassThrough.empty()) {
+        events[n++] = mPassThrough.front();
+        mPassThrough.pop();
+    }
+
+    while (n < count) {
+        Source *source = nextSourceLocked();
+        if (source == NULL) {
+            break;
+        }
+
+        const ASensorEvent &event = source->ring.front();
+        if (event.timestamp < mLastDeliveredTimestamp) {
+            // Arrived after the window had passed it.
+            ++mDroppedEventCount;
+        } else {
+            events[n++] = event;
+            mLastDeliveredTimestamp = event.timestamp;
+        }
+        source->ring.pop();
+    }
+
+    rearmIfReadyLocked();
+    return n;
+}
+
+void ASensorEventStream::rearmIfReadyLocked() {
+    // Events that can go but didn't get to arrive on no new signal of the
+    // queue. Those still held back by the merge don't need one: only new
+    // events of the stream's sensors let them go, and those signal the
+    // queue themselves.
+    if (!mPassThrough.empty() || nextSourceLocked() != NULL) {
+        mQueue->requestDrain();
+    }
+}
+
+int64_t ASensorEventStream::getDroppedEventCount() const {
+    Mutex::Autolock autoLock(mLock);
+    return mDroppedEventCount;
+}
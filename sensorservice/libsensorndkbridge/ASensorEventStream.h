@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef A_SENSOR_EVENT_STREAM_H_
+
+#define A_SENSOR_EVENT_STREAM_H_
+
+#include "ASensorEventQueue.h"
+
+#include <android/sensor.h>
+#include <android-base/macros.h>
+#include <utils/Mutex.h>
+#include <utils/RefBase.h>
+
+#include <memory>
+#include <vector>
+
+// Events of several sensors, delivered in timestamp order.
+//
+// The events arrive through a regular event queue. Each sensor's events are
+// in order already, so they are sorted into one small ring per sensor and
+// merged: the oldest event at the head of the rings goes next. It can go as
+// soon as every enabled sensor has an event queued, since none of them can
+// deliver an older one anymore, or once it is reorderWindowNs older than the
+// newest event seen, after which a sensor lagging further behind is
+// considered late. Late events are dropped to keep the stream monotonic.
+//
+// There are only a handful of sensors per stream, so the merge scans the
+// ring heads rather than maintain a heap.
+struct ASensorEventStream {
+    ASensorEventStream(const android::sp<ASensorEventQueue> &queue, int64_t reorderWindowNs);
+
+    ASensorEventQueue *getQueue() const { return mQueue.get(); }
+
+    int registerSensor(
+            ASensorRef sensor,
+            int32_t samplingPeriodUs,
+            int64_t maxBatchReportLatencyUs);
+
+    int disableSensor(ASensorRef sensor);
+
+    ssize_t getEvents(ASensorEvent *events, size_t count);
+
+    int64_t getDroppedEventCount() const;
+
+private:
+    // Single consumer ring, unlike SensorEventRing nothing else touches it.
+    struct EventRing {
+        explicit EventRing(size_t capacity);
+
+        bool empty() const { return mHead == mTail; }
+        const ASensorEvent &front() const { return mSlots[mHead & mMask]; }
+        void pop() { ++mHead; }
+
+        // Returns false if the oldest event had to be dropped to make room.
+        bool push(const ASensorEvent &event);
+
+    private:
+        const size_t mMask;
+        std::unique_ptr<ASensorEvent[]> mSlots;
+        uint64_t mHead;
+        uint64_t mTail;
+    };
+
+    struct Source {
+        int32_t handle;
+        bool enabled;
+        int64_t lastTimestamp;
+        EventRing ring;
+
+        explicit Source(int32_t sensorHandle);
+    };
+
+    // Reads everything pending on the queue into the rings.
+    void drainQueueLocked();
+    Source *findSourceLocked(int32_t handle);
+
+    // Returns the source whose head goes next, or NULL if none can go yet.
+    Source *nextSourceLocked();
+    // Signals the queue's fd again if events can go that weren't delivered.
+    void rearmIfReadyLocked();
+
+    const android::sp<ASensorEventQueue> mQueue;
+    const int64_t mReorderWindowNs;
+
+    mutable android::Mutex mLock;
+    std::vector<std::unique_ptr<Source>> mSources;  // guarded by mLock
+    // Events other than sensor data, such as flush complete events, bypass
+    // the merge.
+    EventRing mPassThrough;  // guarded by mLock
+    int64_t mNewestTimestamp;  // guarded by mLock
+    int64_t mLastDeliveredTimestamp;  // guarded by mLock
+    int64_t mDroppedEventCount;  // guarded by mLock
+
+    DISALLOW_COPY_AND_ASSIGN(ASensorEventStream);
+};
+
+#endif  // A_SENSOR_EVENT_STREAM_H_
@@ -16,15 +16,28 @@
 
 #include "ALooper.h"
 #include "ASensorEventQueue.h"
+#include "ASensorEventStream.h"
 #include "ASensorManager.h"
+#include "SensorTrace.h"
 
 #define LOG_TAG "libsensorndkbridge"
 #include <android-base/logging.h>
 #include <android/looper.h>
+#include <cutils/native_handle.h>
 #include <hidl/HidlTransportSupport.h>
+#include <sensorndkbridge/sensor_bridge.h>
 #include <sensors/convert.h>
 
+#include <sched.h>
+#include <sys/resource.h>
+
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::RateLevel;
+using android::hardware::sensors::V1_0::SensorFlagBits;
+using android::hardware::sensors::V1_0::SensorFlagShift;
 using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorsEventFormatOffset;
+using android::frameworks::sensorservice::V1_0::IDirectReportChannel;
 using android::frameworks::sensorservice::V1_0::IEventQueue;
 using android::frameworks::sensorservice::V1_0::ISensorManager;
 using android::frameworks::sensorservice::V1_0::Result;
@@ -36,11 +49,18 @@ using android::status_t;
 using android::OK;
 using android::NO_INIT;
 using android::BAD_VALUE;
+using android::hardware::hidl_memory;
 using android::hardware::hidl_vec;
+using android::hardware::MQDescriptorSync;
 using android::hardware::Return;
 
 static Mutex gLock;
 
+// Queues without a scheduling of their own get callbacks at near-maximum
+// real-time priority, and no thread is pinned.
+static const ASensorEventQueueScheduling kDefaultScheduling = {
+        SCHED_FIFO, 98 /* priority */, 0 /* cpuMask */};
+
 // static
 ASensorManager *ASensorManager::sInstance = NULL;
 
@@ -59,141 +79,623 @@ ASensorManager *ASensorManager::getInstance() {
 
 void ASensorManager::SensorDeathRecipient::serviceDied(
         uint64_t, const wp<::android::hidl::base::V1_0::IBase>&) {
-    LOG(ERROR) << "Sensor service died. Cleanup sensor manager instance!";
-    Mutex::Autolock autoLock(gLock);
-    delete sInstance;
-    sInstance = NULL;
+    LOG(ERROR) << "Sensor service died, reconnecting";
+    mManager->onServiceDied();
+}
+
+static sp<ASensorManager::ISensorManager_1_1> castToV1_1(
+        const sp<ASensorManager::ISensorManager> &manager) {
+    auto manager_1_1 = ASensorManager::ISensorManager_1_1::castFrom(manager);
+    if (!manager_1_1.isOk()) {
+        return NULL;
+    }
+    return manager_1_1;
 }
 
 ASensorManager::ASensorManager()
-    : mInitCheck(NO_INIT) {
-    mManager = ISensorManager::getService();
+    : ASensorManager(ISensorManager::getService()) {
+}
+
+ASensorManager::ASensorManager(const sp<ISensorManager> &manager, ServiceGetter getter)
+    : mInitCheck(NO_INIT),
+      mServiceGetter(getter ? getter : [] { return ISensorManager::getService(); }),
+      mManager(manager),
+      mNextDirectChannelId(1),
+      mConnected(true),
+      mStopReconnectThread(false),
+      mServiceDiedTime(0),
+      mReconnectStats() {
     if (mManager != NULL) {
-        mDeathRecipient = new SensorDeathRecipient();
-        Return<bool> linked = mManager->linkToDeath(mDeathRecipient, /*cookie*/ 0);
-        if (!linked.isOk()) {
-            LOG(ERROR) << "Transaction error in linking to sensor service death: " <<
-                    linked.description().c_str();
-        } else if (!linked) {
-            LOG(WARNING) << "Unable to link to sensor service death notifications";
-        } else {
-            LOG(DEBUG) << "Link to sensor service death notification successful";
+        mManager_1_1 = castToV1_1(mManager);
+        if (linkToDeath(mManager)) {
             mInitCheck = OK;
         }
     }
 }
 
+ASensorManager::~ASensorManager() {
+    {
+        Mutex::Autolock autoLock(mLock);
+        mStopReconnectThread = true;
+        mReconnectCondition.signal();
+    }
+    if (mReconnectThread.joinable()) {
+        mReconnectThread.join();
+    }
+
+    if (mDeathRecipient != NULL && mManager != NULL) {
+        Return<bool> unlinked = mManager->unlinkToDeath(mDeathRecipient);
+        (void)unlinked.isOk();
+    }
+}
+
+bool ASensorManager::linkToDeath(const sp<ISensorManager> &manager) {
+    if (!manager->isRemote()) {
+        // An in-process service can't die independently of us.
+        return true;
+    }
+
+    if (mDeathRecipient == NULL) {
+        mDeathRecipient = new SensorDeathRecipient(this);
+    }
+
+    Return<bool> linked = manager->linkToDeath(mDeathRecipient, /*cookie*/ 0);
+    if (!linked.isOk()) {
+        LOG(ERROR) << "Transaction error in linking to sensor service death: " <<
+                linked.description().c_str();
+        return false;
+    } else if (!linked) {
+        LOG(WARNING) << "Unable to link to sensor service death notifications";
+        return false;
+    }
+
+    LOG(DEBUG) << "Link to sensor service death notification successful";
+    return true;
+}
+
+void ASensorManager::getManagers(
+        sp<ISensorManager> *manager, sp<ISensorManager_1_1> *manager_1_1) const {
+    Mutex::Autolock autoLock(mLock);
+    *manager = mManager;
+    *manager_1_1 = mManager_1_1;
+}
+
+void ASensorManager::onServiceDied() {
+    Mutex::Autolock autoLock(mLock);
+    ++mReconnectStats.serviceDeaths;
+    if (mConnected) {
+        mConnected = false;
+        mServiceDiedTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+
+    if (!mReconnectThread.joinable()) {
+        mReconnectThread = std::thread(&ASensorManager::reconnectThreadLoop, this);
+    }
+    mReconnectCondition.signal();
+}
+
+void ASensorManager::reconnectThreadLoop() {
+    static constexpr nsecs_t kMinRetryDelayNs = 10000000;  // 10 ms
+    static constexpr nsecs_t kMaxRetryDelayNs = 1000000000;  // 1 s
+
+    nsecs_t retryDelayNs = kMinRetryDelayNs;
+    for (;;) {
+        {
+            Mutex::Autolock autoLock(mLock);
+            while (mConnected && !mStopReconnectThread) {
+                mReconnectCondition.wait(mLock);
+                retryDelayNs = kMinRetryDelayNs;
+            }
+            if (mStopReconnectThread) {
+                return;
+            }
+        }
+
+        if (reconnect()) {
+            continue;
+        }
+
+        Mutex::Autolock autoLock(mLock);
+        if (!mStopReconnectThread) {
+            mReconnectCondition.waitRelative(mLock, retryDelayNs);
+        }
+        retryDelayNs = std::min(retryDelayNs * 2, kMaxRetryDelayNs);
+    }
+}
+
+bool ASensorManager::reconnect() {
+    uint32_t serviceDeaths;
+    {
+        Mutex::Autolock autoLock(mLock);
+        serviceDeaths = mReconnectStats.serviceDeaths;
+    }
+
+    sp<ISensorManager> manager = mServiceGetter();
+    if (manager == NULL || !linkToDeath(manager)) {
+        return false;
+    }
+    sp<ISensorManager_1_1> manager_1_1 = castToV1_1(manager);
+
+    // Queues created from now on use the new service, the ones created so far
+    // are moved over below. Those a previous attempt moved over already stay
+    // connected, unless the service died again since.
+    std::vector<std::pair<sp<ASensorEventQueue>, EventQueueInfo>> queues;
+    {
+        Mutex::Autolock autoLock(mLock);
+        mManager = manager;
+        mManager_1_1 = manager_1_1;
+        for (const auto &entry : mEventQueues) {
+            if (entry.second.serviceDeaths != serviceDeaths) {
+                queues.emplace_back(entry.first, entry.second);
+            }
+        }
+    }
+
+    for (auto &entry : queues) {
+        const sp<ASensorEventQueue> &queue = entry.first;
+        EventQueueInfo &info = entry.second;
+        if (!connectEventQueue(queue, &info, manager, manager_1_1)) {
+            LOG(ERROR) << "FAILED to reconnect event queue " << queue.get();
+            return false;
+        }
+
+        {
+            Mutex::Autolock autoLock(mLock);
+            auto it = mEventQueues.find(queue.get());
+            if (it == mEventQueues.end()) {
+                // Destroyed meanwhile. invalidate() may have dropped the
+                // previous connection before this one was made.
+                queue->clearEventQueue();
+                queue->setImpl(nullptr);
+                continue;
+            }
+            it->second.usesEventQueue = info.usesEventQueue;
+        }
+        if (!info.usesEventQueue && info.scheduling.cpuMask != 0) {
+            // The queue outlives the service it was created for, all that
+            // can be done is to tell.
+            LOG(WARNING) << "Event queue " << queue.get() << " fell back to callbacks, "
+                         << "its CPU mask 0x" << std::hex << info.scheduling.cpuMask
+                         << " no longer applies";
+        }
+
+        if (!queue->restoreSensors()) {
+            LOG(ERROR) << "FAILED to restore the sensors of event queue " << queue.get();
+            return false;
+        }
+
+        Mutex::Autolock autoLock(mLock);
+        auto it = mEventQueues.find(queue.get());
+        if (it != mEventQueues.end()) {
+            it->second.serviceDeaths = serviceDeaths;
+        }
+    }
+
+    Mutex::Autolock autoLock(mLock);
+    if (mReconnectStats.serviceDeaths != serviceDeaths) {
+        // The new service died meanwhile, start over.
+        return false;
+    }
+
+    nsecs_t latencyNs = systemTime(SYSTEM_TIME_MONOTONIC) - mServiceDiedTime;
+    mConnected = true;
+    ++mReconnectStats.reconnects;
+    mReconnectStats.lastReconnectLatencyNs = latencyNs;
+    mReconnectStats.maxReconnectLatencyNs =
+            std::max(mReconnectStats.maxReconnectLatencyNs, latencyNs);
+    LOG(INFO) << "Reconnected to sensor service with " << queues.size() << " event queues in "
+              << latencyNs / 1000000 << " ms";
+    return true;
+}
+
+void ASensorManager::getReconnectStats(ASensorManagerReconnectStats *stats) const {
+    Mutex::Autolock autoLock(mLock);
+    *stats = mReconnectStats;
+}
+
 status_t ASensorManager::initCheck() const {
     return mInitCheck;
 }
 
-int ASensorManager::getSensorList(ASensorList *out) {
-    LOG(VERBOSE) << "ASensorManager::getSensorList";
+void ASensorManager::fetchSensorListLocked() {
+    if (mCatalog != NULL) {
+        return;
+    }
 
-    Mutex::Autolock autoLock(mLock);
+    // Copied straight out of the reply, into the catalog's arena.
+    std::unique_ptr<SensorCatalog> catalog;
+    Return<void> ret =
+        mManager->getSensorList([&](const auto &list, auto result) {
+            if (result != Result::OK) {
+                return;
+            }
+
+            catalog.reset(new SensorCatalog(list));
+    });
+
+    if (!ret.isOk() || catalog == NULL) {
+        // Leave mCatalog alone so that the next call tries again.
+        LOG(ERROR) << "FAILED to get sensor list";
+        return;
+    }
 
-    if (mSensorList == NULL) {
-        Return<void> ret =
-            mManager->getSensorList([&](const auto &list, auto result) {
-                if (result != Result::OK) {
-                    return;
-                }
+    mCatalog = std::move(catalog);
+    mSensorsByHandle.clear();
+    mDefaultSensors.clear();
+    for (size_t i = 0; i < mCatalog->size(); ++i) {
+        const SensorRecord &sensor = mCatalog->at(i);
+        ASensorRef ref = mCatalog->getList()[i];
 
-                mSensors = list;
-        });
+        mSensorsByHandle.emplace(sensor.sensorHandle, ref);
 
-        (void)ret.isOk();
+        // emplace keeps the first sensor of each kind, which is the one the
+        // framework picks as default.
+        bool wakeup = sensor.flags & static_cast<uint32_t>(SensorFlagBits::WAKE_UP);
+        mDefaultSensors.emplace(getDefaultSensorKey(sensor.type, wakeup), ref);
+    }
+}
+
+// static
+uint64_t ASensorManager::getDefaultSensorKey(int type, bool wakeup) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(type)) << 1) | (wakeup ? 1 : 0);
+}
+
+int ASensorManager::getSensorList(ASensorList *out) {
+    LOG(VERBOSE) << "ASensorManager::getSensorList";
 
-        mSensorList.reset(new ASensorRef[mSensors.size()]);
-        for (size_t i = 0; i < mSensors.size(); ++i) {
-            mSensorList.get()[i] =
-                reinterpret_cast<ASensorRef>(&mSensors[i]);
+    Mutex::Autolock autoLock(mLock);
+    fetchSensorListLocked();
+
+    if (mCatalog == NULL) {
+        if (out) {
+            *out = NULL;
         }
+        return 0;
     }
 
     if (out) {
-        *out = reinterpret_cast<ASensorList>(mSensorList.get());
+        *out = mCatalog->getList();
     }
 
-    return mSensors.size();
+    return mCatalog->size();
 }
 
 ASensorRef ASensorManager::getDefaultSensor(int type) {
-    (void)getSensorList(NULL /* list */);
-
-    ASensorRef defaultSensor = NULL;
+    // Same choice as SensorManager::getDefaultSensor, which the service uses
+    // to answer ISensorManager::getDefaultSensor: these types are wake-up
+    // sensors by definition, for all others the non wake-up variant is the
+    // default.
+    bool wakeup = false;
+    switch (type) {
+        case ASENSOR_TYPE_PROXIMITY:
+        case ASENSOR_TYPE_SIGNIFICANT_MOTION:
+        case static_cast<int>(SensorType::TILT_DETECTOR):
+        case static_cast<int>(SensorType::WAKE_GESTURE):
+        case static_cast<int>(SensorType::GLANCE_GESTURE):
+        case static_cast<int>(SensorType::PICK_UP_GESTURE):
+        case static_cast<int>(SensorType::WRIST_TILT_GESTURE):
+        case ASENSOR_TYPE_LOW_LATENCY_OFFBODY_DETECT:
+            wakeup = true;
+            break;
+        default:
+            break;
+    }
 
-    Return<void> ret = mManager->getDefaultSensor(
-            static_cast<SensorType>(type),
-            [&](const auto &sensor, auto result) {
-                if (result != Result::OK) {
-                    return;
-                }
+    return getDefaultSensorEx(type, wakeup);
+}
 
-                for (size_t i = 0; i < mSensors.size(); ++i) {
-                    if (sensor == mSensors[i]) {
-                        defaultSensor =
-                             reinterpret_cast<ASensorRef>(&mSensors[i]);
+ASensorRef ASensorManager::getDefaultSensorEx(int type, bool wakeup) {
+    Mutex::Autolock autoLock(mLock);
+    fetchSensorListLocked();
 
-                        break;
-                    }
-                }
-            });
+    auto it = mDefaultSensors.find(getDefaultSensorKey(type, wakeup));
+    return it != mDefaultSensors.end() ? it->second : NULL;
+}
 
-    (void)ret.isOk();
+ASensorRef ASensorManager::getSensorByHandle(int32_t handle) {
+    Mutex::Autolock autoLock(mLock);
+    fetchSensorListLocked();
 
-    return defaultSensor;
+    auto it = mSensorsByHandle.find(handle);
+    return it != mSensorsByHandle.end() ? it->second : NULL;
 }
 
-ASensorRef ASensorManager::getDefaultSensorEx(
-        int /* type */, bool /* wakeup */) {
-    // XXX ISensorManager's getDefaultSensorEx() lacks a "wakeup" parameter.
-    return NULL;
+size_t ASensorManager::getEventQueueCapacity() {
+    // Queues are created before any sensor is registered on them, so size
+    // them to hold a full hardware FIFO flush of the deepest sensor.
+    static constexpr size_t kMinCapacity = 256;
+    static constexpr size_t kMaxCapacity = 8192;
+
+    Mutex::Autolock autoLock(mLock);
+    fetchSensorListLocked();
+
+    size_t capacity = kMinCapacity;
+    for (size_t i = 0; mCatalog != NULL && i < mCatalog->size(); ++i) {
+        capacity = std::max(capacity, static_cast<size_t>(mCatalog->at(i).fifoMaxEventCount));
+    }
+
+    return std::min(capacity, kMaxCapacity);
 }
 
 ASensorEventQueue *ASensorManager::createEventQueue(
         ALooper *looper,
-        int /* ident */,
+        int ident,
         ALooper_callbackFunc callback,
-        void *data) {
+        void *data,
+        int64_t maxDeliveryLatencyUs,
+        const ASensorEventQueueScheduling *scheduling) {
     LOG(VERBOSE) << "ASensorManager::createEventQueue";
 
-    sp<ASensorEventQueue> queue =
-        new ASensorEventQueue(looper, callback, data);
-
-    ::android::hardware::setMinSchedulerPolicy(queue, SCHED_FIFO, 98);
-    Result result;
-    Return<void> ret =
-        mManager->createEventQueue(
-                queue, [&](const sp<IEventQueue> &queueImpl, auto tmpResult) {
-                    result = tmpResult;
-                    if (result != Result::OK) {
-                        return;
-                    }
-
-                    queue->setImpl(queueImpl);
-                });
+    sp<ISensorManager> manager;
+    sp<ISensorManager_1_1> manager_1_1;
+    getManagers(&manager, &manager_1_1);
+
+    EventQueueInfo info;
+    info.capacity = getEventQueueCapacity();
+    info.maxDeliveryLatencyUs = maxDeliveryLatencyUs;
+    info.scheduling = scheduling != NULL ? *scheduling : kDefaultScheduling;
+    // Prefer shared memory, which doesn't take any transaction per event.
+    // Its events bypass the queue's ring, which is still sized for callbacks
+    // in case a restarted service can't give the queue shared memory.
+    info.usesEventQueue = manager_1_1 != NULL && maxDeliveryLatencyUs >= 0;
+    if (!info.usesEventQueue && info.scheduling.cpuMask != 0) {
+        LOG(ERROR) << "Can't pin callbacks to CPUs, they are delivered by binder threads";
+        return NULL;
+    }
+    {
+        Mutex::Autolock autoLock(mLock);
+        info.serviceDeaths = mReconnectStats.serviceDeaths;
+    }
 
-    if (!ret.isOk() || result != Result::OK) {
+    sp<ASensorEventQueue> queue = new ASensorEventQueue(looper, info.capacity);
+    // The thread reading shared memory delivers the events in place of the
+    // service's binder thread, it only gets a policy when asked for.
+    if (scheduling != NULL) {
+        queue->setScheduling(*scheduling);
+    }
+    if (!connectEventQueue(queue, &info, manager, manager_1_1)) {
         LOG(ERROR) << "FAILED to create event queue";
         return NULL;
     }
+    if (!info.usesEventQueue && info.scheduling.cpuMask != 0) {
+        LOG(ERROR) << "Can't pin callbacks to CPUs, the service has no shared memory queue";
+        queue->invalidate();
+        return NULL;
+    }
+
+    if (looper->addFd(queue->getFd(), ident, ALOOPER_EVENT_INPUT, callback, data) < 0) {
+        LOG(ERROR) << "FAILED to add event queue to looper";
+        queue->invalidate();
+        return NULL;
+    }
 
     queue->incStrong(NULL /* id */);
+    {
+        Mutex::Autolock autoLock(mLock);
+        mEventQueues.emplace(queue.get(), info);
+    }
 
     LOG(VERBOSE) << "Returning event queue " << queue.get();
     return queue.get();
 }
 
+bool ASensorManager::connectEventQueue(
+        const sp<ASensorEventQueue> &queue,
+        EventQueueInfo *info,
+        const sp<ISensorManager> &manager,
+        const sp<ISensorManager_1_1> &manager_1_1) {
+    if (info->usesEventQueue) {
+        if (connectFmqEventQueue(queue, *info, manager_1_1)) {
+            return true;
+        }
+        LOG(DEBUG) << "No shared memory event queue, falling back to callbacks";
+        queue->clearEventQueue();
+        info->usesEventQueue = false;
+    }
+
+    return connectCallbackEventQueue(queue, *info, manager, manager_1_1);
+}
+
+bool ASensorManager::connectFmqEventQueue(
+        const sp<ASensorEventQueue> &queue,
+        const EventQueueInfo &info,
+        const sp<ISensorManager_1_1> &manager_1_1) {
+    if (manager_1_1 == NULL) {
+        return false;
+    }
+
+    Result result = Result::UNKNOWN_ERROR;
+    Return<void> ret = manager_1_1->createFmqEventQueue(
+            static_cast<uint32_t>(info.capacity), info.maxDeliveryLatencyUs,
+            [&](const sp<IEventQueue> &queueImpl, const MQDescriptorSync<Event> &desc,
+                auto tmpResult) {
+                result = tmpResult;
+                if (result != Result::OK) {
+                    return;
+                }
+
+                if (queue->setEventQueue(desc) != OK) {
+                    result = Result::UNKNOWN_ERROR;
+                    return;
+                }
+
+                queue->setImpl(queueImpl);
+            });
+
+    return ret.isOk() && result == Result::OK;
+}
+
+bool ASensorManager::connectCallbackEventQueue(
+        const sp<ASensorEventQueue> &queue,
+        const EventQueueInfo &info,
+        const sp<ISensorManager> &manager,
+        const sp<ISensorManager_1_1> &manager_1_1) {
+    Result result = Result::UNKNOWN_ERROR;
+    if (!::android::hardware::setMinSchedulerPolicy(
+                queue, info.scheduling.policy, info.scheduling.priority)) {
+        LOG(WARNING) << "Can't schedule event queue callbacks with policy "
+                     << info.scheduling.policy << " and priority " << info.scheduling.priority;
+    }
+    auto onCreated = [&](const sp<IEventQueue> &queueImpl, auto tmpResult) {
+        result = tmpResult;
+        if (result != Result::OK) {
+            return;
+        }
+
+        queue->setImpl(queueImpl);
+    };
+
+    // Prefer batched delivery: a whole FIFO flush then costs a single
+    // transaction instead of one per event.
+    Return<void> ret = (manager_1_1 != NULL && info.maxDeliveryLatencyUs >= 0)
+            ? manager_1_1->createEventQueue_1_1(queue, info.maxDeliveryLatencyUs, onCreated)
+            : manager->createEventQueue(queue, onCreated);
+
+    return ret.isOk() && result == Result::OK;
+}
+
+int ASensorManager::startRecording(
+        ASensorEventQueue *queue, const char *path, size_t maxEvents) {
+    std::unique_ptr<SensorTraceWriter> recorder;
+    {
+        Mutex::Autolock autoLock(mLock);
+        fetchSensorListLocked();
+        recorder.reset(new SensorTraceWriter(
+                path, mCatalog != NULL ? mCatalog->toSensorInfos() : hidl_vec<SensorInfo>(),
+                maxEvents));
+    }
+
+    if (recorder->initCheck() != OK) {
+        return recorder->initCheck();
+    }
+
+    queue->setRecorder(std::move(recorder));
+    return OK;
+}
+
 void ASensorManager::destroyEventQueue(ASensorEventQueue *queue) {
     LOG(VERBOSE) << "ASensorManager::destroyEventQueue(" << queue << ")";
 
+    {
+        Mutex::Autolock autoLock(mLock);
+        mEventQueues.erase(queue);
+    }
+
     queue->invalidate();
 
     queue->decStrong(NULL /* id */);
     queue = NULL;
 }
 
+static status_t convertResult(Result result) {
+    switch (result) {
+        case Result::OK:
+            return OK;
+        case Result::NOT_EXIST:
+            return android::NAME_NOT_FOUND;
+        case Result::NO_MEMORY:
+            return android::NO_MEMORY;
+        case Result::NO_INIT:
+            return NO_INIT;
+        case Result::PERMISSION_DENIED:
+            return android::PERMISSION_DENIED;
+        case Result::BAD_VALUE:
+            return BAD_VALUE;
+        case Result::INVALID_OPERATION:
+            return android::INVALID_OPERATION;
+        default:
+            return android::UNKNOWN_ERROR;
+    }
+}
+
+int ASensorManager::createSharedMemoryDirectChannel(int fd, size_t size) {
+    LOG(VERBOSE) << "ASensorManager::createSharedMemoryDirectChannel";
+
+    sp<ISensorManager> manager;
+    sp<ISensorManager_1_1> manager_1_1;
+    getManagers(&manager, &manager_1_1);
+
+    // hidl_memory only refers to the handle, which has to outlive the call.
+    // Deleting the handle doesn't close fd, the caller keeps ownership of it.
+    native_handle_t *handle = native_handle_create(1 /* numFds */, 0 /* numInts */);
+    if (handle == NULL) {
+        return android::NO_MEMORY;
+    }
+    handle->data[0] = fd;
+
+    sp<IDirectReportChannel> channel;
+    Result result = Result::UNKNOWN_ERROR;
+    Return<void> ret = manager->createAshmemDirectChannel(
+            hidl_memory("ashmem", handle, size), size,
+            [&](const sp<IDirectReportChannel> &chan, auto tmpResult) {
+                result = tmpResult;
+                channel = chan;
+            });
+    native_handle_delete(handle);
+
+    if (!ret.isOk()) {
+        LOG(ERROR) << "FAILED to create direct channel: " << ret.description();
+        return android::DEAD_OBJECT;
+    }
+
+    if (result != Result::OK || channel == NULL) {
+        LOG(ERROR) << "FAILED to create direct channel: " << toString(result);
+        return result != Result::OK ? convertResult(result) : android::UNKNOWN_ERROR;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+    int channelId = mNextDirectChannelId++;
+    mDirectChannels.emplace(channelId, channel);
+    return channelId;
+}
+
+void ASensorManager::destroyDirectChannel(int channelId) {
+    LOG(VERBOSE) << "ASensorManager::destroyDirectChannel(" << channelId << ")";
+
+    // Dropping the last reference makes the service tear down the channel.
+    Mutex::Autolock autoLock(mLock);
+    mDirectChannels.erase(channelId);
+}
+
+int ASensorManager::configureDirectReport(ASensorRef sensor, int channelId, int rate) {
+    LOG(VERBOSE) << "ASensorManager::configureDirectReport(" << channelId << ", " << rate << ")";
+
+    if (rate < ASENSOR_DIRECT_RATE_STOP || rate > ASENSOR_DIRECT_RATE_VERY_FAST) {
+        return BAD_VALUE;
+    }
+
+    sp<IDirectReportChannel> channel;
+    {
+        Mutex::Autolock autoLock(mLock);
+        auto it = mDirectChannels.find(channelId);
+        if (it == mDirectChannels.end()) {
+            return BAD_VALUE;
+        }
+        channel = it->second;
+    }
+
+    int32_t sensorHandle = sensor == NULL ? -1 : asSensorRecord(sensor)->sensorHandle;
+
+    int32_t token = 0;
+    Result result = Result::UNKNOWN_ERROR;
+    Return<void> ret = channel->configure(
+            sensorHandle, static_cast<RateLevel>(rate), [&](auto tmpToken, auto tmpResult) {
+                token = tmpToken;
+                result = tmpResult;
+            });
+
+    if (!ret.isOk()) {
+        LOG(ERROR) << "FAILED to configure direct report: " << ret.description();
+        return android::DEAD_OBJECT;
+    }
+
+    if (result != Result::OK) {
+        return convertResult(result);
+    }
+
+    return token;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 ASensorManager *ASensorManager_getInstance() {
@@ -238,14 +740,12 @@ ASensor const* ASensorManager_getDefaultSensor(
     return manager->getDefaultSensor(type);
 }
 
-#if 0
 ASensor const* ASensorManager_getDefaultSensorEx(
         ASensorManager* manager, int type, bool wakeUp) {
     RETURN_IF_MANAGER_IS_NULL(NULL);
 
     return manager->getDefaultSensorEx(type, wakeUp);
 }
-#endif
 
 ASensorEventQueue* ASensorManager_createEventQueue(
         ASensorManager* manager,
@@ -262,6 +762,68 @@ ASensorEventQueue* ASensorManager_createEventQueue(
     return manager->createEventQueue(looper, ident, callback, data);
 }
 
+ASensorEventQueue* ASensorManager_createBatchedEventQueue(
+        ASensorManager* manager,
+        ALooper* looper,
+        int ident,
+        ALooper_callbackFunc callback,
+        void* data,
+        int64_t maxDeliveryLatencyUs) {
+    RETURN_IF_MANAGER_IS_NULL(NULL);
+
+    if (looper == NULL || maxDeliveryLatencyUs < 0) {
+        return NULL;
+    }
+
+    return manager->createEventQueue(looper, ident, callback, data, maxDeliveryLatencyUs);
+}
+
+ASensorEventQueue* ASensorManager_createEventQueueWithScheduling(
+        ASensorManager* manager,
+        ALooper* looper,
+        int ident,
+        ALooper_callbackFunc callback,
+        void* data,
+        const ASensorEventQueueScheduling* scheduling) {
+    RETURN_IF_MANAGER_IS_NULL(NULL);
+
+    if (looper == NULL || scheduling == NULL) {
+        return NULL;
+    }
+
+    switch (scheduling->policy) {
+        case SCHED_OTHER:
+            if (scheduling->priority < PRIO_MIN || scheduling->priority >= PRIO_MAX) {
+                return NULL;
+            }
+            break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            if (scheduling->priority < sched_get_priority_min(scheduling->policy) ||
+                    scheduling->priority > sched_get_priority_max(scheduling->policy)) {
+                return NULL;
+            }
+            break;
+        default:
+            return NULL;
+    }
+
+    return manager->createEventQueue(
+            looper, ident, callback, data, 0 /* maxDeliveryLatencyUs */, scheduling);
+}
+
+int ASensorManager_getReconnectStats(
+        ASensorManager* manager, ASensorManagerReconnectStats* stats) {
+    RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
+
+    if (stats == NULL) {
+        return BAD_VALUE;
+    }
+
+    manager->getReconnectStats(stats);
+    return OK;
+}
+
 int ASensorManager_destroyEventQueue(
         ASensorManager* manager, ASensorEventQueue* queue) {
     RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
@@ -273,23 +835,101 @@ int ASensorManager_destroyEventQueue(
     return OK;
 }
 
-#if 0
+#define RETURN_IF_STREAM_IS_NULL(x)     \
+    do {                                \
+        if (stream == NULL) {           \
+            return x;                   \
+        }                               \
+    } while (0)
+
+ASensorEventStream* ASensorManager_createEventStream(
+        ASensorManager* manager,
+        ALooper* looper,
+        int ident,
+        ALooper_callbackFunc callback,
+        void* data,
+        int64_t reorderWindowNs) {
+    RETURN_IF_MANAGER_IS_NULL(NULL);
+
+    if (looper == NULL || reorderWindowNs < 0) {
+        return NULL;
+    }
+
+    ASensorEventQueue *queue = manager->createEventQueue(looper, ident, callback, data);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    return new ASensorEventStream(queue, reorderWindowNs);
+}
+
+int ASensorManager_destroyEventStream(
+        ASensorManager* manager, ASensorEventStream* stream) {
+    RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
+    RETURN_IF_STREAM_IS_NULL(BAD_VALUE);
+
+    manager->destroyEventQueue(stream->getQueue());
+    delete stream;
+
+    return OK;
+}
+
+int ASensorEventStream_registerSensor(
+        ASensorEventStream* stream,
+        ASensor const* sensor,
+        int32_t samplingPeriodUs,
+        int64_t maxBatchReportLatencyUs) {
+    RETURN_IF_STREAM_IS_NULL(BAD_VALUE);
+    RETURN_IF_SENSOR_IS_NULL(BAD_VALUE);
+
+    return stream->registerSensor(sensor, samplingPeriodUs, maxBatchReportLatencyUs);
+}
+
+int ASensorEventStream_disableSensor(ASensorEventStream* stream, ASensor const* sensor) {
+    RETURN_IF_STREAM_IS_NULL(BAD_VALUE);
+    RETURN_IF_SENSOR_IS_NULL(BAD_VALUE);
+
+    return stream->disableSensor(sensor);
+}
+
+ssize_t ASensorEventStream_getEvents(
+        ASensorEventStream* stream, ASensorEvent* events, size_t count) {
+    RETURN_IF_STREAM_IS_NULL(BAD_VALUE);
+    return stream->getEvents(events, count);
+}
+
+int64_t ASensorEventStream_getDroppedEventCount(ASensorEventStream* stream) {
+    RETURN_IF_STREAM_IS_NULL(BAD_VALUE);
+    return stream->getDroppedEventCount();
+}
+
 int ASensorManager_createSharedMemoryDirectChannel(
         ASensorManager* manager, int fd, size_t size) {
     RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
 
-    return OK;
+    if (fd < 0 || size < static_cast<size_t>(SensorsEventFormatOffset::TOTAL_LENGTH)) {
+        return BAD_VALUE;
+    }
+
+    return manager->createSharedMemoryDirectChannel(fd, size);
 }
 
+#if 0
 int ASensorManager_createHardwareBufferDirectChannel(
         ASensorManager* manager, AHardwareBuffer const * buffer, size_t size) {
     RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
 
     return OK;
 }
+#endif
 
 void ASensorManager_destroyDirectChannel(
         ASensorManager* manager, int channelId) {
+    if (manager == NULL) {
+        return;
+    }
+
+    manager->destroyDirectChannel(channelId);
 }
 
 int ASensorManager_configureDirectReport(
@@ -297,9 +937,15 @@ int ASensorManager_configureDirectReport(
         ASensor const* sensor,
         int channelId,int rate) {
     RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
-    return OK;
+
+    // A NULL sensor with ASENSOR_DIRECT_RATE_STOP stops all sensors on the
+    // channel.
+    if (sensor == NULL && rate != ASENSOR_DIRECT_RATE_STOP) {
+        return BAD_VALUE;
+    }
+
+    return manager->configureDirectReport(sensor, channelId, rate);
 }
-#endif
 
 int ASensorEventQueue_registerSensor(
         ASensorEventQueue* queue,
@@ -346,110 +992,211 @@ ssize_t ASensorEventQueue_getEvents(
     return queue->getEvents(events, count);
 }
 
+ssize_t ASensorEventQueue_getEventsBatch(
+        ASensorEventQueue* queue, ASensorEvent* events, size_t count, size_t* outPending) {
+    LOG(VERBOSE) << "ASensorEventQueue_getEventsBatch";
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    return queue->getEventsBatch(events, count, outPending);
+}
+
+int ASensorEventQueue_setDecimation(
+        ASensorEventQueue* queue, ASensor const* sensor, int mode, int32_t factor) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    RETURN_IF_SENSOR_IS_NULL(BAD_VALUE);
+    return queue->setDecimation(sensor, mode, factor);
+}
+
+int ASensorEventQueue_setLatencyTracking(ASensorEventQueue* queue, bool enable) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    return queue->setLatencyTracking(enable);
+}
+
+int ASensorEventQueue_getLatencyStats(
+        ASensorEventQueue* queue, ASensor const* sensor, ASensorLatencySummary* arrival,
+        ASensorLatencySummary* drain) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    RETURN_IF_SENSOR_IS_NULL(BAD_VALUE);
+    return queue->getLatencyStats(sensor, arrival, drain);
+}
+
+int ASensorManager_startEventQueueRecording(
+        ASensorManager* manager, ASensorEventQueue* queue, const char* path, size_t maxEvents) {
+    RETURN_IF_MANAGER_IS_NULL(BAD_VALUE);
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+
+    if (path == NULL || maxEvents == 0) {
+        return BAD_VALUE;
+    }
+
+    return manager->startRecording(queue, path, maxEvents);
+}
+
+int ASensorEventQueue_stopRecording(ASensorEventQueue* queue) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+
+    queue->setRecorder(nullptr);
+    return OK;
+}
+
+int ASensorEventQueue_dump(ASensorEventQueue* queue, int fd) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    queue->dump(fd);
+    return OK;
+}
+
+ssize_t ASensorEventQueue_getEventsTimeout(
+        ASensorEventQueue* queue, ASensorEvent* events, size_t count, size_t minCount,
+        int64_t timeoutNs) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    return queue->getEventsTimeout(events, count, minCount, timeoutNs);
+}
+
 int ASensorEventQueue_requestAdditionalInfoEvents(ASensorEventQueue* queue, bool enable) {
     RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
     return queue->requestAdditionalInfoEvents(enable);
 }
 
+int ASensorEventQueue_setOverflowPolicy(ASensorEventQueue* queue, int policy) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    return queue->setOverflowPolicy(policy);
+}
+
+int64_t ASensorEventQueue_getOverflowCount(ASensorEventQueue* queue) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+    return queue->getOverflowCount();
+}
+
+int ASensorEventQueue_getStats(ASensorEventQueue* queue, ASensorEventQueueStats* stats) {
+    RETURN_IF_QUEUE_IS_NULL(BAD_VALUE);
+
+    if (stats == NULL) {
+        return BAD_VALUE;
+    }
+
+    queue->getStats(stats);
+    return OK;
+}
+
 const char *ASensor_getName(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(NULL);
-    return reinterpret_cast<const SensorInfo *>(sensor)->name.c_str();
+    return asSensorRecord(sensor)->name;
 }
 
 const char *ASensor_getVendor(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(NULL);
-    return reinterpret_cast<const SensorInfo *>(sensor)->vendor.c_str();
+    return asSensorRecord(sensor)->vendor;
 }
 
 int ASensor_getType(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_TYPE_INVALID);
-    return static_cast<int>(
-            reinterpret_cast<const SensorInfo *>(sensor)->type);
+    return asSensorRecord(sensor)->type;
 }
 
 float ASensor_getResolution(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_RESOLUTION_INVALID);
-    return reinterpret_cast<const SensorInfo *>(sensor)->resolution;
+    return asSensorRecord(sensor)->resolution;
 }
 
 int ASensor_getMinDelay(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_DELAY_INVALID);
-    return reinterpret_cast<const SensorInfo *>(sensor)->minDelay;
+    return asSensorRecord(sensor)->minDelay;
 }
 
 int ASensor_getFifoMaxEventCount(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_FIFO_COUNT_INVALID);
-    return reinterpret_cast<const SensorInfo *>(sensor)->fifoMaxEventCount;
+    return asSensorRecord(sensor)->fifoMaxEventCount;
 }
 
 int ASensor_getFifoReservedEventCount(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_FIFO_COUNT_INVALID);
-    return reinterpret_cast<const SensorInfo *>(sensor)->fifoReservedEventCount;
+    return asSensorRecord(sensor)->fifoReservedEventCount;
 }
 
 const char* ASensor_getStringType(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(NULL);
-    return reinterpret_cast<const SensorInfo *>(sensor)->typeAsString.c_str();
+    return asSensorRecord(sensor)->typeAsString;
 }
 
 extern "C" float ASensor_getMaxRange(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(nanf(""));
-    return reinterpret_cast<const SensorInfo *>(sensor)->maxRange;
+    return asSensorRecord(sensor)->maxRange;
 }
 
 int ASensor_getHandle(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_INVALID);
-    return reinterpret_cast<const SensorInfo*>(sensor)->sensorHandle;
+    return asSensorRecord(sensor)->sensorHandle;
 }
 
-#if 0
 int ASensor_getReportingMode(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(AREPORTING_MODE_INVALID);
-    return 0;
+    return (asSensorRecord(sensor)->flags
+            & static_cast<uint32_t>(SensorFlagBits::MASK_REPORTING_MODE))
+            >> static_cast<uint32_t>(SensorFlagShift::REPORTING_MODE);
 }
 
 bool ASensor_isWakeUpSensor(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(false);
-    return false;
+    return asSensorRecord(sensor)->flags & static_cast<uint32_t>(SensorFlagBits::WAKE_UP);
 }
 
 bool ASensor_isDirectChannelTypeSupported(
         ASensor const* sensor, int channelType) {
     RETURN_IF_SENSOR_IS_NULL(false);
-    return false;
+
+    // Only shared memory channels are bridged, see
+    // ASensorManager_createHardwareBufferDirectChannel.
+    if (channelType != ASENSOR_DIRECT_CHANNEL_TYPE_SHARED_MEMORY) {
+        return false;
+    }
+
+    return asSensorRecord(sensor)->flags
+            & static_cast<uint32_t>(SensorFlagBits::DIRECT_CHANNEL_ASHMEM);
 }
 
 int ASensor_getHighestDirectReportRateLevel(ASensor const* sensor) {
     RETURN_IF_SENSOR_IS_NULL(ASENSOR_DIRECT_RATE_STOP);
-    return 0;
-}
-#endif
-
-static ALooper *getTheLooper() {
-    static ALooper *sLooper = NULL;
-
-    Mutex::Autolock autoLock(gLock);
-    if (sLooper == NULL) {
-        sLooper = new ALooper;
-    }
-
-    return sLooper;
+    return (asSensorRecord(sensor)->flags
+            & static_cast<uint32_t>(SensorFlagBits::MASK_DIRECT_REPORT))
+            >> static_cast<uint32_t>(SensorFlagShift::DIRECT_REPORT);
 }
 
+// Loopers are per thread. The thread holds a strong reference to its looper
+// until it exits, event queues hold one to the looper they were created with.
+static thread_local sp<ALooper> tLooper;
 
 ALooper *ALooper_forThread() {
     LOG(VERBOSE) << "ALooper_forThread";
-    return getTheLooper();
+    return tLooper.get();
 }
 
-ALooper *ALooper_prepare(int /* opts */) {
+ALooper *ALooper_prepare(int opts) {
     LOG(VERBOSE) << "ALooper_prepare";
-    return getTheLooper();
+    bool allowNonCallbacks = opts & ALOOPER_PREPARE_ALLOW_NON_CALLBACKS;
+    if (tLooper == NULL) {
+        tLooper = new ALooper(allowNonCallbacks);
+    } else if (tLooper->getAllowNonCallbacks() != allowNonCallbacks) {
+        LOG(WARNING) << "ALooper_prepare: looper already prepared for this thread "
+                     << "with a different value for ALOOPER_PREPARE_ALLOW_NON_CALLBACKS";
+    }
+    return tLooper.get();
+}
+
+void ALooper_acquire(ALooper* looper) {
+    looper->incStrong(NULL /* id */);
+}
+
+void ALooper_release(ALooper* looper) {
+    looper->decStrong(NULL /* id */);
 }
 
 int ALooper_pollOnce(
         int timeoutMillis, int* outFd, int* outEvents, void** outData) {
-    int res = getTheLooper()->pollOnce(timeoutMillis, outFd, outEvents, outData);
+    if (tLooper == NULL) {
+        LOG(ERROR) << "ALooper_pollOnce called on a thread without a looper";
+        return ALOOPER_POLL_ERROR;
+    }
+
+    int res = tLooper->pollOnce(timeoutMillis, outFd, outEvents, outData);
     LOG(VERBOSE) << "ALooper_pollOnce => " << res;
     return res;
 }
@@ -458,3 +1205,20 @@ void ALooper_wake(ALooper* looper) {
     LOG(VERBOSE) << "ALooper_wake";
     looper->wake();
 }
+
+int ALooper_addFd(ALooper* looper, int fd, int ident, int events,
+        ALooper_callbackFunc callback, void* data) {
+    LOG(VERBOSE) << "ALooper_addFd(" << fd << ")";
+    if (looper == NULL) {
+        return -1;
+    }
+    return looper->addFd(fd, ident, events, callback, data);
+}
+
+int ALooper_removeFd(ALooper* looper, int fd) {
+    LOG(VERBOSE) << "ALooper_removeFd(" << fd << ")";
+    if (looper == NULL) {
+        return -1;
+    }
+    return looper->removeFd(fd);
+}
@@ -18,18 +18,40 @@
 
 #define A_SENSOR_MANAGER_H_
 
+#include "SensorCatalog.h"
+
 #include <android-base/macros.h>
-#include <android/frameworks/sensorservice/1.0/ISensorManager.h>
+#include <android/frameworks/sensorservice/1.1/ISensorManager.h>
 #include <android/sensor.h>
+#include <sensorndkbridge/sensor_bridge.h>
+#include <utils/Condition.h>
 #include <utils/Mutex.h>
 #include <utils/RefBase.h>
+#include <utils/Timers.h>
+
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 struct ALooper;
 
 struct ASensorManager {
+    using ISensorManager = android::frameworks::sensorservice::V1_0::ISensorManager;
+    using ISensorManager_1_1 = android::frameworks::sensorservice::V1_1::ISensorManager;
+
+    // Looks up the sensor service, called again to reconnect after it died.
+    // Returns NULL if it isn't available (yet).
+    using ServiceGetter = std::function<android::sp<ISensorManager>()>;
+
     static ASensorManager *getInstance();
 
     ASensorManager();
+    // An empty getter means ISensorManager::getService.
+    explicit ASensorManager(
+            const android::sp<ISensorManager> &manager, ServiceGetter getter = ServiceGetter());
+    ~ASensorManager();
     android::status_t initCheck() const;
 
     // Returns error or number of sensors returned.
@@ -38,37 +60,138 @@ struct ASensorManager {
     ASensorRef getDefaultSensor(int type);
     ASensorRef getDefaultSensorEx(int type, bool wakeup);
 
+    // Returns NULL if there is no sensor with this handle.
+    ASensorRef getSensorByHandle(int32_t handle);
+
+    // A negative maxDeliveryLatencyUs creates a queue receiving one event per
+    // callback even if the service can deliver batches. A NULL scheduling
+    // means SCHED_FIFO at priority 98 for callbacks.
     ASensorEventQueue *createEventQueue(
             ALooper *looper,
             int ident,
             ALooper_callbackFunc callback,
-            void *data);
+            void *data,
+            int64_t maxDeliveryLatencyUs = 0,
+            const ASensorEventQueueScheduling *scheduling = NULL);
 
-    // This must not be called from inside ALooper_callbackFunc to avoid deadlocking inside of the
-    // ALooper.
     void destroyEventQueue(ASensorEventQueue *queue);
 
+    // Records what queue receives to a new trace at path, with the sensor list
+    // in its header. Returns error or OK.
+    int startRecording(ASensorEventQueue *queue, const char *path, size_t maxEvents);
+
+    // Returns error or a positive channel id.
+    int createSharedMemoryDirectChannel(int fd, size_t size);
+    void destroyDirectChannel(int channelId);
+
+    // Returns error, a positive report token or 0 when stopping.
+    int configureDirectReport(ASensorRef sensor, int channelId, int rate);
+
+    // Called when the service dies. Reconnects in the background: event
+    // queues are connected to the new service and their sensors enabled
+    // again. Sensor references stay valid, the sensor list isn't fetched
+    // again. Direct channels are not restored.
+    void onServiceDied();
+
+    void getReconnectStats(ASensorManagerReconnectStats *stats) const;
+
 private:
+    // How each live queue was connected, to connect it again the same way.
+    struct EventQueueInfo {
+        bool usesEventQueue;
+        size_t capacity;
+        int64_t maxDeliveryLatencyUs;
+        ASensorEventQueueScheduling scheduling;
+        // mReconnectStats.serviceDeaths when the queue was last connected.
+        // The queue is connected to the current service if it still matches.
+        uint32_t serviceDeaths;
+    };
+
+    // Fetches the sensor list from the service into mCatalog and indexes
+    // it, unless that was already done. The list doesn't change afterwards.
+    void fetchSensorListLocked();
+
+    static uint64_t getDefaultSensorKey(int type, bool wakeup);
+
+    // Capacity of the event ring of newly created queues.
+    size_t getEventQueueCapacity();
+
+    void getManagers(android::sp<ISensorManager> *manager,
+                     android::sp<ISensorManager_1_1> *manager_1_1) const;
+
+    // Connects queue to the service, replacing its previous connection if
+    // any. A queue using shared memory falls back to callbacks if the
+    // service can't give it a message queue, which clears
+    // info->usesEventQueue for good.
+    bool connectEventQueue(
+            const android::sp<ASensorEventQueue> &queue,
+            EventQueueInfo *info,
+            const android::sp<ISensorManager> &manager,
+            const android::sp<ISensorManager_1_1> &manager_1_1);
+    // Shared memory queues need a service supporting @1.1.
+    bool connectFmqEventQueue(
+            const android::sp<ASensorEventQueue> &queue,
+            const EventQueueInfo &info,
+            const android::sp<ISensorManager_1_1> &manager_1_1);
+    bool connectCallbackEventQueue(
+            const android::sp<ASensorEventQueue> &queue,
+            const EventQueueInfo &info,
+            const android::sp<ISensorManager> &manager,
+            const android::sp<ISensorManager_1_1> &manager_1_1);
+
+    // Starts watching manager for death. Returns false if it can't be
+    // watched, in which case there is no point in using it.
+    bool linkToDeath(const android::sp<ISensorManager> &manager);
+
+    void reconnectThreadLoop();
+    bool reconnect();
 
     struct SensorDeathRecipient : public android::hardware::hidl_death_recipient
     {
+        explicit SensorDeathRecipient(ASensorManager *manager) : mManager(manager) {}
+
         // hidl_death_recipient interface
         virtual void serviceDied(uint64_t cookie,
                 const ::android::wp<::android::hidl::base::V1_0::IBase>& who) override;
+
+    private:
+        ASensorManager *mManager;
     };
 
-    using ISensorManager = android::frameworks::sensorservice::V1_0::ISensorManager;
-    using SensorInfo = android::hardware::sensors::V1_0::SensorInfo;
+    using IDirectReportChannel = android::frameworks::sensorservice::V1_0::IDirectReportChannel;
 
     static ASensorManager *sInstance;
     android::sp<SensorDeathRecipient> mDeathRecipient = nullptr;
 
     android::status_t mInitCheck;
-    android::sp<ISensorManager> mManager;
+    const ServiceGetter mServiceGetter;
 
     mutable android::Mutex mLock;
-    android::hardware::hidl_vec<SensorInfo> mSensors;
-    std::unique_ptr<ASensorRef[]> mSensorList;
+    android::sp<ISensorManager> mManager;  // guarded by mLock
+    // Non-NULL if the service supports batched event delivery.
+    android::sp<ISensorManager_1_1> mManager_1_1;  // guarded by mLock
+    // NULL until the sensor list was fetched. Sensor references point into
+    // it, so it is kept for as long as the manager lives.
+    std::unique_ptr<SensorCatalog> mCatalog;
+    std::unordered_map<int32_t, ASensorRef> mSensorsByHandle;
+    // First sensor of the list for each type and wake-up flag.
+    std::unordered_map<uint64_t, ASensorRef> mDefaultSensors;
+
+    std::unordered_map<int, android::sp<IDirectReportChannel>> mDirectChannels;
+    int mNextDirectChannelId;
+
+    // Queues handed out and not destroyed yet. Each holds a strong reference
+    // to itself until it is destroyed, so the pointers are valid while the
+    // queues are in here.
+    std::unordered_map<ASensorEventQueue *, EventQueueInfo> mEventQueues;
+
+    // Reconnection state, guarded by mLock.
+    std::thread mReconnectThread;
+    android::Condition mReconnectCondition;
+    bool mConnected;
+    bool mStopReconnectThread;
+    nsecs_t mServiceDiedTime;
+    ASensorManagerReconnectStats mReconnectStats;
 
     DISALLOW_COPY_AND_ASSIGN(ASensorManager);
 };
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventConversion.h"
+
+#include <sensors/convert.h>
+#include <string.h>
+
+#include <array>
+#include <utility>
+
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorType;
+
+namespace {
+
+// How the payload of a type is laid out, both in Event::u and in the union of
+// sensors_event_t.
+enum class Payload {
+    NONE,  // left to convertToSensorEvent
+    VEC3,
+    VEC4,
+    DATA5,
+    UNCAL,
+    SCALAR,
+    STEP_COUNT,
+    HEART_RATE,
+    POSE_6DOF,
+};
+
+constexpr Payload payloadOf(SensorType type) {
+    switch (type) {
+        case SensorType::ACCELEROMETER:
+        case SensorType::MAGNETIC_FIELD:
+        case SensorType::ORIENTATION:
+        case SensorType::GYROSCOPE:
+        case SensorType::GRAVITY:
+        case SensorType::LINEAR_ACCELERATION:
+            return Payload::VEC3;
+
+        case SensorType::GAME_ROTATION_VECTOR:
+            return Payload::VEC4;
+
+        case SensorType::ROTATION_VECTOR:
+        case SensorType::GEOMAGNETIC_ROTATION_VECTOR:
+            return Payload::DATA5;
+
+        case SensorType::MAGNETIC_FIELD_UNCALIBRATED:
+        case SensorType::GYROSCOPE_UNCALIBRATED:
+        case SensorType::ACCELEROMETER_UNCALIBRATED:
+            return Payload::UNCAL;
+
+        case SensorType::DEVICE_ORIENTATION:
+        case SensorType::LIGHT:
+        case SensorType::PRESSURE:
+        case SensorType::TEMPERATURE:
+        case SensorType::PROXIMITY:
+        case SensorType::RELATIVE_HUMIDITY:
+        case SensorType::AMBIENT_TEMPERATURE:
+        case SensorType::SIGNIFICANT_MOTION:
+        case SensorType::STEP_DETECTOR:
+        case SensorType::TILT_DETECTOR:
+        case SensorType::WAKE_GESTURE:
+        case SensorType::GLANCE_GESTURE:
+        case SensorType::PICK_UP_GESTURE:
+        case SensorType::WRIST_TILT_GESTURE:
+        case SensorType::STATIONARY_DETECT:
+        case SensorType::MOTION_DETECT:
+        case SensorType::HEART_BEAT:
+        case SensorType::LOW_LATENCY_OFFBODY_DETECT:
+            return Payload::SCALAR;
+
+        case SensorType::STEP_COUNTER:
+            return Payload::STEP_COUNT;
+
+        case SensorType::HEART_RATE:
+            return Payload::HEART_RATE;
+
+        case SensorType::POSE_6DOF:
+            return Payload::POSE_6DOF;
+
+        default:
+            return Payload::NONE;
+    }
+}
+
+template <Payload P>
+struct PayloadConverter;
+
+// x, y and z are contiguous on both sides, the status byte is not copied
+// along with them so the reserved bytes after it are left alone.
+template <>
+struct PayloadConverter<Payload::VEC3> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        memcpy(dst->data, &src.u.vec3, 3 * sizeof(float));
+        dst->acceleration.status = static_cast<int8_t>(src.u.vec3.status);
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::VEC4> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        memcpy(dst->data, &src.u.vec4, 4 * sizeof(float));
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::DATA5> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        memcpy(dst->data, src.u.data.data(), 5 * sizeof(float));
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::UNCAL> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        memcpy(dst->data, &src.u.uncal, 6 * sizeof(float));
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::SCALAR> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        dst->data[0] = src.u.scalar;
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::STEP_COUNT> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        dst->u64.step_counter = src.u.stepCount;
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::HEART_RATE> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        dst->heart_rate.bpm = src.u.heartRate.bpm;
+        dst->heart_rate.status = static_cast<int8_t>(src.u.heartRate.status);
+    }
+};
+
+template <>
+struct PayloadConverter<Payload::POSE_6DOF> {
+    static void convert(const Event &src, sensors_event_t *dst) {
+        memcpy(dst->data, src.u.pose6DOF.data(), 15 * sizeof(float));
+    }
+};
+
+// Converts a run of events of one type.
+using RunConverter = void (*)(const Event *src, size_t count, sensors_event_t *dst);
+
+template <Payload P>
+void convertRun(const Event *src, size_t count, sensors_event_t *dst) {
+    for (size_t i = 0; i < count; ++i) {
+        // convertToSensorEvent assigns the whole event, leaving the payload
+        // zero past the fields of the type; stale bytes of a reused ring slot
+        // mustn't reach the client either.
+        memset(&dst[i], 0, sizeof(sensors_event_t));
+        dst[i].version = sizeof(sensors_event_t);
+        dst[i].sensor = src[i].sensorHandle;
+        dst[i].type = static_cast<int32_t>(src[i].sensorType);
+        dst[i].timestamp = src[i].timestamp;
+
+        PayloadConverter<P>::convert(src[i], &dst[i]);
+    }
+}
+
+void convertRunSlow(const Event *src, size_t count, sensors_event_t *dst) {
+    for (size_t i = 0; i < count; ++i) {
+        android::hardware::sensors::V1_0::implementation::convertToSensorEvent(src[i], &dst[i]);
+    }
+}
+
+template <Payload P>
+constexpr RunConverter runConverterFor() {
+    return &convertRun<P>;
+}
+
+template <>
+constexpr RunConverter runConverterFor<Payload::NONE>() {
+    return &convertRunSlow;
+}
+
+// Covers all the types defined by sensors@1.0 below DEVICE_PRIVATE_BASE.
+constexpr size_t kTableSize = static_cast<size_t>(SensorType::ACCELEROMETER_UNCALIBRATED) + 1;
+
+template <size_t... I>
+constexpr std::array<RunConverter, sizeof...(I)> makeTable(std::index_sequence<I...>) {
+    return {{runConverterFor<payloadOf(static_cast<SensorType>(I))>()...}};
+}
+
+constexpr std::array<RunConverter, kTableSize> kRunConverters =
+        makeTable(std::make_index_sequence<kTableSize>());
+
+RunConverter runConverterOf(SensorType type) {
+    uint32_t index = static_cast<uint32_t>(type);
+    return index < kTableSize ? kRunConverters[index] : &convertRunSlow;
+}
+
+}  // namespace
+
+void convertSensorEvent(const Event &src, sensors_event_t *dst) {
+    runConverterOf(src.sensorType)(&src, 1, dst);
+}
+
+void convertSensorEvents(const Event *src, size_t count, sensors_event_t *dst) {
+    size_t i = 0;
+    while (i < count) {
+        SensorType type = src[i].sensorType;
+        size_t end = i + 1;
+        while (end < count && src[end].sensorType == type) {
+            ++end;
+        }
+        runConverterOf(type)(&src[i], end - i, &dst[i]);
+        i = end;
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EVENT_CONVERSION_H_
+
+#define EVENT_CONVERSION_H_
+
+#include <android/hardware/sensors/1.0/types.h>
+#include <hardware/sensors.h>
+
+#include <stddef.h>
+
+// Conversion of HIDL sensor events to sensors_event_t, with the same result
+// as convertToSensorEvent from android.hardware.sensors@1.0-convert.
+//
+// convertToSensorEvent switches on the type of every event and copies the
+// payload field by field. Here the conversion of each type is instantiated
+// at compile time from the layout of its payload and looked up in a table
+// indexed by type. Runs of consecutive events of the same type, the common
+// case in a batch, are converted by a single loop of fixed-size copies that
+// the compiler can vectorize. Rare types (meta data, dynamic sensors,
+// additional info and device private types) go through convertToSensorEvent.
+
+void convertSensorEvent(const android::hardware::sensors::V1_0::Event &src,
+                        sensors_event_t *dst);
+
+// Converts count events from src into dst, which must not overlap.
+void convertSensorEvents(const android::hardware::sensors::V1_0::Event *src, size_t count,
+                         sensors_event_t *dst);
+
+#endif  // EVENT_CONVERSION_H_
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventDecimator.h"
+
+#include <android/sensor.h>
+
+using android::BAD_VALUE;
+using android::OK;
+
+size_t EventDecimator::getAveragedChannels(int32_t sensorType) {
+    switch (sensorType) {
+        case ASENSOR_TYPE_ACCELEROMETER:
+        case ASENSOR_TYPE_MAGNETIC_FIELD:
+        case ASENSOR_TYPE_GYROSCOPE:
+        case ASENSOR_TYPE_GRAVITY:
+        case ASENSOR_TYPE_LINEAR_ACCELERATION:
+            return 3;
+        case ASENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED:
+        case ASENSOR_TYPE_GYROSCOPE_UNCALIBRATED:
+        case ASENSOR_TYPE_ACCELEROMETER_UNCALIBRATED:
+            return 6;
+        case ASENSOR_TYPE_LIGHT:
+        case ASENSOR_TYPE_PRESSURE:
+        case ASENSOR_TYPE_RELATIVE_HUMIDITY:
+        case ASENSOR_TYPE_AMBIENT_TEMPERATURE:
+            return 1;
+        default:
+            // Orientations don't average component-wise, the rest are
+            // integers, flags or events.
+            return 0;
+    }
+}
+
+android::status_t EventDecimator::setMode(
+        int32_t sensorHandle, int32_t sensorType, Mode mode, uint32_t factor) {
+    if (mode == NONE) {
+        auto it = mSensors.find(sensorHandle);
+        if (it != mSensors.end()) {
+            // The event kept back goes along with the mode that kept it,
+            // unless taken before.
+            mHeldCount -= it->second.held ? 1 : 0;
+            mSensors.erase(it);
+        }
+        return OK;
+    }
+
+    if ((mode == KEEP_NTH || mode == AVERAGE) && factor < 1) {
+        return BAD_VALUE;
+    }
+
+    State state = {};
+    state.sensorType = sensorType;
+    state.mode = mode;
+    state.factor = factor;
+    if (mode == AVERAGE) {
+        state.channels = getAveragedChannels(sensorType);
+        if (state.channels == 0) {
+            return BAD_VALUE;
+        }
+    }
+
+    State &current = mSensors[sensorHandle];
+    if (current.held && mode == LATEST) {
+        state.held = true;
+        state.heldEvent = current.heldEvent;
+    } else if (current.held) {
+        --mHeldCount;
+    }
+    current = state;
+    return OK;
+}
+
+EventDecimator::State *EventDecimator::findState(const Event &event) {
+    auto it = mSensors.find(event.sensorHandle);
+    if (it == mSensors.end()
+            || it->second.sensorType != static_cast<int32_t>(event.sensorType)) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+void EventDecimator::scan(const Event &event, size_t index) {
+    State *state = findState(event);
+    if (state != NULL && state->mode == LATEST) {
+        state->latestIndex = index;
+    }
+}
+
+const EventDecimator::Event *EventDecimator::process(const Event &event, size_t index) {
+    State *found = findState(event);
+    if (found == NULL) {
+        return &event;
+    }
+
+    State &state = *found;
+    switch (state.mode) {
+        case KEEP_NTH: {
+            bool keep = state.count == 0;
+            state.count = (state.count + 1) % state.factor;
+            return keep ? &event : NULL;
+        }
+
+        case AVERAGE: {
+            // Plain loops over contiguous floats, which the compiler
+            // vectorizes.
+            const float *values = &event.u.data[0];
+            for (size_t i = 0; i < state.channels; ++i) {
+                state.sums[i] += values[i];
+            }
+            if (++state.count < state.factor) {
+                return NULL;
+            }
+
+            state.averaged = event;
+            float *averaged = &state.averaged.u.data[0];
+            float scale = 1.0f / state.factor;
+            for (size_t i = 0; i < state.channels; ++i) {
+                averaged[i] = state.sums[i] * scale;
+                state.sums[i] = 0.0f;
+            }
+            state.count = 0;
+            return &state.averaged;
+        }
+
+        case LATEST:
+            return index == state.latestIndex ? &event : NULL;
+
+        case NONE:
+            break;
+    }
+
+    return &event;
+}
+
+bool EventDecimator::hold(const Event &event, bool *replaced) {
+    State *state = findState(event);
+    if (state == NULL || state->mode != LATEST) {
+        return false;
+    }
+
+    *replaced = state->held;
+    if (!state->held) {
+        state->held = true;
+        ++mHeldCount;
+    }
+    state->heldEvent = event;
+    return true;
+}
+
+const EventDecimator::Event *EventDecimator::takeHeld() {
+    State *oldest = NULL;
+    for (auto &entry : mSensors) {
+        State &state = entry.second;
+        if (state.held
+                && (oldest == NULL || state.heldEvent.timestamp < oldest->heldEvent.timestamp)) {
+            oldest = &state;
+        }
+    }
+    if (oldest == NULL) {
+        return NULL;
+    }
+
+    oldest->held = false;
+    --mHeldCount;
+    return &oldest->heldEvent;
+}
+
+const EventDecimator::Event *EventDecimator::takeHeld(int32_t sensorHandle) {
+    auto it = mSensors.find(sensorHandle);
+    if (it == mSensors.end() || !it->second.held) {
+        return NULL;
+    }
+
+    it->second.held = false;
+    --mHeldCount;
+    return &it->second.heldEvent;
+}
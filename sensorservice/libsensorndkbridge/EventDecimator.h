@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EVENT_DECIMATOR_H_
+
+#define EVENT_DECIMATOR_H_
+
+#include <android/hardware/sensors/1.0/types.h>
+#include <android-base/macros.h>
+#include <utils/Errors.h>
+
+#include <unordered_map>
+
+// Thins out the events of sensors that arrive faster than the client of a
+// queue wants them, before they are converted and copied into the queue.
+//
+// Works on the events as the service delivers them, one batch at a time: an
+// onEvents call or one read of the shared memory queue. Not thread safe, the
+// owning queue serializes access.
+struct EventDecimator {
+    using Event = android::hardware::sensors::V1_0::Event;
+
+    enum Mode {
+        NONE,
+        // The first event out of every factor events.
+        KEEP_NTH,
+        // Every factor events, the last one with its values averaged over all
+        // of them. Only for sensors with continuous float values.
+        AVERAGE,
+        // The newest event of each batch. Where batches are whatever arrived
+        // since the last read anyway, as with the shared memory queue, that
+        // is the newest event since the client last read. Otherwise the
+        // owner also hold()s the event until the client reads it.
+        LATEST,
+    };
+
+    EventDecimator() = default;
+
+    // Returns BAD_VALUE if mode isn't supported for sensors of this type.
+    android::status_t setMode(int32_t sensorHandle, int32_t sensorType, Mode mode,
+                              uint32_t factor);
+
+    bool empty() const { return mSensors.empty(); }
+
+    // Called for each event of a batch, in order, before process.
+    void scan(const Event &event, size_t index);
+
+    // Returns the event to deliver instead of the index-th event of the
+    // batch, or NULL to drop it. The returned event is valid until the next
+    // call.
+    const Event *process(const Event &event, size_t index);
+
+    // Keeps event, as returned by process, back instead of delivering it if
+    // its sensor is decimated with LATEST, replacing the one kept before.
+    // Returns false if it isn't. *replaced tells whether an older event was
+    // dropped to make room.
+    bool hold(const Event &event, bool *replaced);
+    // Returns the oldest event kept back and forgets it, or NULL if there is
+    // none. The returned event is valid until the next call to hold.
+    const Event *takeHeld();
+    // Same for the event kept back for sensorHandle only.
+    const Event *takeHeld(int32_t sensorHandle);
+    size_t heldCount() const { return mHeldCount; }
+
+private:
+    static constexpr size_t kMaxChannels = 16;
+
+    struct State {
+        // Other events of the sensor, such as additional info, go through.
+        int32_t sensorType;
+        Mode mode;
+        uint32_t factor;
+        uint32_t count;
+        // AVERAGE: number of values averaged, and their sums so far.
+        size_t channels;
+        float sums[kMaxChannels];
+        Event averaged;
+        // LATEST: index of the newest event in the current batch, and the
+        // event kept back for the client, if held.
+        size_t latestIndex;
+        bool held;
+        Event heldEvent;
+    };
+
+    // Returns NULL if event isn't decimated.
+    State *findState(const Event &event);
+
+    // Number of leading float values in the payload of events of sensorType
+    // that can be averaged, 0 if it can't.
+    static size_t getAveragedChannels(int32_t sensorType);
+
+    std::unordered_map<int32_t, State> mSensors;
+    size_t mHeldCount = 0;
+
+    DISALLOW_COPY_AND_ASSIGN(EventDecimator);
+};
+
+#endif  // EVENT_DECIMATOR_H_
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventQueueStats.h"
+
+#include <android-base/stringprintf.h>
+#include <inttypes.h>
+
+using android::hardware::sensors::V1_0::SensorType;
+
+EventQueueStats::EventQueueStats()
+    : mReceived(0),
+      mDelivered(0),
+      mDecimated(0),
+      mFiltered(0),
+      mMaxDepth(0),
+      mGaps(0),
+      mMissedSamples(0) {}
+
+void EventQueueStats::setSamplingPeriod(int32_t sensorHandle, int64_t periodNs) {
+    Slot *slot = mSlots.find(sensorHandle, periodNs > 0 /* create */);
+    if (slot == NULL) {
+        return;
+    }
+    slot->periodNs.store(periodNs, std::memory_order_relaxed);
+    slot->lastTimestampNs.store(0, std::memory_order_relaxed);
+}
+
+void EventQueueStats::checkTimestamp(Slot *slot, int64_t timestampNs) {
+    int64_t periodNs = slot->periodNs.load(std::memory_order_relaxed);
+    if (periodNs <= 0) {
+        return;
+    }
+
+    int64_t lastNs = slot->lastTimestampNs.exchange(timestampNs, std::memory_order_relaxed);
+    // Some slack for jitter: only an event that is at least a whole period
+    // late counts, as the sample before it went missing.
+    if (lastNs == 0 || timestampNs - lastNs < 2 * periodNs) {
+        return;
+    }
+
+    uint64_t missed = (timestampNs - lastNs + periodNs / 2) / periodNs - 1;
+    slot->gaps.fetch_add(1, std::memory_order_relaxed);
+    slot->missedSamples.fetch_add(missed, std::memory_order_relaxed);
+    mGaps.fetch_add(1, std::memory_order_relaxed);
+    mMissedSamples.fetch_add(missed, std::memory_order_relaxed);
+}
+
+void EventQueueStats::onReceived(const Event *events, size_t count) {
+    mReceived.fetch_add(count, std::memory_order_relaxed);
+
+    // Batches mostly hold runs of events of the same sensor, look its slot
+    // up once per run.
+    int64_t slotHandle = INT64_MIN;  // not a sensor handle
+    Slot *slot = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        const Event &event = events[i];
+        if (event.sensorType == SensorType::META_DATA
+                || event.sensorType == SensorType::ADDITIONAL_INFO) {
+            continue;
+        }
+        if (event.sensorHandle != slotHandle) {
+            slotHandle = event.sensorHandle;
+            slot = mSlots.find(event.sensorHandle, false /* create */);
+        }
+        if (slot != NULL) {
+            checkTimestamp(slot, event.timestamp);
+        }
+    }
+}
+
+void EventQueueStats::onDecimated(size_t count) {
+    mDecimated.fetch_add(count, std::memory_order_relaxed);
+}
+
+void EventQueueStats::onFiltered(size_t count) {
+    mFiltered.fetch_add(count, std::memory_order_relaxed);
+}
+
+void EventQueueStats::onQueued(size_t depth) {
+    uint64_t maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+    while (depth > maxDepth
+            && !mMaxDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed)) {
+    }
+}
+
+void EventQueueStats::onDelivered(size_t count) {
+    mDelivered.fetch_add(count, std::memory_order_relaxed);
+}
+
+void EventQueueStats::getStats(ASensorEventQueueStats *stats) const {
+    stats->received = mReceived.load(std::memory_order_relaxed);
+    stats->delivered = mDelivered.load(std::memory_order_relaxed);
+    stats->overflowed = 0;
+    stats->decimated = mDecimated.load(std::memory_order_relaxed);
+    stats->filtered = mFiltered.load(std::memory_order_relaxed);
+    stats->gaps = mGaps.load(std::memory_order_relaxed);
+    stats->missedSamples = mMissedSamples.load(std::memory_order_relaxed);
+    stats->maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+}
+
+void EventQueueStats::dump(uint64_t overflowed, std::string *out) const {
+    ASensorEventQueueStats stats;
+    getStats(&stats);
+    *out += android::base::StringPrintf(
+            "  events received %" PRIu64 " delivered %" PRIu64 " overflowed %" PRIu64
+            " decimated %" PRIu64 " filtered %" PRIu64 ", max depth %" PRIu64 "\n",
+            stats.received, stats.delivered, overflowed, stats.decimated, stats.filtered,
+            stats.maxDepth);
+
+    mSlots.forEach([out](int32_t sensorHandle, const Slot &slot) {
+        uint64_t gaps = slot.gaps.load(std::memory_order_relaxed);
+        if (gaps == 0) {
+            return;
+        }
+        *out += android::base::StringPrintf(
+                "  gaps of 0x%08x: %" PRIu64 ", %" PRIu64 " samples missed\n",
+                static_cast<uint32_t>(sensorHandle), gaps,
+                slot.missedSamples.load(std::memory_order_relaxed));
+    });
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EVENT_QUEUE_STATS_H_
+
+#define EVENT_QUEUE_STATS_H_
+
+#include "SensorSlotTable.h"
+
+#include <android/hardware/sensors/1.0/types.h>
+#include <android-base/macros.h>
+#include <sensorndkbridge/sensor_bridge.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// Accounting of where the events of one queue went: how many arrived, were
+// dropped by decimation or filtered out, reached the client, and how deep
+// the queue got.
+// Gaps in the timestamps of continuous sensors tell events lost upstream,
+// before they reached the queue, from those the queue dropped itself.
+//
+// Everything is relaxed atomic counters, updated by the producers and the
+// consumer without a lock. Sensors get a slot for gap detection in a
+// SensorSlotTable when their sampling period is first set; sensors beyond
+// kMaxSensors are not checked for gaps.
+struct EventQueueStats {
+    using Event = android::hardware::sensors::V1_0::Event;
+
+    static constexpr size_t kMaxSensors = 16;
+
+    EventQueueStats();
+
+    // Period at which the queue expects events of the sensor, 0 to stop
+    // checking it for gaps. Checking starts over from the next event.
+    void setSamplingPeriod(int32_t sensorHandle, int64_t periodNs);
+
+    // Called with each batch of events the service delivers, before
+    // anything is filtered out.
+    void onReceived(const Event *events, size_t count);
+    void onDecimated(size_t count);
+    // Called with the number of additional info events ignored because the
+    // client didn't ask for them.
+    void onFiltered(size_t count);
+    // Called after writing to the queue with the number of events pending.
+    void onQueued(size_t depth);
+    void onDelivered(size_t count);
+
+    // Fills in everything but overflowed, which the queue keeps itself.
+    void getStats(ASensorEventQueueStats *stats) const;
+
+    // Appends the counts, with the given overflow count, and a line per
+    // sensor with gaps to out.
+    void dump(uint64_t overflowed, std::string *out) const;
+
+private:
+    struct Slot {
+        Slot() : periodNs(0), lastTimestampNs(0), gaps(0), missedSamples(0) {}
+
+        std::atomic<int64_t> periodNs;
+        // 0 until the first event after the period was set.
+        std::atomic<int64_t> lastTimestampNs;
+        std::atomic<uint64_t> gaps;
+        std::atomic<uint64_t> missedSamples;
+    };
+
+    // Checks the timestamp of the next event of the sensor of slot against
+    // the one before.
+    void checkTimestamp(Slot *slot, int64_t timestampNs);
+
+    std::atomic<uint64_t> mReceived;
+    std::atomic<uint64_t> mDelivered;
+    std::atomic<uint64_t> mDecimated;
+    std::atomic<uint64_t> mFiltered;
+    std::atomic<uint64_t> mMaxDepth;
+    std::atomic<uint64_t> mGaps;
+    std::atomic<uint64_t> mMissedSamples;
+
+    SensorSlotTable<Slot, kMaxSensors> mSlots;
+
+    DISALLOW_COPY_AND_ASSIGN(EventQueueStats);
+};
+
+#endif  // EVENT_QUEUE_STATS_H_
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LatencyStats.h"
+
+#include <android-base/stringprintf.h>
+#include <inttypes.h>
+
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::reset() {
+    for (auto &count : mCounts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    mCount.store(0, std::memory_order_relaxed);
+    mSumNs.store(0, std::memory_order_relaxed);
+    mMaxNs.store(0, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::getBucket(uint64_t value) {
+    if (value < kSubBuckets) {
+        return value;
+    }
+    value = std::min<uint64_t>(value, kMaxValueNs);
+
+    // The top kSubBucketBits bits below the leading one pick the bucket
+    // within the power of two.
+    int exponent = 63 - __builtin_clzll(value);
+    size_t subBucket = (value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+    return (exponent - kSubBucketBits + 1) * kSubBuckets + subBucket;
+}
+
+int64_t LatencyHistogram::getBucketValue(size_t bucket) {
+    if (bucket < kSubBuckets) {
+        return bucket;
+    }
+
+    int exponent = bucket / kSubBuckets + kSubBucketBits - 1;
+    int shift = exponent - kSubBucketBits;
+    int64_t lowest = static_cast<int64_t>(kSubBuckets + bucket % kSubBuckets) << shift;
+    return lowest + (int64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t valueNs) {
+    // Clocks of different components may be slightly off.
+    valueNs = std::max<int64_t>(valueNs, 0);
+
+    mCounts[getBucket(valueNs)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    mSumNs.fetch_add(valueNs, std::memory_order_relaxed);
+
+    int64_t max = mMaxNs.load(std::memory_order_relaxed);
+    while (valueNs > max
+            && !mMaxNs.compare_exchange_weak(max, valueNs, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::getSummary(ASensorLatencySummary *summary) const {
+    uint64_t counts[kBucketCount];
+    uint64_t total = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        counts[i] = mCounts[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+
+    int64_t max = mMaxNs.load(std::memory_order_relaxed);
+    uint64_t count = mCount.load(std::memory_order_relaxed);
+
+    summary->count = total;
+    summary->meanNs = count > 0 ? mSumNs.load(std::memory_order_relaxed) / count : 0;
+    summary->maxNs = max;
+
+    // Percentiles from the one snapshot of the buckets, so that they are
+    // consistent with each other.
+    struct {
+        uint32_t perMille;
+        int64_t *valueNs;
+    } percentiles[] = {
+        {500, &summary->p50Ns},
+        {900, &summary->p90Ns},
+        {990, &summary->p99Ns},
+    };
+
+    size_t bucket = 0;
+    uint64_t seen = 0;
+    for (auto &percentile : percentiles) {
+        uint64_t rank = (total * percentile.perMille + 999) / 1000;
+        while (bucket < kBucketCount && seen + counts[bucket] < std::max<uint64_t>(rank, 1)) {
+            seen += counts[bucket++];
+        }
+        *percentile.valueNs =
+                total > 0 ? std::min(getBucketValue(std::min(bucket, kBucketCount - 1)), max) : 0;
+    }
+}
+
+SensorLatencyStats::SensorLatencyStats() {}
+
+void SensorLatencyStats::recordArrival(int32_t sensorHandle, int64_t latencyNs) {
+    Slot *slot = mSlots.find(sensorHandle, true /* create */);
+    if (slot != NULL) {
+        slot->arrival.record(latencyNs);
+    }
+}
+
+void SensorLatencyStats::recordDrain(int32_t sensorHandle, int64_t latencyNs) {
+    Slot *slot = mSlots.find(sensorHandle, true /* create */);
+    if (slot != NULL) {
+        slot->drain.record(latencyNs);
+    }
+}
+
+bool SensorLatencyStats::getSummaries(
+        int32_t sensorHandle, ASensorLatencySummary *arrival,
+        ASensorLatencySummary *drain) const {
+    const Slot *slot = mSlots.find(sensorHandle);
+    if (slot == NULL) {
+        return false;
+    }
+    if (arrival != NULL) {
+        slot->arrival.getSummary(arrival);
+    }
+    if (drain != NULL) {
+        slot->drain.getSummary(drain);
+    }
+    return true;
+}
+
+void SensorLatencyStats::reset() {
+    mSlots.forEach([](int32_t /* sensorHandle */, Slot &slot) {
+        slot.arrival.reset();
+        slot.drain.reset();
+    });
+}
+
+static void appendSummary(std::string *out, const char *name,
+                          const ASensorLatencySummary &summary) {
+    *out += android::base::StringPrintf(
+            "    %-7s n %" PRIu64 " mean %" PRId64 " p50 %" PRId64 " p90 %" PRId64
+            " p99 %" PRId64 " max %" PRId64 " ns\n",
+            name, summary.count, summary.meanNs, summary.p50Ns, summary.p90Ns, summary.p99Ns,
+            summary.maxNs);
+}
+
+void SensorLatencyStats::dump(std::string *out) const {
+    mSlots.forEach([out](int32_t sensorHandle, const Slot &slot) {
+        ASensorLatencySummary summary;
+        *out += android::base::StringPrintf("  latency of 0x%08x\n",
+                                            static_cast<uint32_t>(sensorHandle));
+        slot.arrival.getSummary(&summary);
+        appendSummary(out, "arrival", summary);
+        slot.drain.getSummary(&summary);
+        appendSummary(out, "drain", summary);
+    });
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LATENCY_STATS_H_
+
+#define LATENCY_STATS_H_
+
+#include "SensorSlotTable.h"
+
+#include <android-base/macros.h>
+#include <sensorndkbridge/sensor_bridge.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// Histogram of latencies in nanoseconds with log-linear buckets, like
+// HdrHistogram: each power of two is split into kSubBuckets buckets, so
+// values are kept to within 1 / kSubBuckets of their magnitude, from 1ns up
+// to kMaxValueNs. Larger values are counted in the last bucket.
+//
+// Recording is a few relaxed atomic increments and never blocks, so any
+// number of threads can record while others read a summary. A summary taken
+// while values are being recorded may miss some of them.
+struct LatencyHistogram {
+    LatencyHistogram();
+
+    void record(int64_t valueNs);
+    void reset();
+
+    void getSummary(ASensorLatencySummary *summary) const;
+
+    static constexpr int kSubBucketBits = 3;
+    static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMaxExponent = 36;
+    static constexpr int64_t kMaxValueNs = (int64_t(1) << kMaxExponent) - 1;
+
+private:
+    static constexpr size_t kBucketCount = (kMaxExponent - kSubBucketBits + 1) * kSubBuckets;
+
+    static size_t getBucket(uint64_t value);
+    // Largest value counted in bucket.
+    static int64_t getBucketValue(size_t bucket);
+
+    std::atomic<uint64_t> mCounts[kBucketCount];
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mSumNs;
+    std::atomic<int64_t> mMaxNs;
+
+    DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+};
+
+// Latency histograms of the sensors of one event queue: from the sensor
+// timestamp to the event arriving at the queue, and from arriving to being
+// read by the client.
+//
+// Sensors get a slot in a SensorSlotTable on their first event, so neither
+// recording nor lookup takes a lock. Events of sensors beyond kMaxSensors
+// are not recorded.
+struct SensorLatencyStats {
+    static constexpr size_t kMaxSensors = 16;
+
+    SensorLatencyStats();
+
+    void recordArrival(int32_t sensorHandle, int64_t latencyNs);
+    void recordDrain(int32_t sensorHandle, int64_t latencyNs);
+
+    // Returns false if no event of the sensor was recorded.
+    bool getSummaries(int32_t sensorHandle, ASensorLatencySummary *arrival,
+                      ASensorLatencySummary *drain) const;
+
+    void reset();
+
+    // Appends a line per sensor to out.
+    void dump(std::string *out) const;
+
+private:
+    struct Slot {
+        LatencyHistogram arrival;
+        LatencyHistogram drain;
+    };
+
+    SensorSlotTable<Slot, kMaxSensors> mSlots;
+
+    DISALLOW_COPY_AND_ASSIGN(SensorLatencyStats);
+};
+
+#endif  // LATENCY_STATS_H_
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SensorCatalog.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using android::hardware::hidl_string;
+using android::hardware::hidl_vec;
+using android::hardware::sensors::V1_0::SensorType;
+
+static_assert(sizeof(SensorRecord) % alignof(ASensorRef) == 0, "misaligned sensor list");
+
+SensorCatalog::SensorCatalog(const hidl_vec<SensorInfo> &sensors) : mSize(sensors.size()) {
+    // Lay the strings out first. Sensors of one vendor share most of theirs,
+    // and the permission is mostly empty.
+    static constexpr size_t kStringsPerSensor = 4;
+    std::string strings;
+    std::unordered_map<std::string, size_t> offsets;
+    std::vector<size_t> stringOffsets;
+    stringOffsets.reserve(mSize * kStringsPerSensor);
+    auto intern = [&](const hidl_string &s) {
+        auto inserted = offsets.emplace(std::string(s.c_str(), s.size()), strings.size());
+        if (inserted.second) {
+            strings.append(s.c_str(), s.size());
+            strings.push_back('\0');
+        }
+        stringOffsets.push_back(inserted.first->second);
+    };
+    for (const SensorInfo &info : sensors) {
+        intern(info.name);
+        intern(info.vendor);
+        intern(info.typeAsString);
+        intern(info.requiredPermission);
+    }
+
+    size_t recordsSize = mSize * sizeof(SensorRecord);
+    size_t listSize = mSize * sizeof(ASensorRef);
+    mArenaSize = recordsSize + listSize + strings.size();
+    mArena.reset(new char[std::max<size_t>(mArenaSize, 1)]);
+    mRecords = reinterpret_cast<SensorRecord *>(mArena.get());
+    mList = reinterpret_cast<ASensorRef *>(mArena.get() + recordsSize);
+    char *stringBlock = mArena.get() + recordsSize + listSize;
+    memcpy(stringBlock, strings.data(), strings.size());
+
+    for (size_t i = 0; i < mSize; ++i) {
+        const SensorInfo &info = sensors[i];
+        const size_t *offset = &stringOffsets[i * kStringsPerSensor];
+        SensorRecord &record = mRecords[i];
+        record.sensorHandle = info.sensorHandle;
+        record.type = static_cast<int32_t>(info.type);
+        record.flags = info.flags;
+        record.minDelay = info.minDelay;
+        record.maxDelay = info.maxDelay;
+        record.fifoReservedEventCount = info.fifoReservedEventCount;
+        record.fifoMaxEventCount = info.fifoMaxEventCount;
+        record.version = info.version;
+        record.maxRange = info.maxRange;
+        record.resolution = info.resolution;
+        record.power = info.power;
+        record.name = stringBlock + offset[0];
+        record.vendor = stringBlock + offset[1];
+        record.typeAsString = stringBlock + offset[2];
+        record.requiredPermission = stringBlock + offset[3];
+
+        mList[i] = reinterpret_cast<ASensorRef>(&record);
+    }
+}
+
+hidl_vec<SensorCatalog::SensorInfo> SensorCatalog::toSensorInfos() const {
+    hidl_vec<SensorInfo> sensors;
+    sensors.resize(mSize);
+    for (size_t i = 0; i < mSize; ++i) {
+        const SensorRecord &record = mRecords[i];
+        SensorInfo &info = sensors[i];
+        info.sensorHandle = record.sensorHandle;
+        info.name = record.name;
+        info.vendor = record.vendor;
+        info.version = record.version;
+        info.type = static_cast<SensorType>(record.type);
+        info.typeAsString = record.typeAsString;
+        info.maxRange = record.maxRange;
+        info.resolution = record.resolution;
+        info.power = record.power;
+        info.minDelay = record.minDelay;
+        info.fifoReservedEventCount = record.fifoReservedEventCount;
+        info.fifoMaxEventCount = record.fifoMaxEventCount;
+        info.requiredPermission = record.requiredPermission;
+        info.maxDelay = record.maxDelay;
+        info.flags = record.flags;
+    }
+    return sensors;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SENSOR_CATALOG_H_
+
+#define SENSOR_CATALOG_H_
+
+#include <android/hardware/sensors/1.0/types.h>
+#include <android/sensor.h>
+#include <android-base/macros.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+// What an ASensorRef points to: the fields of a SensorInfo, with the strings
+// in the string block of the catalog it belongs to. Fields read on every
+// event queue call come first.
+struct SensorRecord {
+    int32_t sensorHandle;
+    int32_t type;
+    uint32_t flags;
+    int32_t minDelay;
+    int32_t maxDelay;
+    uint32_t fifoReservedEventCount;
+    uint32_t fifoMaxEventCount;
+    int32_t version;
+    float maxRange;
+    float resolution;
+    float power;
+    const char *name;
+    const char *vendor;
+    const char *typeAsString;
+    const char *requiredPermission;
+};
+
+inline const SensorRecord *asSensorRecord(ASensorRef sensor) {
+    return reinterpret_cast<const SensorRecord *>(sensor);
+}
+
+// The sensor list of the service, copied into a single allocation: the
+// records, the ASensorRef array handed out as ASensorList, and the strings,
+// each distinct string stored once. Nothing in it changes or moves once it
+// is built, so references into it stay valid for as long as the catalog
+// lives, and reading it needs no lock.
+struct SensorCatalog {
+    using SensorInfo = android::hardware::sensors::V1_0::SensorInfo;
+
+    explicit SensorCatalog(const android::hardware::hidl_vec<SensorInfo> &sensors);
+
+    size_t size() const { return mSize; }
+    const SensorRecord &at(size_t i) const { return mRecords[i]; }
+
+    ASensorList getList() const { return mList; }
+
+    // Copies the catalog back out, for what needs it in the service's terms.
+    android::hardware::hidl_vec<SensorInfo> toSensorInfos() const;
+
+    // Bytes of the allocation, for diagnosis.
+    size_t getArenaSize() const { return mArenaSize; }
+
+private:
+    size_t mSize;
+    size_t mArenaSize;
+    std::unique_ptr<char[]> mArena;
+    SensorRecord *mRecords;
+    ASensorRef *mList;
+
+    DISALLOW_COPY_AND_ASSIGN(SensorCatalog);
+};
+
+#endif  // SENSOR_CATALOG_H_
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SensorEventRing.h"
+
+#include "PowerOfTwo.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+SensorEventRing::SensorEventRing(size_t capacity)
+    : mCapacity(roundUpToPowerOfTwo(std::max<size_t>(capacity, 1))),
+      mMask(mCapacity - 1),
+      mSlots(new sensors_event_t[mCapacity]()),
+      mPolicy(DROP_OLDEST),
+      mOverflowCount(0),
+      mHead(0),
+      mTail(0),
+      mReading(kNotReading) {}
+
+void SensorEventRing::setOverflowPolicy(OverflowPolicy policy) {
+    mPolicy.store(policy, std::memory_order_relaxed);
+}
+
+SensorEventRing::OverflowPolicy SensorEventRing::overflowPolicy() const {
+    return static_cast<OverflowPolicy>(mPolicy.load(std::memory_order_relaxed));
+}
+
+sensors_event_t *SensorEventRing::beginWrite() {
+    size_t skip;
+    return beginWriteBatch(1, &skip) == 1 ? slotAt(0) : NULL;
+}
+
+void SensorEventRing::endWrite() {
+    endWriteBatch(1);
+}
+
+size_t SensorEventRing::beginWriteBatch(size_t count, size_t *outSkip) {
+    *outSkip = 0;
+
+    uint64_t tail = mTail.load(std::memory_order_relaxed);
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    bool dropOldest = overflowPolicy() == DROP_OLDEST;
+
+    if (dropOldest) {
+        if (count > mCapacity) {
+            *outSkip = count - mCapacity;
+            mOverflowCount.fetch_add(*outSkip, std::memory_order_relaxed);
+            count = mCapacity;
+        }
+
+        // Evict as many of the oldest events as needed. On failure head is
+        // reloaded and the loop re-checks, since the consumer may have made
+        // room in the meantime.
+        while (tail - head + count > mCapacity) {
+            uint64_t evict = tail - head + count - mCapacity;
+            if (mHead.compare_exchange_weak(
+                        head, head + evict, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                mOverflowCount.fetch_add(evict, std::memory_order_relaxed);
+                head += evict;
+                break;
+            }
+        }
+    }
+
+    // Slots the consumer is still copying from are off limits even though it
+    // already claimed them. mReading must be loaded after mHead: a consumer
+    // that claimed up to the head we saw published mReading before doing so.
+    // A failed claim can leave mReading behind the head; that only makes us
+    // more conservative until the consumer's next store.
+    uint64_t reading = mReading.load(std::memory_order_acquire);
+    uint64_t floor = std::min(head, reading);
+    size_t available = mCapacity - std::min<uint64_t>(tail - floor, mCapacity);
+    if (count > available) {
+        mOverflowCount.fetch_add(count - available, std::memory_order_relaxed);
+        // Under DROP_OLDEST the oldest events of the batch give way, so the
+        // newest ones still make it in once the consumer is done.
+        if (dropOldest) {
+            *outSkip += count - available;
+        }
+        count = available;
+    }
+
+    return count;
+}
+
+sensors_event_t *SensorEventRing::slotAt(size_t i) {
+    return &mSlots[(mTail.load(std::memory_order_relaxed) + i) & mMask];
+}
+
+size_t SensorEventRing::contiguousSlotsAt(size_t i) const {
+    return mCapacity - ((mTail.load(std::memory_order_relaxed) + i) & mMask);
+}
+
+void SensorEventRing::endWriteBatch(size_t count) {
+    mTail.store(mTail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+size_t SensorEventRing::read(sensors_event_t *out, size_t count) {
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    size_t n;
+
+    // Claim before copying, so the producer never rewrites a slot while we
+    // read it. mReading tells the producer where our claim starts; it is
+    // published before the exchange, so a producer that sees the claimed head
+    // also sees it. If the producer evicted events meanwhile, the exchange
+    // fails, reports the new head and we retry from there.
+    for (;;) {
+        uint64_t tail = mTail.load(std::memory_order_acquire);
+        n = std::min<uint64_t>(count, tail - head);
+        if (n == 0) {
+            return 0;
+        }
+
+        mReading.store(head, std::memory_order_release);
+        if (mHead.compare_exchange_weak(
+                    head, head + n, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            break;
+        }
+        mReading.store(kNotReading, std::memory_order_release);
+    }
+
+    // At most two block copies: up to the end of the slot array, then the
+    // wrapped-around remainder from its start.
+    size_t first = head & mMask;
+    size_t firstCount = std::min(n, mCapacity - first);
+    memcpy(out, &mSlots[first], firstCount * sizeof(sensors_event_t));
+    if (firstCount < n) {
+        memcpy(out + firstCount, &mSlots[0], (n - firstCount) * sizeof(sensors_event_t));
+    }
+
+    mReading.store(kNotReading, std::memory_order_release);
+    return n;
+}
+
+size_t SensorEventRing::size() const {
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    uint64_t tail = mTail.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+}
+
+uint64_t SensorEventRing::overflowCount() const {
+    return mOverflowCount.load(std::memory_order_relaxed);
+}
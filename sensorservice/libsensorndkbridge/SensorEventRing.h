@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SENSOR_EVENT_RING_H_
+
+#define SENSOR_EVENT_RING_H_
+
+#include <android-base/macros.h>
+#include <hardware/sensors.h>
+
+#include <atomic>
+#include <memory>
+
+// Bounded single-producer/single-consumer ring of sensor events.
+//
+// The producer is the HIDL thread delivering IEventQueueCallback::onEvent
+// (oneway calls to one binder node are serialized), the consumer is whoever
+// calls ASensorEventQueue_getEvents. Neither side ever blocks or allocates.
+// Both are lock-free but not wait-free: they race on the read index with a
+// compare-and-swap and retry when the other side moved it first, which only
+// happens under DROP_OLDEST.
+//
+// When the ring is full the overflow policy decides which event is lost.
+// DROP_OLDEST lets the producer advance the read index itself, so the
+// consumer claims events with a compare-and-swap before copying them, and
+// announces the claim in mReading so the producer keeps its hands off those
+// slots until the copy is done. If the ring fills up during that copy, the
+// oldest events of the incoming batch are dropped instead.
+struct SensorEventRing {
+    enum OverflowPolicy {
+        DROP_OLDEST,
+        DROP_NEWEST,
+    };
+
+    // The capacity is rounded up to the next power of two.
+    explicit SensorEventRing(size_t capacity);
+
+    size_t capacity() const { return mCapacity; }
+
+    void setOverflowPolicy(OverflowPolicy policy);
+    OverflowPolicy overflowPolicy() const;
+
+    // Producer side. Returns the slot to fill in, or NULL if the event must be
+    // dropped. Every non-NULL beginWrite() must be followed by endWrite().
+    sensors_event_t *beginWrite();
+    void endWrite();
+
+    // Producer side, for a batch of count events. Applies the overflow policy
+    // to the whole batch at once and returns the number of slots reserved.
+    // The caller skips the first *outSkip events of its batch (older events
+    // that don't fit under DROP_OLDEST), fills slotAt(0) to slotAt(n - 1)
+    // with the events that follow, and publishes them with endWriteBatch.
+    size_t beginWriteBatch(size_t count, size_t *outSkip);
+    sensors_event_t *slotAt(size_t i);
+    // Number of slots from slotAt(i) to the end of the slot array: slotAt(i)
+    // to slotAt(i + n - 1) are contiguous for n up to that.
+    size_t contiguousSlotsAt(size_t i) const;
+    void endWriteBatch(size_t count);
+
+    // Consumer side. Copies up to count events into out and returns the number
+    // of events copied.
+    size_t read(sensors_event_t *out, size_t count);
+
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+
+    // Number of events lost to the overflow policy since creation.
+    uint64_t overflowCount() const;
+
+private:
+    const size_t mCapacity;
+    const size_t mMask;
+    std::unique_ptr<sensors_event_t[]> mSlots;
+
+    std::atomic<int> mPolicy;
+    std::atomic<uint64_t> mOverflowCount;
+
+    // Monotonic indices; the slot of index i is mSlots[i & mMask]. Kept on
+    // separate cache lines so the producer and consumer don't false-share.
+    alignas(64) std::atomic<uint64_t> mHead;
+    alignas(64) std::atomic<uint64_t> mTail;
+
+    // Index the consumer is copying from, kNotReading when it isn't.
+    static constexpr uint64_t kNotReading = UINT64_MAX;
+    alignas(64) std::atomic<uint64_t> mReading;
+
+    DISALLOW_COPY_AND_ASSIGN(SensorEventRing);
+};
+
+#endif  // SENSOR_EVENT_RING_H_
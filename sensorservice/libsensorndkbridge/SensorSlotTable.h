@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SENSOR_SLOT_TABLE_H_
+
+#define SENSOR_SLOT_TABLE_H_
+
+#include <android-base/macros.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+// Fixed table of per-sensor state of type T, for statistics updated from
+// several threads without a lock.
+//
+// A sensor gets a slot the first time find() is asked to create one, by
+// probing from the slot its handle hashes to. Slots are never given up, so
+// a slot found once stays the sensor's for the lifetime of the table, and
+// sensors beyond kMaxSensors get none.
+template <typename T, size_t kMaxSensors>
+struct SensorSlotTable {
+    SensorSlotTable() : mEntries(new Entry[kMaxSensors]) {
+        for (size_t i = 0; i < kMaxSensors; ++i) {
+            mEntries[i].sensorHandle.store(kNoSensor, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns NULL if the sensor has no slot and create is false or the
+    // table is full.
+    T *find(int32_t sensorHandle, bool create) {
+        size_t start = static_cast<uint32_t>(sensorHandle) % kMaxSensors;
+        for (size_t i = 0; i < kMaxSensors; ++i) {
+            Entry &entry = mEntries[(start + i) % kMaxSensors];
+            int64_t handle = entry.sensorHandle.load(std::memory_order_acquire);
+            if (handle == sensorHandle) {
+                return &entry.value;
+            }
+            if (handle != kNoSensor) {
+                continue;
+            }
+            if (!create) {
+                return NULL;
+            }
+            // Losing the race to another sensor just means probing on.
+            if (entry.sensorHandle.compare_exchange_strong(
+                        handle, sensorHandle, std::memory_order_acq_rel)
+                    || handle == sensorHandle) {
+                return &entry.value;
+            }
+        }
+        return NULL;
+    }
+
+    const T *find(int32_t sensorHandle) const {
+        return const_cast<SensorSlotTable *>(this)->find(sensorHandle, false /* create */);
+    }
+
+    // Calls f(sensorHandle, slot) for each sensor that has a slot.
+    template <typename F>
+    void forEach(F f) {
+        for (size_t i = 0; i < kMaxSensors; ++i) {
+            int64_t handle = mEntries[i].sensorHandle.load(std::memory_order_acquire);
+            if (handle != kNoSensor) {
+                f(static_cast<int32_t>(handle), mEntries[i].value);
+            }
+        }
+    }
+
+    template <typename F>
+    void forEach(F f) const {
+        const_cast<SensorSlotTable *>(this)->forEach(
+                [&f](int32_t sensorHandle, const T &value) { f(sensorHandle, value); });
+    }
+
+private:
+    static constexpr int64_t kNoSensor = INT64_MIN;
+
+    struct Entry {
+        std::atomic<int64_t> sensorHandle;
+        T value;
+    };
+
+    std::unique_ptr<Entry[]> mEntries;
+
+    DISALLOW_COPY_AND_ASSIGN(SensorSlotTable);
+};
+
+#endif  // SENSOR_SLOT_TABLE_H_
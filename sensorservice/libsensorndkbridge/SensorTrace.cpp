@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SensorTrace.h"
+
+#include "EventConversion.h"
+
+#define LOG_TAG "libsensorndkbridge"
+#include <android-base/logging.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using android::BAD_VALUE;
+using android::NO_INIT;
+using android::OK;
+using android::hardware::hidl_string;
+using android::hardware::hidl_vec;
+using android::hardware::sensors::V1_0::SensorType;
+using android::status_t;
+
+constexpr char SensorTraceHeader::kMagic[8];
+constexpr size_t SensorTraceSensor::kMaxStringLength;
+
+static void copyString(char *dst, const hidl_string &src) {
+    size_t length = std::min(src.size(), SensorTraceSensor::kMaxStringLength);
+    memcpy(dst, src.c_str(), length);
+    dst[length] = '\0';
+}
+
+// The strings of a trace are NUL-terminated, unless it is corrupt.
+static hidl_string readString(const char *src) {
+    return hidl_string(src, strnlen(src, SensorTraceSensor::kMaxStringLength + 1));
+}
+
+static size_t getRecordOffset(size_t sensorCount) {
+    size_t offset = sizeof(SensorTraceHeader) + sensorCount * sizeof(SensorTraceSensor);
+    return (offset + alignof(SensorTraceRecord) - 1) & ~(alignof(SensorTraceRecord) - 1);
+}
+
+SensorTraceWriter::SensorTraceWriter(
+        const char *path, const hidl_vec<SensorInfo> &sensors, size_t maxRecords)
+    : mInitCheck(NO_INIT),
+      mMapping(NULL),
+      mMappingSize(0),
+      mHeader(NULL),
+      mRecords(NULL),
+      mDroppedCount(0) {
+    size_t recordOffset = getRecordOffset(sensors.size());
+    if (maxRecords == 0
+            || maxRecords > (SIZE_MAX - recordOffset) / sizeof(SensorTraceRecord)) {
+        LOG(ERROR) << "Can't make room for " << maxRecords << " events in sensor trace " << path;
+        mInitCheck = BAD_VALUE;
+        return;
+    }
+
+    mFd.reset(TEMP_FAILURE_RETRY(open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)));
+    if (!mFd.ok()) {
+        PLOG(ERROR) << "Can't create sensor trace " << path;
+        return;
+    }
+
+    mMappingSize = recordOffset + maxRecords * sizeof(SensorTraceRecord);
+    if (ftruncate(mFd.get(), mMappingSize) != 0) {
+        PLOG(ERROR) << "Can't size sensor trace " << path << " for " << maxRecords << " events";
+        return;
+    }
+
+    void *mapping = mmap(NULL, mMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd.get(), 0);
+    if (mapping == MAP_FAILED) {
+        PLOG(ERROR) << "Can't map sensor trace " << path;
+        return;
+    }
+    mMapping = static_cast<uint8_t *>(mapping);
+
+    // The file is zero-filled, only the set fields need writing.
+    mHeader = reinterpret_cast<SensorTraceHeader *>(mMapping);
+    memcpy(mHeader->magic, SensorTraceHeader::kMagic, sizeof(mHeader->magic));
+    mHeader->version = SensorTraceHeader::kVersion;
+    mHeader->sensorCount = sensors.size();
+    mHeader->sensorSize = sizeof(SensorTraceSensor);
+    mHeader->recordSize = sizeof(SensorTraceRecord);
+    mHeader->recordOffset = recordOffset;
+    mHeader->recordCapacity = maxRecords;
+
+    SensorTraceSensor *table =
+            reinterpret_cast<SensorTraceSensor *>(mMapping + sizeof(SensorTraceHeader));
+    for (size_t i = 0; i < sensors.size(); ++i) {
+        const SensorInfo &info = sensors[i];
+        SensorTraceSensor *sensor = &table[i];
+        sensor->handle = info.sensorHandle;
+        sensor->type = static_cast<int32_t>(info.type);
+        sensor->version = info.version;
+        sensor->minDelay = info.minDelay;
+        sensor->maxDelay = info.maxDelay;
+        sensor->fifoReservedEventCount = info.fifoReservedEventCount;
+        sensor->fifoMaxEventCount = info.fifoMaxEventCount;
+        sensor->flags = info.flags;
+        sensor->maxRange = info.maxRange;
+        sensor->resolution = info.resolution;
+        sensor->power = info.power;
+        copyString(sensor->name, info.name);
+        copyString(sensor->vendor, info.vendor);
+        copyString(sensor->typeAsString, info.typeAsString);
+        copyString(sensor->requiredPermission, info.requiredPermission);
+    }
+
+    mRecords = reinterpret_cast<SensorTraceRecord *>(mMapping + recordOffset);
+    mInitCheck = OK;
+}
+
+SensorTraceWriter::~SensorTraceWriter() {
+    if (mMapping == NULL) {
+        return;
+    }
+
+    // Give back the room that wasn't used.
+    size_t size = mHeader->recordOffset + getRecordCount() * sizeof(SensorTraceRecord);
+    munmap(mMapping, mMappingSize);
+    if (ftruncate(mFd.get(), size) != 0) {
+        PLOG(WARNING) << "Can't truncate sensor trace to " << size << " bytes";
+    }
+}
+
+status_t SensorTraceWriter::initCheck() const {
+    return mInitCheck;
+}
+
+void SensorTraceWriter::append(const Event *events, size_t count, int64_t arrivalNs) {
+    uint64_t recordCount = getRecordCount();
+    size_t n = std::min<uint64_t>(count, mHeader->recordCapacity - recordCount);
+    mDroppedCount += count - n;
+
+    for (size_t i = 0; i < n; ++i) {
+        SensorTraceRecord *record = &mRecords[recordCount + i];
+        record->arrivalNs = arrivalNs;
+        convertSensorEvent(events[i], &record->event);
+    }
+
+    // Publish the whole batch at once, see SensorTraceHeader::recordCount.
+    __atomic_store_n(&mHeader->recordCount, recordCount + n, __ATOMIC_RELEASE);
+}
+
+uint64_t SensorTraceWriter::getRecordCount() const {
+    return __atomic_load_n(&mHeader->recordCount, __ATOMIC_ACQUIRE);
+}
+
+SensorTraceReader::SensorTraceReader(const char *path)
+    : mInitCheck(NO_INIT),
+      mMapping(NULL),
+      mMappingSize(0),
+      mRecords(NULL),
+      mRecordCount(0) {
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC)));
+    struct stat st;
+    if (!fd.ok() || fstat(fd.get(), &st) != 0) {
+        PLOG(ERROR) << "Can't open sensor trace " << path;
+        return;
+    }
+
+    mInitCheck = BAD_VALUE;
+    mMappingSize = st.st_size;
+    if (mMappingSize < sizeof(SensorTraceHeader)) {
+        LOG(ERROR) << "Sensor trace " << path << " is truncated";
+        return;
+    }
+
+    void *mapping = mmap(NULL, mMappingSize, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (mapping == MAP_FAILED) {
+        PLOG(ERROR) << "Can't map sensor trace " << path;
+        mMappingSize = 0;
+        return;
+    }
+    mMapping = static_cast<const uint8_t *>(mapping);
+
+    const SensorTraceHeader *header = reinterpret_cast<const SensorTraceHeader *>(mMapping);
+    uint64_t recordCount = __atomic_load_n(&header->recordCount, __ATOMIC_ACQUIRE);
+    // The sensor table must fit before getRecordOffset can be trusted not to
+    // overflow.
+    if (memcmp(header->magic, SensorTraceHeader::kMagic, sizeof(header->magic)) != 0 ||
+            header->version != SensorTraceHeader::kVersion ||
+            header->sensorSize != sizeof(SensorTraceSensor) ||
+            header->recordSize != sizeof(SensorTraceRecord) ||
+            header->sensorCount > (mMappingSize - sizeof(SensorTraceHeader))
+                    / sizeof(SensorTraceSensor) ||
+            header->recordOffset != getRecordOffset(header->sensorCount) ||
+            header->recordOffset > mMappingSize ||
+            recordCount > (mMappingSize - header->recordOffset) / sizeof(SensorTraceRecord)) {
+        LOG(ERROR) << "Sensor trace " << path << " is corrupt or of another version";
+        return;
+    }
+
+    const SensorTraceSensor *table =
+            reinterpret_cast<const SensorTraceSensor *>(mMapping + sizeof(SensorTraceHeader));
+    mSensors.resize(header->sensorCount);
+    for (size_t i = 0; i < header->sensorCount; ++i) {
+        const SensorTraceSensor &sensor = table[i];
+        SensorInfo &info = mSensors[i];
+        info.sensorHandle = sensor.handle;
+        info.type = static_cast<SensorType>(sensor.type);
+        info.version = sensor.version;
+        info.minDelay = sensor.minDelay;
+        info.maxDelay = sensor.maxDelay;
+        info.fifoReservedEventCount = sensor.fifoReservedEventCount;
+        info.fifoMaxEventCount = sensor.fifoMaxEventCount;
+        info.flags = sensor.flags;
+        info.maxRange = sensor.maxRange;
+        info.resolution = sensor.resolution;
+        info.power = sensor.power;
+        info.name = readString(sensor.name);
+        info.vendor = readString(sensor.vendor);
+        info.typeAsString = readString(sensor.typeAsString);
+        info.requiredPermission = readString(sensor.requiredPermission);
+    }
+
+    mRecords = reinterpret_cast<const SensorTraceRecord *>(mMapping + header->recordOffset);
+    mRecordCount = recordCount;
+    mInitCheck = OK;
+}
+
+SensorTraceReader::~SensorTraceReader() {
+    if (mMapping != NULL) {
+        munmap(const_cast<uint8_t *>(mMapping), mMappingSize);
+    }
+}
+
+status_t SensorTraceReader::initCheck() const {
+    return mInitCheck;
+}
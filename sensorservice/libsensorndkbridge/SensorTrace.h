@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SENSOR_TRACE_H_
+
+#define SENSOR_TRACE_H_
+
+#include <android/hardware/sensors/1.0/types.h>
+#include <android-base/macros.h>
+#include <android-base/unique_fd.h>
+#include <hardware/sensors.h>
+#include <utils/Errors.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A recording of the events an event queue received, to reproduce what a
+// client saw offline.
+//
+// A trace file is a header, a table of the sensors of the service at the time
+// of the recording, and records of the events in the order they arrived:
+//
+//   SensorTraceHeader
+//   SensorTraceSensor[sensorCount]
+//   SensorTraceRecord[recordCount], starting at recordOffset
+//
+// Every field is in the byte order of the device that recorded it. The file
+// is sized for the maximum number of records up front and mapped, so
+// appending a record is a conversion straight into the mapping. recordCount
+// is updated after the records it covers, so a trace that wasn't closed,
+// because the process crashed, still reads up to its last complete batch.
+// Closing the trace truncates the file to the records it holds.
+
+struct SensorTraceHeader {
+    static constexpr char kMagic[8] = {'S', 'N', 'S', 'T', 'R', 'A', 'C', 'E'};
+    static constexpr uint32_t kVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t sensorCount;
+    uint32_t sensorSize;  // sizeof(SensorTraceSensor)
+    uint32_t recordSize;  // sizeof(SensorTraceRecord)
+    uint64_t recordOffset;
+    uint64_t recordCapacity;
+    uint64_t recordCount;  // accessed atomically
+};
+
+// The fields of a SensorInfo, with strings truncated to fit.
+struct SensorTraceSensor {
+    static constexpr size_t kMaxStringLength = 63;
+
+    int32_t handle;
+    int32_t type;
+    int32_t version;
+    int32_t minDelay;
+    int32_t maxDelay;
+    uint32_t fifoReservedEventCount;
+    uint32_t fifoMaxEventCount;
+    uint32_t flags;
+    float maxRange;
+    float resolution;
+    float power;
+    char name[kMaxStringLength + 1];
+    char vendor[kMaxStringLength + 1];
+    char typeAsString[kMaxStringLength + 1];
+    char requiredPermission[kMaxStringLength + 1];
+};
+
+struct SensorTraceRecord {
+    // elapsedRealtimeNano when the event arrived. Events delivered together
+    // share it, which is how replay tells the batches apart.
+    int64_t arrivalNs;
+    sensors_event_t event;
+};
+
+// Appends to a new trace file. Not thread safe, the owning queue serializes
+// access.
+struct SensorTraceWriter {
+    using Event = android::hardware::sensors::V1_0::Event;
+    using SensorInfo = android::hardware::sensors::V1_0::SensorInfo;
+
+    // Creates or replaces path, with room for maxRecords records. initCheck()
+    // returns BAD_VALUE if maxRecords is 0 or the file would be too large.
+    SensorTraceWriter(const char *path,
+                      const android::hardware::hidl_vec<SensorInfo> &sensors,
+                      size_t maxRecords);
+    ~SensorTraceWriter();
+
+    android::status_t initCheck() const;
+
+    // Records count events that arrived together at arrivalNs. Events past
+    // the capacity of the trace are dropped.
+    void append(const Event *events, size_t count, int64_t arrivalNs);
+
+    uint64_t getRecordCount() const;
+    uint64_t getDroppedCount() const { return mDroppedCount; }
+
+private:
+    android::status_t mInitCheck;
+    android::base::unique_fd mFd;
+    uint8_t *mMapping;
+    size_t mMappingSize;
+    SensorTraceHeader *mHeader;
+    SensorTraceRecord *mRecords;
+    uint64_t mDroppedCount;
+
+    DISALLOW_COPY_AND_ASSIGN(SensorTraceWriter);
+};
+
+// Reads a trace file, through a read-only mapping of it.
+struct SensorTraceReader {
+    using SensorInfo = android::hardware::sensors::V1_0::SensorInfo;
+
+    explicit SensorTraceReader(const char *path);
+    ~SensorTraceReader();
+
+    // Returns BAD_VALUE if the file isn't a trace this version understands.
+    android::status_t initCheck() const;
+
+    const android::hardware::hidl_vec<SensorInfo> &getSensors() const { return mSensors; }
+
+    size_t getRecordCount() const { return mRecordCount; }
+    const SensorTraceRecord &getRecord(size_t i) const { return mRecords[i]; }
+
+private:
+    android::status_t mInitCheck;
+    const uint8_t *mMapping;
+    size_t mMappingSize;
+    android::hardware::hidl_vec<SensorInfo> mSensors;
+    const SensorTraceRecord *mRecords;
+    size_t mRecordCount;
+
+    DISALLOW_COPY_AND_ASSIGN(SensorTraceReader);
+};
+
+#endif  // SENSOR_TRACE_H_
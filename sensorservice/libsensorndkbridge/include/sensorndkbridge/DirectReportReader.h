@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SENSOR_NDK_BRIDGE_DIRECT_REPORT_READER_H_
+
+#define SENSOR_NDK_BRIDGE_DIRECT_REPORT_READER_H_
+
+#include <android/sensor.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Reads sensor events out of the shared memory of a direct channel created with
+// ASensorManager_createSharedMemoryDirectChannel.
+//
+// Each record has the layout documented in ISensorManager.hal
+// (android.hardware.sensors@1.0::SensorsEventFormatOffset), which is the layout
+// of ASensorEvent with the following fields repurposed:
+//
+//   version   - record size, always kRecordSize
+//   sensor    - report token returned by ASensorManager_configureDirectReport
+//   reserved0 - atomic counter, 1 for the first record and incremented by one
+//               for every record, written last
+//
+// Records are written sequentially and wrap around at the end of the region.
+// The reader follows the counter to find new records and to notice when the
+// writer has lapped it. Nothing here allocates or takes locks; one reader per
+// region.
+//
+// A record that is being rewritten while it is read can only be detected once
+// its counter changes, so size the region for a few read intervals of events.
+struct DirectReportReader {
+    static constexpr size_t kRecordSize = 104;
+    static constexpr size_t kCounterOffset = 0x0C;
+
+    // A run of new records that are contiguous in the region.
+    struct Span {
+        const ASensorEvent *records;
+        size_t count;
+    };
+
+    // mem is the mapped region, size its usable size as passed to
+    // ASensorManager_createSharedMemoryDirectChannel.
+    DirectReportReader(const void *mem, size_t size)
+        : mMem(static_cast<const uint8_t *>(mem)),
+          mRecordCount(size / kRecordSize),
+          mIndex(0),
+          mNextCounter(1),
+          mOverrunCount(0) {}
+
+    // Returns the next contiguous run of at most maxCount new records, in
+    // place. The span stays valid until consume() or the writer laps it.
+    Span peek(size_t maxCount) {
+        Span span = {NULL, 0};
+        if (mRecordCount == 0) {
+            return span;
+        }
+
+        resyncIfLapped();
+
+        size_t limit = mRecordCount - mIndex;
+        if (maxCount < limit) {
+            limit = maxCount;
+        }
+
+        uint32_t expected = mNextCounter;
+        while (span.count < limit && counterAt(mIndex + span.count) == expected) {
+            ++span.count;
+            ++expected;
+        }
+
+        span.records = reinterpret_cast<const ASensorEvent *>(mMem + mIndex * kRecordSize);
+        return span;
+    }
+
+    // Marks the records of span as read. Returns false if the writer has
+    // overwritten the span in the meantime, in which case its contents must be
+    // discarded and the lost records are counted as an overrun.
+    bool consume(const Span &span) {
+        if (span.count == 0) {
+            return true;
+        }
+
+        // The writer proceeds in order, so it can't have touched any record
+        // of the span without overwriting the first one.
+        bool intact = counterAt(mIndex) == mNextCounter;
+        if (!intact) {
+            mOverrunCount += span.count;
+        }
+        advance(span.count);
+        return intact;
+    }
+
+    // Copies up to count new records into events, normalized to regular
+    // ASensorEvents: version is sizeof(ASensorEvent) and reserved0 is 0, sensor
+    // still holds the report token. Returns the number of events copied.
+    size_t read(ASensorEvent *events, size_t count) {
+        size_t copied = 0;
+        while (copied < count) {
+            Span span = peek(count - copied);
+            if (span.count == 0) {
+                break;
+            }
+
+            memcpy(&events[copied], span.records, span.count * sizeof(ASensorEvent));
+            if (!consume(span)) {
+                continue;
+            }
+
+            for (size_t i = copied; i < copied + span.count; ++i) {
+                events[i].version = sizeof(ASensorEvent);
+                events[i].reserved0 = 0;
+            }
+            copied += span.count;
+        }
+        return copied;
+    }
+
+    // Number of records lost because the writer lapped the reader.
+    uint64_t overrunCount() const { return mOverrunCount; }
+
+private:
+    static_assert(sizeof(ASensorEvent) == kRecordSize, "mismatched record size");
+
+    const uint8_t *mMem;
+    const size_t mRecordCount;
+    size_t mIndex;
+    uint32_t mNextCounter;
+    uint64_t mOverrunCount;
+
+    uint32_t counterAt(size_t index) const {
+        const uint32_t *counter =
+                reinterpret_cast<const uint32_t *>(mMem + index * kRecordSize + kCounterOffset);
+        return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+    }
+
+    void advance(size_t count) {
+        mNextCounter += count;
+        mIndex += count;
+        if (mIndex == mRecordCount) {
+            mIndex = 0;
+        }
+    }
+
+    // If the slot we expect the next record in holds a newer one, the writer
+    // has lapped us. Reading restarts from the oldest record that survived,
+    // the one right after the newest; everything before it is lost. Finding
+    // it takes a scan of the region, but only on overrun.
+    void resyncIfLapped() {
+        if (static_cast<int32_t>(counterAt(mIndex) - mNextCounter) <= 0) {
+            return;
+        }
+
+        size_t newestIndex = mIndex;
+        for (size_t i = 0; i < mRecordCount; ++i) {
+            if (static_cast<int32_t>(counterAt(i) - counterAt(newestIndex)) > 0) {
+                newestIndex = i;
+            }
+        }
+
+        mIndex = (newestIndex + 1) % mRecordCount;
+        uint32_t oldest = counterAt(mIndex);
+        mOverrunCount += static_cast<uint32_t>(oldest - mNextCounter);
+        mNextCounter = oldest;
+    }
+};
+
+#endif  // SENSOR_NDK_BRIDGE_DIRECT_REPORT_READER_H_
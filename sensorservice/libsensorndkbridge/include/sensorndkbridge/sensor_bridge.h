@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Extensions to the NDK sensor API (android/sensor.h) that are only provided
+ * by libsensorndkbridge.
+ */
+
+#ifndef SENSOR_NDK_BRIDGE_SENSOR_BRIDGE_H_
+
+#define SENSOR_NDK_BRIDGE_SENSOR_BRIDGE_H_
+
+#include <android/sensor.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/**
+ * Overflow policies of a sensor event queue, see
+ * {@link ASensorEventQueue_setOverflowPolicy}.
+ */
+enum {
+    /** When the queue is full the oldest pending event is discarded. */
+    ASENSOR_QUEUE_OVERFLOW_DROP_OLDEST = 0,
+    /** When the queue is full the incoming event is discarded. */
+    ASENSOR_QUEUE_OVERFLOW_DROP_NEWEST = 1,
+};
+
+/**
+ * Sets what happens to events arriving while the queue is full. The default
+ * is ASENSOR_QUEUE_OVERFLOW_DROP_OLDEST.
+ *
+ * If the sensor service passes events to the queue through shared memory,
+ * the service itself discards incoming events while the queue is full; the
+ * policy has no effect and those events are not counted by
+ * {@link ASensorEventQueue_getOverflowCount}.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventQueue_setOverflowPolicy(ASensorEventQueue* queue, int policy);
+
+/**
+ * Returns the number of events the queue has discarded because it was full,
+ * or a negative error code on failure.
+ */
+int64_t ASensorEventQueue_getOverflowCount(ASensorEventQueue* queue);
+
+/**
+ * Where the events of a queue went, see {@link ASensorEventQueue_getStats}.
+ * Counts are since the queue was created.
+ */
+typedef struct ASensorEventQueueStats {
+    /**
+     * Number of events the sensor service delivered to the queue, including
+     * additional info events it wasn't asked for, see filtered.
+     */
+    uint64_t received;
+    /** Number of events retrieved by the client. */
+    uint64_t delivered;
+    /**
+     * Number of events discarded because the queue was full, as reported by
+     * {@link ASensorEventQueue_getOverflowCount}.
+     */
+    uint64_t overflowed;
+    /** Number of events dropped by {@link ASensorEventQueue_setDecimation}. */
+    uint64_t decimated;
+    /**
+     * Number of additional info events ignored because they weren't requested
+     * with {@link ASensorEventQueue_requestAdditionalInfoEvents}.
+     */
+    uint64_t filtered;
+    /**
+     * Number of times consecutive events of a continuous sensor were at least
+     * twice its sampling period apart, meaning events were lost before they
+     * reached the queue: in the sensor hub, the HAL or the sensor service.
+     */
+    uint64_t gaps;
+    /** Estimated number of events missing in these gaps. */
+    uint64_t missedSamples;
+    /** Most events that were ever pending in the queue at once. */
+    uint64_t maxDepth;
+} ASensorEventQueueStats;
+
+/**
+ * Retrieves the event accounting of queue, to tell events lost on the way to
+ * the queue from those dropped by it.
+ *
+ * Gaps are detected for continuous sensors enabled on this queue, from the
+ * sampling period this queue asked for. A sensor the service runs slower than
+ * asked for shows up as gaps too.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventQueue_getStats(ASensorEventQueue* queue, ASensorEventQueueStats* stats);
+
+/**
+ * Retrieve pending events in the sensor event queue, like
+ * {@link ASensorEventQueue_getEvents}, and report how many events are still
+ * pending afterwards.
+ *
+ * \param queue {@link ASensorEventQueue} to retrieve the events from.
+ * \param events pointer to an array of {@link ASensorEvent}.
+ * \param count max number of events to return.
+ * \param outPending if non-NULL, receives the number of events left in the
+ *        queue, so that the caller can size its next read without calling
+ *        {@link ASensorEventQueue_hasEvents}.
+ * \return the number of events returned on success; negative error code
+ *         otherwise.
+ */
+ssize_t ASensorEventQueue_getEventsBatch(
+        ASensorEventQueue* queue, ASensorEvent* events, size_t count, size_t* outPending);
+
+/**
+ * Decimation modes of a sensor on an event queue, see
+ * {@link ASensorEventQueue_setDecimation}.
+ */
+enum {
+    /** Every event is delivered. */
+    ASENSOR_DECIMATION_NONE = 0,
+    /** The first out of every factor events is delivered. */
+    ASENSOR_DECIMATION_KEEP_NTH = 1,
+    /**
+     * Every factor events, the last one is delivered with its values averaged
+     * over all of them. Only supported by sensors reporting continuous
+     * values, such as accelerometers, gyroscopes and magnetometers, light
+     * and pressure sensors.
+     */
+    ASENSOR_DECIMATION_AVERAGE = 2,
+    /**
+     * Only the newest event since the client last retrieved events is
+     * delivered, older ones are dropped as newer ones arrive.
+     */
+    ASENSOR_DECIMATION_LATEST = 3,
+};
+
+/**
+ * Thins out the events of sensor on this queue, for a client that wants them
+ * at a lower rate than the sensor runs at for other clients. Events are
+ * dropped before they are copied into the queue and, unless the sensor
+ * service passes events through shared memory, before the queue is signaled.
+ *
+ * \param mode one of the ASENSOR_DECIMATION_* modes.
+ * \param factor the number of events per event delivered, for
+ *        ASENSOR_DECIMATION_KEEP_NTH and ASENSOR_DECIMATION_AVERAGE.
+ * \return 0 on success or a negative error code on failure, in particular if
+ *         sensor doesn't support mode.
+ */
+int ASensorEventQueue_setDecimation(
+        ASensorEventQueue* queue, ASensor const* sensor, int mode, int32_t factor);
+
+/**
+ * Distribution of a latency, see {@link ASensorEventQueue_getLatencyStats}.
+ * Percentiles are accurate to within 12.5%.
+ */
+typedef struct ASensorLatencySummary {
+    /** Number of events recorded. */
+    uint64_t count;
+    int64_t meanNs;
+    int64_t p50Ns;
+    int64_t p90Ns;
+    int64_t p99Ns;
+    int64_t maxNs;
+} ASensorLatencySummary;
+
+/**
+ * Starts or stops recording, for each sensor, how long its events take to
+ * reach the queue and how long they wait in it. Starting discards what was
+ * recorded before. Recording is off by default.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventQueue_setLatencyTracking(ASensorEventQueue* queue, bool enable);
+
+/**
+ * Retrieves the latencies recorded for the events of sensor on this queue:
+ *
+ * - arrival: from the sensor timestamp to the event arriving at the queue,
+ *   which covers the sensor hub, the HAL, the sensor service and binder.
+ * - drain: from arriving at the queue to being retrieved with
+ *   {@link ASensorEventQueue_getEvents}, which covers the looper and the
+ *   client.
+ *
+ * If the sensor service passes events through shared memory, events are
+ * read straight out of it by ASensorEventQueue_getEvents, so that is when
+ * they arrive; arrival includes the wait in the queue and drain is always 0.
+ *
+ * Either summary may be NULL. Returns 0 on success or a negative error code
+ * on failure, in particular if nothing was recorded for sensor.
+ */
+int ASensorEventQueue_getLatencyStats(
+        ASensorEventQueue* queue, ASensor const* sensor, ASensorLatencySummary* arrival,
+        ASensorLatencySummary* drain);
+
+/**
+ * Writes the sensors the queue was asked to deliver, with their sampling period,
+ * maximum batch report latency and whether they are enabled, and the counts of
+ * {@link ASensorEventQueue_getStats}, as text to fd.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventQueue_dump(ASensorEventQueue* queue, int fd);
+
+/**
+ * Starts recording the events the sensor service delivers to queue into a
+ * trace file at path, to reproduce an issue offline. The file is created or
+ * replaced, and starts with the sensor list of the service. Events are
+ * recorded as they arrive, before decimation or any other filtering, along
+ * with their arrival time. Starting a new recording stops the one in
+ * progress.
+ *
+ * The file is sized for maxEvents events right away, and events beyond that
+ * are not recorded. Stopping the recording shrinks the file to the events
+ * it holds. A recording that wasn't stopped, because the process died, can
+ * still be read up to the last batch of events recorded.
+ *
+ * Returns 0 on success or a negative error code on failure, in particular
+ * -EINVAL if maxEvents is 0 or too large to address.
+ */
+int ASensorManager_startEventQueueRecording(
+        ASensorManager* manager, ASensorEventQueue* queue, const char* path, size_t maxEvents);
+
+/**
+ * Stops recording the events of queue and closes the trace file. Destroying
+ * the queue does so as well.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventQueue_stopRecording(ASensorEventQueue* queue);
+
+/**
+ * Retrieves pending events like {@link ASensorEventQueue_getEvents}, after
+ * waiting for at least minCount of them, for clients that read the queue
+ * without a looper. Waiting for several events at once lets the client sleep
+ * through the arrival of all but the last one.
+ *
+ * \param minCount the number of events to wait for. It is capped to count;
+ *        0 doesn't wait.
+ * \param timeoutNs how long, in nanoseconds, to wait at most. 0 doesn't wait,
+ *        a negative value waits until the events arrive or the queue is
+ *        destroyed.
+ * \return the number of events retrieved, which is less than minCount if the
+ *         timeout expired, or a negative error code.
+ */
+ssize_t ASensorEventQueue_getEventsTimeout(
+        ASensorEventQueue* queue, ASensorEvent* events, size_t count, size_t minCount,
+        int64_t timeoutNs);
+
+/**
+ * Creates a new sensor event queue, like {@link ASensorManager_createEventQueue},
+ * that lets the sensor service hold events back for up to maxDeliveryLatencyUs
+ * to deliver them in fewer, larger batches.
+ *
+ * Queues created with {@link ASensorManager_createEventQueue} already receive
+ * events that are available at the same time, such as a hardware FIFO flush,
+ * in a single batch. This only matters for sensors reporting continuously at
+ * high rates, where it trades latency for fewer wakeups of the service and
+ * the client. The latency adds to the maxBatchReportLatencyUs the sensors are
+ * registered with. If the sensor service doesn't support batched delivery,
+ * events are delivered as they arrive.
+ *
+ * \param maxDeliveryLatencyUs how long, in microseconds, events may be held
+ *        back. Must not be negative.
+ * \return the new event queue, or NULL on failure.
+ */
+ASensorEventQueue* ASensorManager_createBatchedEventQueue(
+        ASensorManager* manager, ALooper* looper, int ident, ALooper_callbackFunc callback,
+        void* data, int64_t maxDeliveryLatencyUs);
+
+/**
+ * How the events of a queue are scheduled, see
+ * {@link ASensorManager_createEventQueueWithScheduling}.
+ */
+typedef struct ASensorEventQueueScheduling {
+    /** SCHED_OTHER, SCHED_FIFO or SCHED_RR. */
+    int policy;
+    /**
+     * The real-time priority, 1 to 99, for SCHED_FIFO and SCHED_RR, the nice
+     * value, -20 to 19, for SCHED_OTHER.
+     */
+    int priority;
+    /**
+     * The CPUs the thread of the bridge reading events from shared memory may
+     * run on, bit n standing for CPU n. 0 leaves its affinity alone. Only
+     * valid if the service delivers events through shared memory.
+     */
+    uint64_t cpuMask;
+} ASensorEventQueueScheduling;
+
+/**
+ * Creates a new sensor event queue, like {@link ASensorManager_createEventQueue},
+ * whose events are delivered with the given scheduling policy and priority.
+ *
+ * Queues created with {@link ASensorManager_createEventQueue} are delivered by
+ * threads running SCHED_FIFO at priority 98, which suits a control loop but
+ * lets a low rate sensor such as a step counter preempt everything else on
+ * its CPU. The policy and priority apply to the thread delivering events to
+ * the queue: the binder thread of the service's callbacks, which the service
+ * raises for the duration of each callback, or the thread of the bridge
+ * reading them from shared memory. cpuMask only applies to the latter: the
+ * binder threads serve every other HIDL object of the process too, and the
+ * looper's thread is the client's, so neither is the queue's to pin. The
+ * client pins its own thread if it wants to.
+ *
+ * Scheduling is applied on a best effort basis: if the process isn't allowed
+ * to use a real-time policy or the given CPUs, a warning is logged and the
+ * queue works with the default scheduling.
+ *
+ * \return the new event queue, or NULL on failure, in particular if the
+ *         policy or priority is invalid, or if cpuMask isn't 0 and the
+ *         service can only deliver events through callbacks. If a restarted
+ *         service makes a queue fall back to callbacks, its cpuMask no longer
+ *         applies and a warning is logged.
+ */
+ASensorEventQueue* ASensorManager_createEventQueueWithScheduling(
+        ASensorManager* manager, ALooper* looper, int ident, ALooper_callbackFunc callback,
+        void* data, const ASensorEventQueueScheduling* scheduling);
+
+/**
+ * A stream of the events of several sensors in timestamp order, for clients
+ * such as sensor fusion that would otherwise merge the events of one queue
+ * per sensor themselves.
+ */
+typedef struct ASensorEventStream ASensorEventStream;
+
+/**
+ * Creates a new event stream. Like an event queue it is associated with
+ * looper: its ident is returned by ALooper_pollOnce, or callback is called,
+ * when new events arrive.
+ *
+ * Events are delivered in order of their timestamps across all sensors of the
+ * stream. An event is held back until every enabled sensor of the stream has
+ * delivered a newer one, or until the stream has seen an event reorderWindowNs
+ * newer than it. Events of a sensor lagging further behind than that are
+ * dropped, so the stream is monotonic. Events other than sensor data, such
+ * as flush complete events, are delivered as they arrive.
+ *
+ * \param reorderWindowNs how far, in nanoseconds, the sensors of the stream
+ *        may lag behind each other. Must not be negative.
+ * \return the new event stream, or NULL on failure.
+ */
+ASensorEventStream* ASensorManager_createEventStream(
+        ASensorManager* manager, ALooper* looper, int ident, ALooper_callbackFunc callback,
+        void* data, int64_t reorderWindowNs);
+
+/**
+ * Destroys the event stream and frees all resources associated with it.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorManager_destroyEventStream(ASensorManager* manager, ASensorEventStream* stream);
+
+/**
+ * Adds sensor to the stream and enables it, like
+ * {@link ASensorEventQueue_registerSensor}.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventStream_registerSensor(
+        ASensorEventStream* stream, ASensor const* sensor, int32_t samplingPeriodUs,
+        int64_t maxBatchReportLatencyUs);
+
+/**
+ * Disables sensor. Its events already received are still delivered.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorEventStream_disableSensor(ASensorEventStream* stream, ASensor const* sensor);
+
+/**
+ * Retrieves the events of the stream that are ready, oldest first. Returns
+ * the number of events retrieved, which can be smaller than the number of
+ * events received while some are held back, or a negative error code.
+ */
+ssize_t ASensorEventStream_getEvents(ASensorEventStream* stream, ASensorEvent* events,
+                                     size_t count);
+
+/**
+ * Returns the number of events the stream dropped because they arrived out
+ * of order or while the stream was full, or a negative error code on
+ * failure.
+ */
+int64_t ASensorEventStream_getDroppedEventCount(ASensorEventStream* stream);
+
+/**
+ * How the sensor manager recovered from restarts of the sensor service, see
+ * {@link ASensorManager_getReconnectStats}.
+ */
+typedef struct ASensorManagerReconnectStats {
+    /** Number of times the sensor service died. */
+    uint32_t serviceDeaths;
+    /** Number of times the manager reconnected to the sensor service. */
+    uint32_t reconnects;
+    /**
+     * Time in nanoseconds from the death notification to having reconnected
+     * all event queues and enabled their sensors again, for the last and the
+     * slowest reconnection. 0 if there was none.
+     */
+    int64_t lastReconnectLatencyNs;
+    int64_t maxReconnectLatencyNs;
+} ASensorManagerReconnectStats;
+
+/**
+ * When the sensor service dies, the sensor manager reconnects to it once it
+ * is back. Sensor references stay valid. Event queues keep working: they are
+ * connected to the new service and their sensors enabled again with the
+ * last sampling period and batch latency. Events produced meanwhile are
+ * lost. Direct channels are not restored.
+ *
+ * Fills stats with the reconnection statistics of manager.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+int ASensorManager_getReconnectStats(
+        ASensorManager* manager, ASensorManagerReconnectStats* stats);
+
+__END_DECLS
+
+#endif  // SENSOR_NDK_BRIDGE_SENSOR_BRIDGE_H_
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+using android::frameworks::sensorservice::V1_1::IEventQueueCallback;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr int kIdent = 5;
+static constexpr int32_t kGyroscope = 2;
+static constexpr int32_t kProximity = 3;
+
+static SensorInfo makeSensor(int32_t handle, SensorType type) {
+    SensorInfo info;
+    info.sensorHandle = handle;
+    info.name = "sensor";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = type;
+    info.typeAsString = "";
+    info.maxRange = 1.0f;
+    info.resolution = 1.0f;
+    info.power = 0.1f;
+    info.minDelay = 1000;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 0;
+    info.maxDelay = 1000000;
+    info.flags = 0;
+    return info;
+}
+
+static Event makeVectorEvent(int64_t timestamp, float x) {
+    Event event;
+    event.sensorHandle = kGyroscope;
+    event.sensorType = SensorType::GYROSCOPE;
+    event.timestamp = timestamp;
+    event.u.vec3.x = x;
+    event.u.vec3.y = -x;
+    event.u.vec3.z = 0.0f;
+    event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    return event;
+}
+
+// Decimation applies to both ways events can take into the queue.
+class DecimationTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({
+                makeSensor(kGyroscope, SensorType::GYROSCOPE),
+                makeSensor(kProximity, SensorType::PROXIMITY),
+        }, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mGyroscope = mManager->getSensorByHandle(kGyroscope);
+        ASSERT_NE(mGyroscope, nullptr);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+        ASSERT_EQ(ASensorEventQueue_enableSensor(mQueue, mGyroscope), 0);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    // Delivers events as one batch and returns what the queue passes on.
+    std::vector<ASensorEvent> deliver(const std::vector<Event> &events) {
+        if (GetParam()) {
+            EXPECT_TRUE(mServiceQueue->writeEvents(events));
+        } else {
+            sp<IEventQueueCallback> callback =
+                    IEventQueueCallback::castFrom(mServiceQueue->getCallback());
+            EXPECT_NE(callback, nullptr);
+            callback->onEvents(events);
+        }
+        return read();
+    }
+
+    // Delivers event on its own, through onEvent on the callback path.
+    void send(const Event &event) {
+        if (GetParam()) {
+            EXPECT_TRUE(mServiceQueue->writeEvents({event}));
+        } else {
+            sp<IEventQueueCallback> callback =
+                    IEventQueueCallback::castFrom(mServiceQueue->getCallback());
+            EXPECT_NE(callback, nullptr);
+            callback->onEvent(event);
+        }
+    }
+
+    std::vector<ASensorEvent> read() {
+        ASensorEvent buffer[16];
+        ssize_t n = ASensorEventQueue_getEvents(mQueue, buffer, 16);
+        EXPECT_GE(n, 0);
+        return std::vector<ASensorEvent>(buffer, buffer + std::max<ssize_t>(n, 0));
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mGyroscope;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_P(DecimationTest, KeepsEveryNth) {
+    ASSERT_EQ(ASensorEventQueue_setDecimation(
+                      mQueue, mGyroscope, ASENSOR_DECIMATION_KEEP_NTH, 3),
+              0);
+
+    std::vector<Event> events;
+    for (int i = 1; i <= 7; ++i) {
+        events.push_back(makeVectorEvent(i, i));
+    }
+
+    std::vector<ASensorEvent> delivered = deliver(events);
+    ASSERT_EQ(delivered.size(), 3u);
+    EXPECT_EQ(delivered[0].timestamp, 1);
+    EXPECT_EQ(delivered[1].timestamp, 4);
+    EXPECT_EQ(delivered[2].timestamp, 7);
+
+    // The count carries over to the next batch.
+    EXPECT_TRUE(deliver({makeVectorEvent(8, 8.0f), makeVectorEvent(9, 9.0f)}).empty());
+    EXPECT_EQ(deliver({makeVectorEvent(10, 10.0f)}).size(), 1u);
+}
+
+TEST_P(DecimationTest, Averages) {
+    ASSERT_EQ(ASensorEventQueue_setDecimation(
+                      mQueue, mGyroscope, ASENSOR_DECIMATION_AVERAGE, 2),
+              0);
+
+    std::vector<ASensorEvent> delivered = deliver({
+            makeVectorEvent(1, 1.0f),
+            makeVectorEvent(2, 3.0f),
+            makeVectorEvent(3, 5.0f),
+            makeVectorEvent(4, 7.0f),
+            makeVectorEvent(5, 9.0f),
+    });
+    ASSERT_EQ(delivered.size(), 2u);
+    EXPECT_EQ(delivered[0].timestamp, 2);
+    EXPECT_FLOAT_EQ(delivered[0].vector.x, 2.0f);
+    EXPECT_FLOAT_EQ(delivered[0].vector.y, -2.0f);
+    EXPECT_EQ(delivered[0].vector.status, ASENSOR_STATUS_ACCURACY_HIGH);
+    EXPECT_EQ(delivered[1].timestamp, 4);
+    EXPECT_FLOAT_EQ(delivered[1].vector.x, 6.0f);
+
+    delivered = deliver({makeVectorEvent(6, 11.0f)});
+    ASSERT_EQ(delivered.size(), 1u);
+    EXPECT_FLOAT_EQ(delivered[0].vector.x, 10.0f);
+}
+
+TEST_P(DecimationTest, KeepsLatestOfBatch) {
+    ASSERT_EQ(ASensorEventQueue_setDecimation(mQueue, mGyroscope, ASENSOR_DECIMATION_LATEST, 0),
+              0);
+
+    std::vector<ASensorEvent> delivered = deliver({
+            makeVectorEvent(1, 1.0f),
+            makeVectorEvent(2, 2.0f),
+            makeVectorEvent(3, 3.0f),
+    });
+    ASSERT_EQ(delivered.size(), 1u);
+    EXPECT_EQ(delivered[0].timestamp, 3);
+}
+
+TEST_P(DecimationTest, KeepsLatestUntilRead) {
+    ASSERT_EQ(ASensorEventQueue_setDecimation(mQueue, mGyroscope, ASENSOR_DECIMATION_LATEST, 0),
+              0);
+
+    for (int i = 1; i <= 3; ++i) {
+        send(makeVectorEvent(i, i));
+    }
+    EXPECT_GT(ASensorEventQueue_hasEvents(mQueue), 0);
+
+    std::vector<ASensorEvent> delivered = read();
+    ASSERT_EQ(delivered.size(), 1u);
+    EXPECT_EQ(delivered[0].timestamp, 3);
+    EXPECT_FLOAT_EQ(delivered[0].vector.x, 3.0f);
+    EXPECT_TRUE(read().empty());
+}
+
+TEST_P(DecimationTest, NoneRestoresAllEvents) {
+    ASSERT_EQ(ASensorEventQueue_setDecimation(
+                      mQueue, mGyroscope, ASENSOR_DECIMATION_KEEP_NTH, 4),
+              0);
+    ASSERT_EQ(ASensorEventQueue_setDecimation(mQueue, mGyroscope, ASENSOR_DECIMATION_NONE, 0),
+              0);
+
+    EXPECT_EQ(deliver({makeVectorEvent(1, 1.0f), makeVectorEvent(2, 2.0f)}).size(), 2u);
+
+    // The event LATEST keeps back is delivered, ahead of the ones after it.
+    ASSERT_EQ(ASensorEventQueue_setDecimation(mQueue, mGyroscope, ASENSOR_DECIMATION_LATEST, 0),
+              0);
+    for (int i = 3; i <= 5; ++i) {
+        send(makeVectorEvent(i, i));
+    }
+    ASSERT_EQ(ASensorEventQueue_setDecimation(mQueue, mGyroscope, ASENSOR_DECIMATION_NONE, 0),
+              0);
+    send(makeVectorEvent(6, 6.0f));
+
+    std::vector<ASensorEvent> delivered = read();
+    // Shared memory is only decimated when read, by then LATEST is gone.
+    ASSERT_EQ(delivered.size(), GetParam() ? 4u : 2u);
+    EXPECT_EQ(delivered[delivered.size() - 2].timestamp, 5);
+    EXPECT_FLOAT_EQ(delivered[delivered.size() - 2].vector.x, 5.0f);
+    EXPECT_EQ(delivered.back().timestamp, 6);
+
+    ASensorEventQueueStats stats;
+    ASSERT_EQ(ASensorEventQueue_getStats(mQueue, &stats), 0);
+    EXPECT_EQ(stats.decimated, GetParam() ? 0u : 2u);
+}
+
+TEST_P(DecimationTest, RejectsUnsupportedModes) {
+    ASensorRef proximity = mManager->getSensorByHandle(kProximity);
+    ASSERT_NE(proximity, nullptr);
+
+    EXPECT_LT(ASensorEventQueue_setDecimation(mQueue, proximity, ASENSOR_DECIMATION_AVERAGE, 2),
+              0);
+    EXPECT_LT(ASensorEventQueue_setDecimation(mQueue, mGyroscope, ASENSOR_DECIMATION_KEEP_NTH, 0),
+              0);
+    EXPECT_LT(ASensorEventQueue_setDecimation(mQueue, mGyroscope, 42, 2), 0);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, DecimationTest, ::testing::Bool());
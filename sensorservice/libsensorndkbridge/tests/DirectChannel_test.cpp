@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <android-base/unique_fd.h>
+#include <cutils/ashmem.h>
+#include <gtest/gtest.h>
+#include <hardware/sensors.h>
+#include <sys/mman.h>
+
+using android::base::unique_fd;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::RateLevel;
+using android::hardware::sensors::V1_0::SensorFlagBits;
+using android::hardware::sensors::V1_0::SensorFlagShift;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorsEventFormatOffset;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr size_t kRecordSize = static_cast<size_t>(SensorsEventFormatOffset::TOTAL_LENGTH);
+
+static SensorInfo makeAccelerometer() {
+    SensorInfo info;
+    info.sensorHandle = 1;
+    info.name = "accelerometer";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = SensorType::ACCELEROMETER;
+    info.typeAsString = "android.sensor.accelerometer";
+    info.maxRange = 78.4f;
+    info.resolution = 0.01f;
+    info.power = 0.1f;
+    info.minDelay = 2500;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 1024;
+    info.maxDelay = 1000000;
+    info.flags = static_cast<uint32_t>(SensorFlagBits::DIRECT_CHANNEL_ASHMEM)
+            | (static_cast<uint32_t>(RateLevel::FAST)
+               << static_cast<uint32_t>(SensorFlagShift::DIRECT_REPORT));
+    return info;
+}
+
+class DirectChannelTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeAccelerometer()});
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        ASensorList list;
+        ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 1);
+        mSensor = list[0];
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mSensor;
+};
+
+TEST_F(DirectChannelTest, Capabilities) {
+    EXPECT_TRUE(ASensor_isDirectChannelTypeSupported(
+            mSensor, ASENSOR_DIRECT_CHANNEL_TYPE_SHARED_MEMORY));
+    EXPECT_FALSE(ASensor_isDirectChannelTypeSupported(
+            mSensor, ASENSOR_DIRECT_CHANNEL_TYPE_HARDWARE_BUFFER));
+    EXPECT_EQ(ASensor_getHighestDirectReportRateLevel(mSensor), ASENSOR_DIRECT_RATE_FAST);
+}
+
+TEST_F(DirectChannelTest, RejectsTooSmallMemory) {
+    unique_fd fd(ashmem_create_region("DirectChannelTest", kRecordSize));
+    ASSERT_TRUE(fd.ok());
+    EXPECT_LT(ASensorManager_createSharedMemoryDirectChannel(mManager.get(), fd, 16), 0);
+}
+
+TEST_F(DirectChannelTest, ReportsIntoSharedMemory) {
+    const size_t size = kRecordSize * 8;
+    unique_fd fd(ashmem_create_region("DirectChannelTest", size));
+    ASSERT_TRUE(fd.ok());
+
+    int channelId = ASensorManager_createSharedMemoryDirectChannel(mManager.get(), fd, size);
+    ASSERT_GT(channelId, 0);
+
+    int token = ASensorManager_configureDirectReport(
+            mManager.get(), mSensor, channelId, ASENSOR_DIRECT_RATE_FAST);
+    ASSERT_GT(token, 0);
+
+    sp<FakeDirectReportChannel> channel = mService->getLastDirectChannel();
+    ASSERT_NE(channel, nullptr);
+
+    Event event;
+    event.sensorHandle = 1;
+    event.sensorType = SensorType::ACCELEROMETER;
+    for (int i = 0; i < 3; ++i) {
+        event.timestamp = 1000 * (i + 1);
+        event.u.vec3.x = i;
+        event.u.vec3.y = 0.0f;
+        event.u.vec3.z = 9.8f;
+        event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+        channel->writeEvent(event);
+    }
+
+    void *mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ASSERT_NE(mem, MAP_FAILED);
+    for (int i = 0; i < 3; ++i) {
+        const uint8_t *record = static_cast<const uint8_t *>(mem) + i * kRecordSize;
+        const sensors_event_t *sensorEvent = reinterpret_cast<const sensors_event_t *>(record);
+        EXPECT_EQ(sensorEvent->version, static_cast<int32_t>(kRecordSize));
+        EXPECT_EQ(sensorEvent->sensor, token);
+        EXPECT_EQ(sensorEvent->type, ASENSOR_TYPE_ACCELEROMETER);
+        EXPECT_EQ(static_cast<uint32_t>(sensorEvent->reserved0), static_cast<uint32_t>(i + 1));
+        EXPECT_EQ(sensorEvent->timestamp, 1000 * (i + 1));
+        EXPECT_EQ(sensorEvent->acceleration.x, static_cast<float>(i));
+    }
+    munmap(mem, size);
+
+    EXPECT_EQ(ASensorManager_configureDirectReport(
+            mManager.get(), mSensor, channelId, ASENSOR_DIRECT_RATE_STOP), 0);
+    ASensorManager_destroyDirectChannel(mManager.get(), channelId);
+    EXPECT_LT(ASensorManager_configureDirectReport(
+            mManager.get(), mSensor, channelId, ASENSOR_DIRECT_RATE_FAST), 0);
+}
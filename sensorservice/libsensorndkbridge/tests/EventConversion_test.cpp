@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventConversion.h"
+
+#include <gtest/gtest.h>
+#include <sensors/convert.h>
+#include <string.h>
+
+#include <vector>
+
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorType;
+using android::hardware::sensors::V1_0::implementation::convertToSensorEvent;
+
+static const SensorType kAllTypes[] = {
+        SensorType::META_DATA,
+        SensorType::ACCELEROMETER,
+        SensorType::MAGNETIC_FIELD,
+        SensorType::ORIENTATION,
+        SensorType::GYROSCOPE,
+        SensorType::LIGHT,
+        SensorType::PRESSURE,
+        SensorType::TEMPERATURE,
+        SensorType::PROXIMITY,
+        SensorType::GRAVITY,
+        SensorType::LINEAR_ACCELERATION,
+        SensorType::ROTATION_VECTOR,
+        SensorType::RELATIVE_HUMIDITY,
+        SensorType::AMBIENT_TEMPERATURE,
+        SensorType::MAGNETIC_FIELD_UNCALIBRATED,
+        SensorType::GAME_ROTATION_VECTOR,
+        SensorType::GYROSCOPE_UNCALIBRATED,
+        SensorType::SIGNIFICANT_MOTION,
+        SensorType::STEP_DETECTOR,
+        SensorType::STEP_COUNTER,
+        SensorType::GEOMAGNETIC_ROTATION_VECTOR,
+        SensorType::HEART_RATE,
+        SensorType::TILT_DETECTOR,
+        SensorType::WAKE_GESTURE,
+        SensorType::GLANCE_GESTURE,
+        SensorType::PICK_UP_GESTURE,
+        SensorType::WRIST_TILT_GESTURE,
+        SensorType::DEVICE_ORIENTATION,
+        SensorType::POSE_6DOF,
+        SensorType::STATIONARY_DETECT,
+        SensorType::MOTION_DETECT,
+        SensorType::HEART_BEAT,
+        SensorType::DYNAMIC_SENSOR_META,
+        SensorType::ADDITIONAL_INFO,
+        SensorType::LOW_LATENCY_OFFBODY_DETECT,
+        SensorType::ACCELEROMETER_UNCALIBRATED,
+        SensorType::DEVICE_PRIVATE_BASE,
+        static_cast<SensorType>(static_cast<int32_t>(SensorType::DEVICE_PRIVATE_BASE) + 1),
+};
+
+// Fills the whole payload, so every field of every type gets a distinct value.
+static Event makeEvent(SensorType type, int32_t seed) {
+    Event event;
+    event.sensorHandle = seed;
+    event.sensorType = type;
+    event.timestamp = 1000 * seed;
+    for (size_t i = 0; i < 16; ++i) {
+        event.u.data[i] = seed + 0.25f * i;
+    }
+    // Keep the status bytes valid values of SensorStatus.
+    if (type == SensorType::HEART_RATE) {
+        event.u.heartRate.status = static_cast<decltype(event.u.heartRate.status)>(seed % 4);
+    } else {
+        event.u.vec3.status = static_cast<decltype(event.u.vec3.status)>(seed % 4);
+    }
+    return event;
+}
+
+// Fills dst with the same garbage before converting, so the comparison also
+// catches fields written by one conversion but not the other.
+static void expectSameConversion(const Event &event, const sensors_event_t &converted) {
+    sensors_event_t expected;
+    memset(&expected, 0xa5, sizeof(expected));
+    convertToSensorEvent(event, &expected);
+    EXPECT_EQ(memcmp(&converted, &expected, sizeof(expected)), 0)
+            << "type " << static_cast<int32_t>(event.sensorType);
+}
+
+TEST(EventConversionTest, SingleEventsMatchConvertToSensorEvent) {
+    int32_t seed = 1;
+    for (SensorType type : kAllTypes) {
+        Event event = makeEvent(type, seed++);
+        sensors_event_t converted;
+        memset(&converted, 0xa5, sizeof(converted));
+        convertSensorEvent(event, &converted);
+        expectSameConversion(event, converted);
+    }
+}
+
+TEST(EventConversionTest, BatchesMatchConvertToSensorEvent) {
+    // Runs of each type of various lengths, in a row and interleaved.
+    std::vector<Event> events;
+    int32_t seed = 1;
+    for (size_t run = 1; run <= 3; ++run) {
+        for (SensorType type : kAllTypes) {
+            for (size_t i = 0; i < run; ++i) {
+                events.push_back(makeEvent(type, seed++));
+            }
+        }
+    }
+    const size_t typeCount = sizeof(kAllTypes) / sizeof(kAllTypes[0]);
+    for (size_t i = 0; i < 64; ++i) {
+        events.push_back(makeEvent(kAllTypes[(i * 7) % typeCount], seed++));
+    }
+
+    std::vector<sensors_event_t> converted(events.size());
+    memset(converted.data(), 0xa5, converted.size() * sizeof(sensors_event_t));
+    convertSensorEvents(events.data(), events.size(), converted.data());
+
+    for (size_t i = 0; i < events.size(); ++i) {
+        expectSameConversion(events[i], converted[i]);
+    }
+}
+
+TEST(EventConversionTest, EmptyBatch) {
+    sensors_event_t converted;
+    memset(&converted, 0xa5, sizeof(converted));
+    convertSensorEvents(NULL, 0, &converted);
+
+    sensors_event_t untouched;
+    memset(&untouched, 0xa5, sizeof(untouched));
+    EXPECT_EQ(memcmp(&converted, &untouched, sizeof(untouched)), 0);
+}
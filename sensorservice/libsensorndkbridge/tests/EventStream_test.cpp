@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr int kIdent = 7;
+static constexpr int kTimeoutMillis = 1000;
+static constexpr int32_t kAccelerometer = 1;
+static constexpr int32_t kGyroscope = 2;
+static constexpr int64_t kReorderWindowNs = 100;
+
+static SensorInfo makeSensor(int32_t handle, SensorType type) {
+    SensorInfo info;
+    info.sensorHandle = handle;
+    info.name = "sensor";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = type;
+    info.typeAsString = "";
+    info.maxRange = 1.0f;
+    info.resolution = 1.0f;
+    info.power = 0.1f;
+    info.minDelay = 1000;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 0;
+    info.maxDelay = 1000000;
+    info.flags = 0;
+    return info;
+}
+
+static Event makeEvent(int32_t handle, int64_t timestamp) {
+    Event event;
+    event.sensorHandle = handle;
+    event.sensorType = handle == kAccelerometer ? SensorType::ACCELEROMETER
+                                                : SensorType::GYROSCOPE;
+    event.timestamp = timestamp;
+    event.u.vec3.x = 0.0f;
+    event.u.vec3.y = 0.0f;
+    event.u.vec3.z = 0.0f;
+    event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    return event;
+}
+
+class EventStreamTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({
+                makeSensor(kAccelerometer, SensorType::ACCELEROMETER),
+                makeSensor(kGyroscope, SensorType::GYROSCOPE),
+        });
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mStream = ASensorManager_createEventStream(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */,
+                kReorderWindowNs);
+        ASSERT_NE(mStream, nullptr);
+
+        ASSERT_EQ(ASensorEventStream_registerSensor(
+                          mStream, mManager->getSensorByHandle(kAccelerometer), 1000, 0),
+                  0);
+        ASSERT_EQ(ASensorEventStream_registerSensor(
+                          mStream, mManager->getSensorByHandle(kGyroscope), 1000, 0),
+                  0);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mStream != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventStream(mManager.get(), mStream), 0);
+        }
+    }
+
+    // Writes events to the service side and returns the timestamps of the
+    // events the stream delivers then.
+    std::vector<int64_t> deliver(const std::vector<Event> &events) {
+        EXPECT_TRUE(mServiceQueue->writeEvents(events));
+
+        int fd;
+        int pollEvents;
+        EXPECT_EQ(mLooper->pollOnce(kTimeoutMillis, &fd, &pollEvents, NULL /* outData */),
+                  kIdent);
+
+        ASensorEvent buffer[16];
+        ssize_t n = ASensorEventStream_getEvents(mStream, buffer, 16);
+        EXPECT_GE(n, 0);
+
+        std::vector<int64_t> timestamps;
+        for (ssize_t i = 0; i < n; ++i) {
+            timestamps.push_back(buffer[i].timestamp);
+        }
+        return timestamps;
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    sp<ALooper> mLooper;
+    ASensorEventStream *mStream = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_F(EventStreamTest, MergesInTimestampOrder) {
+    EXPECT_EQ(deliver({
+                      makeEvent(kAccelerometer, 1010),
+                      makeEvent(kAccelerometer, 1020),
+                      makeEvent(kAccelerometer, 1030),
+                      makeEvent(kGyroscope, 1005),
+                      makeEvent(kGyroscope, 1015),
+                      makeEvent(kGyroscope, 1025),
+              }),
+              std::vector<int64_t>({1005, 1010, 1015, 1020, 1025}));
+
+    // 1030 waits for the gyroscope to catch up.
+    EXPECT_EQ(deliver({makeEvent(kGyroscope, 1035)}), std::vector<int64_t>({1030}));
+}
+
+TEST_F(EventStreamTest, ReleasesAfterReorderWindow) {
+    EXPECT_TRUE(deliver({makeEvent(kAccelerometer, 1000)}).empty());
+    EXPECT_TRUE(deliver({makeEvent(kAccelerometer, 1050)}).empty());
+
+    // The gyroscope is silent, the accelerometer is 100ns ahead now.
+    EXPECT_EQ(deliver({makeEvent(kAccelerometer, 1100)}), std::vector<int64_t>({1000}));
+}
+
+TEST_F(EventStreamTest, DropsLateEvents) {
+    EXPECT_EQ(deliver({makeEvent(kAccelerometer, 1000), makeEvent(kAccelerometer, 1200)}),
+              std::vector<int64_t>({1000}));
+
+    // Older than what was delivered already.
+    EXPECT_EQ(deliver({makeEvent(kGyroscope, 950), makeEvent(kGyroscope, 1300)}),
+              std::vector<int64_t>({1200}));
+    EXPECT_EQ(ASensorEventStream_getDroppedEventCount(mStream), 1);
+}
+
+TEST_F(EventStreamTest, DisabledSensorDoesNotHoldBack) {
+    ASSERT_EQ(ASensorEventStream_disableSensor(
+                      mStream, mManager->getSensorByHandle(kGyroscope)),
+              0);
+
+    EXPECT_EQ(deliver({makeEvent(kAccelerometer, 1000), makeEvent(kAccelerometer, 1010)}),
+              std::vector<int64_t>({1000, 1010}));
+}
+
+TEST_F(EventStreamTest, SignalsAgainForEventsLeftBehind) {
+    EXPECT_TRUE(mServiceQueue->writeEvents({
+            makeEvent(kAccelerometer, 1010),
+            makeEvent(kAccelerometer, 1020),
+            makeEvent(kGyroscope, 1015),
+            makeEvent(kGyroscope, 1025),
+    }));
+    ASSERT_EQ(mLooper->pollOnce(kTimeoutMillis, NULL, NULL, NULL), kIdent);
+
+    ASensorEvent buffer[16];
+    ASSERT_EQ(ASensorEventStream_getEvents(mStream, buffer, 1), 1);
+    EXPECT_EQ(buffer[0].timestamp, 1010);
+
+    // 1015 and 1020 can go but didn't fit.
+    ASSERT_EQ(mLooper->pollOnce(0 /* timeoutMillis */, NULL, NULL, NULL), kIdent);
+    ASSERT_EQ(ASensorEventStream_getEvents(mStream, buffer, 16), 2);
+    EXPECT_EQ(buffer[0].timestamp, 1015);
+    EXPECT_EQ(buffer[1].timestamp, 1020);
+
+    // 1025 waits for the accelerometer, whose next event signals anyway.
+    EXPECT_EQ(mLooper->pollOnce(0 /* timeoutMillis */, NULL, NULL, NULL), ALOOPER_POLL_TIMEOUT);
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FakeSensorManager.h"
+
+#include <sensors/convert.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+using android::frameworks::sensorservice::V1_0::IDirectReportChannel;
+using android::frameworks::sensorservice::V1_0::IEventQueue;
+using android::frameworks::sensorservice::V1_0::Result;
+using android::frameworks::sensorservice::V1_1::EventQueueFlagBits;
+using android::hardware::EventFlag;
+using android::hardware::hidl_handle;
+using android::hardware::hidl_memory;
+using android::hardware::Return;
+using android::hardware::Status;
+using android::hardware::Void;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::RateLevel;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::hardware::sensors::V1_0::SensorsEventFormatOffset;
+using android::Mutex;
+using android::sp;
+
+static constexpr size_t kRecordSize = static_cast<size_t>(SensorsEventFormatOffset::TOTAL_LENGTH);
+
+static Status deadObject() {
+    return Status::fromExceptionCode(Status::EX_TRANSACTION_FAILED, "fake service killed");
+}
+
+FakeDirectReportChannel::FakeDirectReportChannel(void *mem, size_t size)
+    : mMem(static_cast<uint8_t *>(mem)), mSize(size), mOffset(0), mCounter(0), mToken(0) {}
+
+FakeDirectReportChannel::~FakeDirectReportChannel() {
+    munmap(mMem, mSize);
+}
+
+Return<void> FakeDirectReportChannel::configure(
+        int32_t sensorHandle, RateLevel rate, configure_cb _hidl_cb) {
+    mToken = (rate == RateLevel::STOP) ? 0 : sensorHandle + 1;
+    _hidl_cb(mToken, Result::OK);
+    return Void();
+}
+
+void FakeDirectReportChannel::writeEvent(const Event &event) {
+    if (mOffset + kRecordSize > mSize) {
+        mOffset = 0;
+    }
+
+    sensors_event_t record;
+    android::hardware::sensors::V1_0::implementation::convertToSensorEvent(event, &record);
+    record.version = kRecordSize;
+    record.sensor = mToken;
+    record.reserved0 = 0;
+
+    uint8_t *start = mMem + mOffset;
+    memcpy(start, &record, kRecordSize);
+
+    // The counter is written last, it is what tells readers that the record is
+    // complete.
+    uint32_t *counter = reinterpret_cast<uint32_t *>(
+            start + static_cast<size_t>(SensorsEventFormatOffset::ATOMIC_COUNTER));
+    __atomic_store_n(counter, ++mCounter, __ATOMIC_RELEASE);
+
+    mOffset += kRecordSize;
+}
+
+FakeEventQueue::FakeEventQueue(const sp<IEventQueueCallback> &callback)
+    : mCallback(callback), mEventFlag(nullptr), mDead(false), mConfigCallCount(0) {}
+
+FakeEventQueue::FakeEventQueue(size_t capacity)
+    : mEventQueue(new EventMessageQueue(capacity, true /* configureEventFlagWord */)),
+      mEventFlag(nullptr),
+      mDead(false),
+      mConfigCallCount(0) {
+    if (mEventQueue->isValid()) {
+        EventFlag::createEventFlag(mEventQueue->getEventFlagWord(), &mEventFlag);
+    }
+}
+
+FakeEventQueue::~FakeEventQueue() {
+    if (mEventFlag != nullptr) {
+        EventFlag::deleteEventFlag(&mEventFlag);
+    }
+}
+
+bool FakeEventQueue::writeEvents(const std::vector<Event> &events) {
+    if (mEventFlag == nullptr || !mEventQueue->write(events.data(), events.size())) {
+        return false;
+    }
+
+    mEventFlag->wake(static_cast<uint32_t>(EventQueueFlagBits::READ_AND_PROCESS));
+    return true;
+}
+
+Return<Result> FakeEventQueue::enableSensor(
+        int32_t sensorHandle, int32_t samplingPeriodUs, int64_t maxBatchReportLatencyUs) {
+    if (mDead) {
+        return deadObject();
+    }
+
+    ++mConfigCallCount;
+    Mutex::Autolock autoLock(mLock);
+    mSensorConfigs[sensorHandle] = {samplingPeriodUs, maxBatchReportLatencyUs};
+    return Result::OK;
+}
+
+Return<Result> FakeEventQueue::disableSensor(int32_t sensorHandle) {
+    if (mDead) {
+        return deadObject();
+    }
+
+    ++mConfigCallCount;
+    Mutex::Autolock autoLock(mLock);
+    mSensorConfigs.erase(sensorHandle);
+    return Result::OK;
+}
+
+bool FakeEventQueue::getSensorConfig(
+        int32_t sensorHandle, int32_t *samplingPeriodUs, int64_t *maxBatchReportLatencyUs) {
+    Mutex::Autolock autoLock(mLock);
+    auto it = mSensorConfigs.find(sensorHandle);
+    if (it == mSensorConfigs.end()) {
+        return false;
+    }
+    *samplingPeriodUs = it->second.samplingPeriodUs;
+    *maxBatchReportLatencyUs = it->second.maxBatchReportLatencyUs;
+    return true;
+}
+
+FakeSensorManager::FakeSensorManager(const std::vector<SensorInfo> &sensors, bool supportsFmq)
+    : mSensors(sensors),
+      mSupportsFmq(supportsFmq),
+      mSensorListCallCount(0),
+      mDefaultSensorCallCount(0),
+      mMaxEventQueues(SIZE_MAX),
+      mDead(false) {}
+
+void FakeSensorManager::kill() {
+    mDead = true;
+
+    Mutex::Autolock autoLock(mLock);
+    for (const auto &queue : mEventQueues) {
+        queue->kill();
+    }
+}
+
+Return<void> FakeSensorManager::getSensorList(getSensorList_cb _hidl_cb) {
+    if (mDead) {
+        return deadObject();
+    }
+
+    ++mSensorListCallCount;
+    _hidl_cb(mSensors, Result::OK);
+    return Void();
+}
+
+Return<void> FakeSensorManager::getDefaultSensor(SensorType type, getDefaultSensor_cb _hidl_cb) {
+    if (mDead) {
+        return deadObject();
+    }
+
+    ++mDefaultSensorCallCount;
+    for (const auto &sensor : mSensors) {
+        if (sensor.type == type) {
+            _hidl_cb(sensor, Result::OK);
+            return Void();
+        }
+    }
+    _hidl_cb(SensorInfo(), Result::NOT_EXIST);
+    return Void();
+}
+
+Return<void> FakeSensorManager::createAshmemDirectChannel(
+        const hidl_memory &mem, uint64_t size, createAshmemDirectChannel_cb _hidl_cb) {
+    if (size > mem.size() || size < kRecordSize || mem.handle() == nullptr
+            || mem.handle()->numFds != 1) {
+        _hidl_cb(nullptr, Result::BAD_VALUE);
+        return Void();
+    }
+
+    void *buf = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem.handle()->data[0], 0);
+    if (buf == MAP_FAILED) {
+        _hidl_cb(nullptr, Result::NO_MEMORY);
+        return Void();
+    }
+
+    sp<FakeDirectReportChannel> channel = new FakeDirectReportChannel(buf, size);
+    {
+        Mutex::Autolock autoLock(mLock);
+        mLastDirectChannel = channel;
+    }
+    _hidl_cb(channel, Result::OK);
+    return Void();
+}
+
+Return<void> FakeSensorManager::createGrallocDirectChannel(
+        const hidl_handle &, uint64_t, createGrallocDirectChannel_cb _hidl_cb) {
+    _hidl_cb(nullptr, Result::INVALID_OPERATION);
+    return Void();
+}
+
+Return<void> FakeSensorManager::createEventQueue(
+        const sp<IEventQueueCallback> &callback, createEventQueue_cb _hidl_cb) {
+    if (mDead) {
+        return deadObject();
+    }
+
+    if (callback == nullptr) {
+        _hidl_cb(nullptr, Result::BAD_VALUE);
+        return Void();
+    }
+
+    sp<FakeEventQueue> queue = new FakeEventQueue(callback);
+    if (!addEventQueue(queue)) {
+        _hidl_cb(nullptr, Result::NO_MEMORY);
+        return Void();
+    }
+    _hidl_cb(queue, Result::OK);
+    return Void();
+}
+
+Return<void> FakeSensorManager::createEventQueue_1_1(
+        const sp<IEventQueueCallback_1_1> &callback, int64_t maxDeliveryLatencyUs,
+        createEventQueue_1_1_cb _hidl_cb) {
+    if (maxDeliveryLatencyUs < 0) {
+        _hidl_cb(nullptr, Result::BAD_VALUE);
+        return Void();
+    }
+
+    return createEventQueue(callback, _hidl_cb);
+}
+
+Return<void> FakeSensorManager::createFmqEventQueue(
+        uint32_t capacity, int64_t maxDeliveryLatencyUs, createFmqEventQueue_cb _hidl_cb) {
+    if (mDead) {
+        return deadObject();
+    }
+
+    if (!mSupportsFmq) {
+        _hidl_cb(nullptr, FakeEventQueue::EventMessageQueue::Descriptor(),
+                 Result::INVALID_OPERATION);
+        return Void();
+    }
+
+    if (capacity == 0 || maxDeliveryLatencyUs < 0) {
+        _hidl_cb(nullptr, FakeEventQueue::EventMessageQueue::Descriptor(), Result::BAD_VALUE);
+        return Void();
+    }
+
+    sp<FakeEventQueue> queue = new FakeEventQueue(capacity);
+    if (queue->getEventQueue() == nullptr || !queue->getEventQueue()->isValid()) {
+        _hidl_cb(nullptr, FakeEventQueue::EventMessageQueue::Descriptor(), Result::NO_MEMORY);
+        return Void();
+    }
+
+    if (!addEventQueue(queue)) {
+        _hidl_cb(nullptr, FakeEventQueue::EventMessageQueue::Descriptor(), Result::NO_MEMORY);
+        return Void();
+    }
+    _hidl_cb(queue, *queue->getEventQueue()->getDesc(), Result::OK);
+    return Void();
+}
+
+bool FakeSensorManager::addEventQueue(const sp<FakeEventQueue> &queue) {
+    Mutex::Autolock autoLock(mLock);
+    if (mEventQueues.size() >= mMaxEventQueues) {
+        return false;
+    }
+
+    mLastEventQueue = queue;
+    mEventQueues.push_back(queue);
+    return true;
+}
+
+void FakeSensorManager::setMaxEventQueues(size_t count) {
+    Mutex::Autolock autoLock(mLock);
+    mMaxEventQueues = count;
+}
+
+size_t FakeSensorManager::getEventQueueCount() {
+    Mutex::Autolock autoLock(mLock);
+    return mEventQueues.size();
+}
+
+sp<FakeDirectReportChannel> FakeSensorManager::getLastDirectChannel() {
+    Mutex::Autolock autoLock(mLock);
+    return mLastDirectChannel;
+}
+
+sp<FakeEventQueue> FakeSensorManager::getLastEventQueue() {
+    Mutex::Autolock autoLock(mLock);
+    return mLastEventQueue;
+}
+
+SensorInfo makeGyroscope() {
+    SensorInfo info;
+    info.sensorHandle = kGyroscopeHandle;
+    info.name = "gyroscope";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = SensorType::GYROSCOPE;
+    info.typeAsString = "android.sensor.gyroscope";
+    info.maxRange = 34.9f;
+    info.resolution = 0.001f;
+    info.power = 0.1f;
+    info.minDelay = 1000;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 512;
+    info.maxDelay = 1000000;
+    info.flags = 0;
+    return info;
+}
+
+Event makeGyroscopeEvent(int64_t timestamp, float x) {
+    Event event;
+    event.sensorHandle = kGyroscopeHandle;
+    event.sensorType = SensorType::GYROSCOPE;
+    event.timestamp = timestamp;
+    event.u.vec3.x = x;
+    event.u.vec3.y = 0.0f;
+    event.u.vec3.z = 0.0f;
+    event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    return event;
+}
+
+bool deliver(const sp<FakeEventQueue> &serviceQueue, const std::vector<Event> &events) {
+    if (serviceQueue->getEventQueue() != nullptr) {
+        return serviceQueue->writeEvents(events);
+    }
+
+    sp<FakeSensorManager::IEventQueueCallback_1_1> callback_1_1 =
+            FakeSensorManager::IEventQueueCallback_1_1::castFrom(serviceQueue->getCallback());
+    if (events.size() > 1 && callback_1_1 != nullptr) {
+        callback_1_1->onEvents(events);
+        return true;
+    }
+
+    for (const Event &event : events) {
+        serviceQueue->getCallback()->onEvent(event);
+    }
+    return true;
+}
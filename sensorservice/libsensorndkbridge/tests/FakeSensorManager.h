@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_SENSOR_MANAGER_H_
+
+#define FAKE_SENSOR_MANAGER_H_
+
+#include <android/frameworks/sensorservice/1.1/ISensorManager.h>
+#include <android-base/macros.h>
+#include <fmq/EventFlag.h>
+#include <fmq/MessageQueue.h>
+#include <utils/Mutex.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
+
+// In-process stand-in for the sensor service, used to exercise the bridge
+// without a device.
+struct FakeDirectReportChannel
+    : public android::frameworks::sensorservice::V1_0::IDirectReportChannel {
+    using Event = android::hardware::sensors::V1_0::Event;
+    using RateLevel = android::hardware::sensors::V1_0::RateLevel;
+
+    FakeDirectReportChannel(void *mem, size_t size);
+    ~FakeDirectReportChannel();
+
+    android::hardware::Return<void> configure(
+            int32_t sensorHandle, RateLevel rate, configure_cb _hidl_cb) override;
+
+    // Appends one record in the SensorsEventFormatOffset layout, like the HAL
+    // does for every sample of a configured sensor.
+    void writeEvent(const Event &event);
+
+    int32_t getToken() const { return mToken; }
+
+private:
+    uint8_t *mMem;
+    size_t mSize;
+    size_t mOffset;
+    uint32_t mCounter;
+    int32_t mToken;
+
+    DISALLOW_COPY_AND_ASSIGN(FakeDirectReportChannel);
+};
+
+struct FakeEventQueue : public android::frameworks::sensorservice::V1_0::IEventQueue {
+    using Event = android::hardware::sensors::V1_0::Event;
+    using EventMessageQueue =
+            android::hardware::MessageQueue<Event, android::hardware::kSynchronizedReadWrite>;
+    using IEventQueueCallback = android::frameworks::sensorservice::V1_0::IEventQueueCallback;
+    using Result = android::frameworks::sensorservice::V1_0::Result;
+
+    // Delivers events to callback.
+    explicit FakeEventQueue(const android::sp<IEventQueueCallback> &callback);
+    // Delivers events through a message queue of the given capacity.
+    explicit FakeEventQueue(size_t capacity);
+    ~FakeEventQueue();
+
+    android::hardware::Return<Result> enableSensor(
+            int32_t sensorHandle, int32_t samplingPeriodUs,
+            int64_t maxBatchReportLatencyUs) override;
+    android::hardware::Return<Result> disableSensor(int32_t sensorHandle) override;
+
+    android::sp<IEventQueueCallback> getCallback() const { return mCallback; }
+    const EventMessageQueue *getEventQueue() const { return mEventQueue.get(); }
+
+    // Writes events to the message queue and wakes up the reader, like the
+    // service does after reading from the sensors. Returns false if they
+    // don't fit.
+    bool writeEvents(const std::vector<Event> &events);
+
+    // Returns false if the sensor isn't enabled.
+    bool getSensorConfig(
+            int32_t sensorHandle, int32_t *samplingPeriodUs, int64_t *maxBatchReportLatencyUs);
+
+    // Number of enableSensor and disableSensor calls so far.
+    int getConfigCallCount() const { return mConfigCallCount; }
+
+    // Makes all further calls fail like calls to a dead service.
+    void kill() { mDead = true; }
+
+private:
+    struct SensorConfig {
+        int32_t samplingPeriodUs;
+        int64_t maxBatchReportLatencyUs;
+    };
+
+    android::sp<IEventQueueCallback> mCallback;
+    std::unique_ptr<EventMessageQueue> mEventQueue;
+    android::hardware::EventFlag *mEventFlag;
+    std::atomic_bool mDead;
+    std::atomic_int mConfigCallCount;
+
+    android::Mutex mLock;
+    std::map<int32_t, SensorConfig> mSensorConfigs;
+
+    DISALLOW_COPY_AND_ASSIGN(FakeEventQueue);
+};
+
+struct FakeSensorManager : public android::frameworks::sensorservice::V1_1::ISensorManager {
+    using SensorInfo = android::hardware::sensors::V1_0::SensorInfo;
+    using SensorType = android::hardware::sensors::V1_0::SensorType;
+    using IEventQueueCallback = android::frameworks::sensorservice::V1_0::IEventQueueCallback;
+    using IEventQueueCallback_1_1 = android::frameworks::sensorservice::V1_1::IEventQueueCallback;
+
+    // supportsFmq controls whether createFmqEventQueue succeeds, to exercise
+    // the fallback to callbacks.
+    explicit FakeSensorManager(const std::vector<SensorInfo> &sensors, bool supportsFmq = true);
+
+    android::hardware::Return<void> getSensorList(getSensorList_cb _hidl_cb) override;
+    android::hardware::Return<void> getDefaultSensor(
+            SensorType type, getDefaultSensor_cb _hidl_cb) override;
+    android::hardware::Return<void> createAshmemDirectChannel(
+            const android::hardware::hidl_memory &mem, uint64_t size,
+            createAshmemDirectChannel_cb _hidl_cb) override;
+    android::hardware::Return<void> createGrallocDirectChannel(
+            const android::hardware::hidl_handle &buffer, uint64_t size,
+            createGrallocDirectChannel_cb _hidl_cb) override;
+    android::hardware::Return<void> createEventQueue(
+            const android::sp<IEventQueueCallback> &callback,
+            createEventQueue_cb _hidl_cb) override;
+    android::hardware::Return<void> createEventQueue_1_1(
+            const android::sp<IEventQueueCallback_1_1> &callback, int64_t maxDeliveryLatencyUs,
+            createEventQueue_1_1_cb _hidl_cb) override;
+    android::hardware::Return<void> createFmqEventQueue(
+            uint32_t capacity, int64_t maxDeliveryLatencyUs,
+            createFmqEventQueue_cb _hidl_cb) override;
+
+    android::sp<FakeDirectReportChannel> getLastDirectChannel();
+    android::sp<FakeEventQueue> getLastEventQueue();
+
+    // Number of calls of the catalog methods, to check what the bridge caches.
+    int getSensorListCallCount() const { return mSensorListCallCount; }
+    int getDefaultSensorCallCount() const { return mDefaultSensorCallCount; }
+
+    // Makes event queue creations fail with NO_MEMORY once count queues
+    // exist, to exercise partial failures.
+    void setMaxEventQueues(size_t count);
+    // Number of event queues created so far.
+    size_t getEventQueueCount();
+
+    // Makes the service and all its event queues behave as if it died. The
+    // bridge has to be notified separately, there is no death notification
+    // in-process.
+    void kill();
+
+private:
+    std::vector<SensorInfo> mSensors;
+    const bool mSupportsFmq;
+    std::atomic_int mSensorListCallCount;
+    std::atomic_int mDefaultSensorCallCount;
+
+    android::Mutex mLock;
+    android::sp<FakeDirectReportChannel> mLastDirectChannel;
+    android::sp<FakeEventQueue> mLastEventQueue;
+    std::vector<android::sp<FakeEventQueue>> mEventQueues;
+    size_t mMaxEventQueues;
+    std::atomic_bool mDead;
+
+    // Returns false if the queue limit is reached.
+    bool addEventQueue(const android::sp<FakeEventQueue> &queue);
+
+    DISALLOW_COPY_AND_ASSIGN(FakeSensorManager);
+};
+
+// The sensor most tests run against, and its events.
+static constexpr int32_t kGyroscopeHandle = 2;
+android::hardware::sensors::V1_0::SensorInfo makeGyroscope();
+android::hardware::sensors::V1_0::Event makeGyroscopeEvent(int64_t timestamp, float x = 1.0f);
+
+// Sends events to the client of serviceQueue through whichever transport it
+// uses: the message queue if it has one, otherwise onEvent for a single
+// event and onEvents for more. Returns false if they don't fit in the message
+// queue.
+bool deliver(const android::sp<FakeEventQueue> &serviceQueue,
+             const std::vector<android::hardware::sensors::V1_0::Event> &events);
+
+#endif  // FAKE_SENSOR_MANAGER_H_
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using android::hardware::sensors::V1_0::AdditionalInfoType;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr int kIdent = 7;
+static constexpr int kTimeoutMillis = 1000;
+
+static Event makeAdditionalInfoEvent(int64_t timestamp) {
+    Event event;
+    event.sensorHandle = 2;
+    event.sensorType = SensorType::ADDITIONAL_INFO;
+    event.timestamp = timestamp;
+    event.u.additional.type = AdditionalInfoType::AINFO_BEGIN;
+    event.u.additional.serial = 0;
+    return event;
+}
+
+class FmqEventQueueTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeGyroscope()});
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        ASensorList list;
+        ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 1);
+        mSensor = list[0];
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+        ASSERT_EQ(ASensorEventQueue_enableSensor(mQueue, mSensor), 0);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+        ASSERT_NE(mServiceQueue->getEventQueue(), nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mSensor;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_F(FmqEventQueueTest, ReadsEventsFromSharedMemory) {
+    ASSERT_TRUE(mServiceQueue->writeEvents({
+            makeGyroscopeEvent(1000, 1.0f),
+            makeGyroscopeEvent(2000, 2.0f),
+            makeGyroscopeEvent(3000, 3.0f),
+    }));
+
+    int fd;
+    int events;
+    EXPECT_EQ(mLooper->pollOnce(kTimeoutMillis, &fd, &events, NULL /* outData */), kIdent);
+    EXPECT_EQ(events, ALOOPER_EVENT_INPUT);
+    EXPECT_GT(ASensorEventQueue_hasEvents(mQueue), 0);
+
+    ASensorEvent buffer[8];
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, buffer, 8), 3);
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(buffer[i].type, ASENSOR_TYPE_GYROSCOPE);
+        EXPECT_EQ(buffer[i].timestamp, 1000 * (i + 1));
+        EXPECT_EQ(buffer[i].vector.x, static_cast<float>(i + 1));
+    }
+
+    EXPECT_EQ(ASensorEventQueue_hasEvents(mQueue), 0);
+    EXPECT_EQ(mLooper->pollOnce(0 /* timeoutMillis */, NULL, NULL, NULL), ALOOPER_POLL_TIMEOUT);
+}
+
+TEST_F(FmqEventQueueTest, ReadsInChunks) {
+    std::vector<Event> written;
+    for (int i = 0; i < 10; ++i) {
+        written.push_back(makeGyroscopeEvent(1000 * (i + 1), i));
+    }
+    ASSERT_TRUE(mServiceQueue->writeEvents(written));
+    EXPECT_EQ(mLooper->pollOnce(kTimeoutMillis, NULL, NULL, NULL), kIdent);
+
+    ASensorEvent buffer[4];
+    size_t pending;
+    EXPECT_EQ(ASensorEventQueue_getEventsBatch(mQueue, buffer, 4, &pending), 4);
+    EXPECT_EQ(pending, 6u);
+    EXPECT_EQ(buffer[3].timestamp, 4000);
+
+    // Events left behind keep the queue's fd signaled.
+    EXPECT_EQ(mLooper->pollOnce(0 /* timeoutMillis */, NULL, NULL, NULL), kIdent);
+    EXPECT_EQ(ASensorEventQueue_getEventsBatch(mQueue, buffer, 4, &pending), 4);
+    EXPECT_EQ(ASensorEventQueue_getEventsBatch(mQueue, buffer, 4, &pending), 2);
+    EXPECT_EQ(pending, 0u);
+    EXPECT_EQ(buffer[1].timestamp, 10000);
+}
+
+TEST_F(FmqEventQueueTest, FiltersAdditionalInfoUnlessRequested) {
+    ASSERT_TRUE(mServiceQueue->writeEvents({
+            makeAdditionalInfoEvent(1000),
+            makeGyroscopeEvent(2000, 2.0f),
+    }));
+
+    ASensorEvent buffer[4];
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, buffer, 4), 1);
+    EXPECT_EQ(buffer[0].type, ASENSOR_TYPE_GYROSCOPE);
+
+    ASSERT_EQ(ASensorEventQueue_requestAdditionalInfoEvents(mQueue, true), 0);
+    ASSERT_TRUE(mServiceQueue->writeEvents({makeAdditionalInfoEvent(3000)}));
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, buffer, 4), 1);
+    EXPECT_EQ(buffer[0].type, ASENSOR_TYPE_ADDITIONAL_INFO);
+}
+
+TEST(FmqEventQueueFallbackTest, UsesCallbacksWithoutSharedMemorySupport) {
+    sp<FakeSensorManager> service = new FakeSensorManager({makeGyroscope()}, false /* supportsFmq */);
+    ASensorManager manager(service);
+    ASSERT_EQ(manager.initCheck(), android::OK);
+
+    sp<ALooper> looper = new ALooper(true /* allowNonCallbacks */);
+    ASensorEventQueue *queue = ASensorManager_createEventQueue(
+            &manager, looper.get(), kIdent, NULL /* callback */, NULL /* data */);
+    ASSERT_NE(queue, nullptr);
+
+    sp<FakeEventQueue> serviceQueue = service->getLastEventQueue();
+    ASSERT_NE(serviceQueue, nullptr);
+    EXPECT_EQ(serviceQueue->getEventQueue(), nullptr);
+    ASSERT_NE(serviceQueue->getCallback(), nullptr);
+
+    ASSERT_TRUE(deliver(serviceQueue, {makeGyroscopeEvent(1000, 1.0f)}));
+    EXPECT_EQ(looper->pollOnce(kTimeoutMillis, NULL, NULL, NULL), kIdent);
+
+    ASensorEvent event;
+    ASSERT_EQ(ASensorEventQueue_getEvents(queue, &event, 1), 1);
+    EXPECT_EQ(event.timestamp, 1000);
+
+    EXPECT_EQ(ASensorManager_destroyEventQueue(&manager, queue), 0);
+}
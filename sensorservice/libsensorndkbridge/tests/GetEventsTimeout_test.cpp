@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <utils/Timers.h>
+
+#include <thread>
+#include <vector>
+
+using android::sp;
+
+static constexpr int kIdent = 4;
+static constexpr int64_t kMillisNs = 1000000;
+
+class GetEventsTimeoutTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeGyroscope()}, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+        ASSERT_EQ(ASensorEventQueue_enableSensor(
+                          mQueue, mManager->getSensorByHandle(kGyroscopeHandle)),
+                  0);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_P(GetEventsTimeoutTest, TimesOutWithoutEvents) {
+    ASensorEvent buffer[8];
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    EXPECT_EQ(ASensorEventQueue_getEventsTimeout(mQueue, buffer, 8, 1, 20 * kMillisNs), 0);
+    EXPECT_GE(systemTime(SYSTEM_TIME_MONOTONIC) - start, 20 * kMillisNs);
+}
+
+TEST_P(GetEventsTimeoutTest, ReturnsPendingEventsRightAway) {
+    EXPECT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(1)}));
+    EXPECT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(2)}));
+
+    ASensorEvent buffer[8];
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    EXPECT_EQ(ASensorEventQueue_getEventsTimeout(mQueue, buffer, 8, 2, 1000 * kMillisNs), 2);
+    EXPECT_LT(systemTime(SYSTEM_TIME_MONOTONIC) - start, 500 * kMillisNs);
+}
+
+TEST_P(GetEventsTimeoutTest, WaitsForMinCount) {
+    std::thread producer([this] {
+        for (int i = 1; i <= 5; ++i) {
+            usleep(2000);
+            EXPECT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(i)}));
+        }
+    });
+
+    ASensorEvent buffer[8];
+    ssize_t n = ASensorEventQueue_getEventsTimeout(mQueue, buffer, 8, 5, -1 /* timeoutNs */);
+    producer.join();
+
+    ASSERT_EQ(n, 5);
+    EXPECT_EQ(buffer[4].timestamp, 5);
+}
+
+TEST_P(GetEventsTimeoutTest, ReturnsWhatArrivedOnTimeout) {
+    EXPECT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(1)}));
+    EXPECT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(2)}));
+
+    ASensorEvent buffer[8];
+    EXPECT_EQ(ASensorEventQueue_getEventsTimeout(mQueue, buffer, 8, 5, 10 * kMillisNs), 2);
+}
+
+TEST_P(GetEventsTimeoutTest, ZeroTimeoutDoesNotWait) {
+    ASensorEvent buffer[8];
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    EXPECT_EQ(ASensorEventQueue_getEventsTimeout(mQueue, buffer, 8, 1, 0), 0);
+    EXPECT_LT(systemTime(SYSTEM_TIME_MONOTONIC) - start, 500 * kMillisNs);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, GetEventsTimeoutTest, ::testing::Bool());
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+#include "LatencyStats.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <utils/SystemClock.h>
+
+#include <vector>
+
+using android::sp;
+
+static constexpr int kIdent = 9;
+static constexpr int64_t kMillisNs = 1000000;
+
+TEST(LatencyHistogramTest, EmptySummary) {
+    LatencyHistogram histogram;
+    ASensorLatencySummary summary;
+    histogram.getSummary(&summary);
+    EXPECT_EQ(summary.count, 0u);
+    EXPECT_EQ(summary.meanNs, 0);
+    EXPECT_EQ(summary.p50Ns, 0);
+    EXPECT_EQ(summary.maxNs, 0);
+}
+
+TEST(LatencyHistogramTest, PercentilesWithinBucketPrecision) {
+    LatencyHistogram histogram;
+    for (int64_t i = 1; i <= 1000; ++i) {
+        histogram.record(i * 1000);
+    }
+
+    ASensorLatencySummary summary;
+    histogram.getSummary(&summary);
+    EXPECT_EQ(summary.count, 1000u);
+    EXPECT_EQ(summary.meanNs, 500500);
+    EXPECT_EQ(summary.maxNs, 1000000);
+
+    auto expectNear = [](int64_t actual, int64_t expected) {
+        EXPECT_GE(actual, expected);
+        EXPECT_LE(actual, expected + expected / LatencyHistogram::kSubBuckets);
+    };
+    expectNear(summary.p50Ns, 500000);
+    expectNear(summary.p90Ns, 900000);
+    expectNear(summary.p99Ns, 990000);
+}
+
+TEST(LatencyHistogramTest, ClampsOutOfRangeValues) {
+    LatencyHistogram histogram;
+    histogram.record(-5);
+    histogram.record(LatencyHistogram::kMaxValueNs * 4);
+
+    ASensorLatencySummary summary;
+    histogram.getSummary(&summary);
+    EXPECT_EQ(summary.count, 2u);
+    EXPECT_EQ(summary.p50Ns, 0);
+    EXPECT_EQ(summary.p99Ns, LatencyHistogram::kMaxValueNs);
+    EXPECT_EQ(summary.maxNs, LatencyHistogram::kMaxValueNs * 4);
+}
+
+TEST(SensorLatencyStatsTest, TracksUpToMaxSensors) {
+    SensorLatencyStats stats;
+    for (size_t i = 0; i <= SensorLatencyStats::kMaxSensors; ++i) {
+        stats.recordArrival(static_cast<int32_t>(i * SensorLatencyStats::kMaxSensors), 100);
+    }
+
+    ASensorLatencySummary arrival;
+    ASensorLatencySummary drain;
+    for (size_t i = 0; i < SensorLatencyStats::kMaxSensors; ++i) {
+        ASSERT_TRUE(stats.getSummaries(
+                static_cast<int32_t>(i * SensorLatencyStats::kMaxSensors), &arrival, &drain));
+        EXPECT_EQ(arrival.count, 1u);
+        EXPECT_EQ(drain.count, 0u);
+    }
+    EXPECT_FALSE(stats.getSummaries(
+            static_cast<int32_t>(SensorLatencyStats::kMaxSensors * SensorLatencyStats::kMaxSensors),
+            &arrival, &drain));
+}
+
+class QueueLatencyTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeGyroscope()}, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mSensor = mManager->getSensorByHandle(kGyroscopeHandle);
+        ASSERT_NE(mSensor, nullptr);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+        ASSERT_EQ(ASensorEventQueue_enableSensor(mQueue, mSensor), 0);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mSensor;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_P(QueueLatencyTest, NotTrackedByDefault) {
+    ASSERT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(android::elapsedRealtimeNano())}));
+
+    ASensorEvent buffer[4];
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, buffer, 4), 1);
+
+    ASensorLatencySummary arrival;
+    EXPECT_LT(ASensorEventQueue_getLatencyStats(mQueue, mSensor, &arrival, NULL), 0);
+}
+
+TEST_P(QueueLatencyTest, RecordsArrivalAndDrain) {
+    ASSERT_EQ(ASensorEventQueue_setLatencyTracking(mQueue, true), 0);
+
+    int64_t sensorTimestamp = android::elapsedRealtimeNano() - 5 * kMillisNs;
+    ASSERT_TRUE(deliver(mServiceQueue, {makeGyroscopeEvent(sensorTimestamp),
+                                        makeGyroscopeEvent(sensorTimestamp)}));
+    usleep(2000);
+
+    ASensorEvent buffer[4];
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, buffer, 4), 2);
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(buffer[i].reserved1[0], 0);
+        EXPECT_EQ(buffer[i].reserved1[1], 0);
+    }
+
+    ASensorLatencySummary arrival;
+    ASensorLatencySummary drain;
+    ASSERT_EQ(ASensorEventQueue_getLatencyStats(mQueue, mSensor, &arrival, &drain), 0);
+    EXPECT_EQ(arrival.count, 2u);
+    EXPECT_GE(arrival.maxNs, 5 * kMillisNs);
+
+    if (GetParam()) {
+        // Read straight out of shared memory, arrival includes the wait.
+        EXPECT_GE(arrival.maxNs, 7 * kMillisNs);
+        EXPECT_EQ(drain.count, 0u);
+    } else {
+        EXPECT_EQ(drain.count, 2u);
+        EXPECT_GE(drain.p50Ns, 2 * kMillisNs);
+    }
+
+    ASSERT_EQ(ASensorEventQueue_setLatencyTracking(mQueue, true), 0);
+    ASSERT_EQ(ASensorEventQueue_getLatencyStats(mQueue, mSensor, &arrival, &drain), 0);
+    EXPECT_EQ(arrival.count, 0u);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, QueueLatencyTest, ::testing::Bool());
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorEventQueue.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+#include <sensorndkbridge/sensor_bridge.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using android::hardware::sensors::V1_0::Event;
+using android::sp;
+
+static constexpr int kIdent = 4;
+static constexpr size_t kBatchSize = 16;
+static constexpr int kIterations = 10;
+static constexpr size_t kRecordedEvents = 4096;
+
+// What each of the queues destroyed together does, so that their producers
+// take every lock they can take while invalidate() waits for them.
+enum QueueRole {
+    PLAIN,        // read by the test thread
+    DECIMATED,    // LATEST decimation, producers take mDecimatorLock
+    RECORDED,     // producers take mRecorderLock
+    WAITED_ON,    // read by a thread in getEventsTimeout, producers take mWaitLock
+    kQueueCount,
+};
+
+// Destroys queues while events keep coming in, meant to be run under TSAN as
+// well. The service only learns about the destruction asynchronously, so it
+// may deliver events to a queue at any point of its destruction.
+class LifecycleTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeGyroscope()}, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mStop = false;
+    }
+
+    // Starts a producer delivering events to the service side of a queue
+    // until mStop is set. There is one per queue, like the service: shared
+    // memory queues have a single writer, and oneway calls to the callback
+    // are serialized. Producers of different queues run concurrently.
+    void startProducer(const sp<FakeEventQueue> &serviceQueue) {
+        mProducers.emplace_back([this, serviceQueue] {
+            std::vector<Event> events(kBatchSize);
+            int64_t timestamp = 0;
+            while (!mStop.load()) {
+                for (size_t i = 0; i < kBatchSize; ++i) {
+                    events[i] = makeGyroscopeEvent(++timestamp);
+                }
+                // Writes fail whenever the reader fell behind, which is fine.
+                deliver(serviceQueue, events);
+                deliver(serviceQueue, {makeGyroscopeEvent(++timestamp)});
+            }
+        });
+    }
+
+    void stopProducers() {
+        mStop = true;
+        for (std::thread &producer : mProducers) {
+            producer.join();
+        }
+        mProducers.clear();
+        mStop = false;
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    sp<ALooper> mLooper;
+    std::atomic_bool mStop;
+    std::vector<std::thread> mProducers;
+};
+
+TEST_P(LifecycleTest, DestroyWhileEventsArrive) {
+    ASensorRef sensor = mManager->getSensorByHandle(kGyroscopeHandle);
+    for (int iteration = 0; iteration < kIterations; ++iteration) {
+        ASensorEventQueue *queues[kQueueCount];
+        // Like the service, hold on to the queues past their destruction.
+        sp<ASensorEventQueue> keepAlive[kQueueCount];
+        sp<FakeEventQueue> serviceQueues[kQueueCount];
+        TemporaryFile trace;
+        for (int role = 0; role < kQueueCount; ++role) {
+            queues[role] = ASensorManager_createEventQueue(
+                    mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+            ASSERT_NE(queues[role], nullptr);
+            keepAlive[role] = queues[role];
+            serviceQueues[role] = mService->getLastEventQueue();
+            ASSERT_EQ(ASensorEventQueue_enableSensor(queues[role], sensor), 0);
+        }
+        ASSERT_EQ(ASensorEventQueue_setDecimation(
+                          queues[DECIMATED], sensor, ASENSOR_DECIMATION_LATEST, 0),
+                  0);
+        ASSERT_EQ(ASensorManager_startEventQueueRecording(
+                          mManager.get(), queues[RECORDED], trace.path, kRecordedEvents),
+                  0);
+
+        // Blocks in getEventsTimeout until the queue is destroyed.
+        std::atomic_bool destroyed(false);
+        std::thread waiter([queue = queues[WAITED_ON], &destroyed] {
+            ASensorEvent buffer[kBatchSize];
+            while (!destroyed.load()) {
+                ASensorEventQueue_getEventsTimeout(
+                        queue, buffer, kBatchSize, kBatchSize, -1 /* timeoutNs */);
+            }
+        });
+
+        for (const sp<FakeEventQueue> &serviceQueue : serviceQueues) {
+            startProducer(serviceQueue);
+        }
+
+        // Consume for a bit so both sides of the rings are busy.
+        ASensorEvent buffer[kBatchSize];
+        for (int i = 0; i < 50; ++i) {
+            for (int role : {PLAIN, DECIMATED, RECORDED}) {
+                ASensorEventQueue_getEvents(queues[role], buffer, kBatchSize);
+            }
+            usleep(50);
+        }
+
+        for (ASensorEventQueue *queue : queues) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+        }
+        // Shared memory events count as received when read, let the waiter
+        // finish its last read.
+        destroyed = true;
+        waiter.join();
+
+        // Nothing is received or signaled once destroyEventQueue returned.
+        uint64_t received[kQueueCount];
+        uint64_t wakeups[kQueueCount];
+        for (int role = 0; role < kQueueCount; ++role) {
+            ASensorEventQueueStats stats;
+            ASSERT_EQ(ASensorEventQueue_getStats(queues[role], &stats), 0);
+            received[role] = stats.received;
+            wakeups[role] = keepAlive[role]->getWakeupCount();
+        }
+
+        usleep(2000);
+        stopProducers();
+        for (int role = 0; role < kQueueCount; ++role) {
+            ASensorEventQueueStats stats;
+            ASSERT_EQ(ASensorEventQueue_getStats(queues[role], &stats), 0);
+            EXPECT_EQ(stats.received, received[role]) << "queue " << role;
+            EXPECT_EQ(keepAlive[role]->getWakeupCount(), wakeups[role]) << "queue " << role;
+        }
+    }
+}
+
+TEST_P(LifecycleTest, DestroyWithoutProducers) {
+    ASensorEventQueue *queue = ASensorManager_createEventQueue(
+            mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+    ASSERT_NE(queue, nullptr);
+    ASSERT_EQ(ASensorEventQueue_enableSensor(
+                      queue, mManager->getSensorByHandle(kGyroscopeHandle)),
+              0);
+
+    sp<ASensorEventQueue> keepAlive = queue;
+    sp<FakeEventQueue> serviceQueue = mService->getLastEventQueue();
+    EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+
+    // Late events are dropped rather than queued.
+    deliver(serviceQueue, {makeGyroscopeEvent(1)});
+    EXPECT_EQ(keepAlive->getWakeupCount(), 0u);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, LifecycleTest, ::testing::Bool());
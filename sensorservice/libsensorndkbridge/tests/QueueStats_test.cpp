@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+using android::frameworks::sensorservice::V1_1::IEventQueueCallback;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorFlagBits;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr int kIdent = 9;
+static constexpr int32_t kGyroscope = 2;
+static constexpr int32_t kProximity = 3;
+static constexpr int32_t kPeriodUs = 10000;
+static constexpr int64_t kPeriodNs = kPeriodUs * 1000ll;
+
+static SensorInfo makeSensor(int32_t handle, SensorType type, uint32_t flags) {
+    SensorInfo info;
+    info.sensorHandle = handle;
+    info.name = "sensor";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = type;
+    info.typeAsString = "";
+    info.maxRange = 1.0f;
+    info.resolution = 1.0f;
+    info.power = 0.1f;
+    info.minDelay = 1000;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 0;
+    info.maxDelay = 1000000;
+    info.flags = flags;
+    return info;
+}
+
+static Event makeEvent(int32_t handle, SensorType type, int64_t timestamp) {
+    Event event;
+    event.sensorHandle = handle;
+    event.sensorType = type;
+    event.timestamp = timestamp;
+    event.u.vec3.x = 1.0f;
+    event.u.vec3.y = 2.0f;
+    event.u.vec3.z = 3.0f;
+    event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    return event;
+}
+
+// count gyroscope events one period apart, starting at first.
+static std::vector<Event> makeGyroscopeEvents(int64_t first, size_t count) {
+    std::vector<Event> events;
+    for (size_t i = 0; i < count; ++i) {
+        events.push_back(makeEvent(kGyroscope, SensorType::GYROSCOPE, first + i * kPeriodNs));
+    }
+    return events;
+}
+
+// The accounting covers both ways events can take into the queue.
+class QueueStatsTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({
+                makeSensor(kGyroscope, SensorType::GYROSCOPE, 0 /* flags */),
+                makeSensor(kProximity, SensorType::PROXIMITY,
+                           static_cast<uint32_t>(SensorFlagBits::ON_CHANGE_MODE)),
+        }, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mGyroscope = mManager->getSensorByHandle(kGyroscope);
+        ASSERT_NE(mGyroscope, nullptr);
+        mProximity = mManager->getSensorByHandle(kProximity);
+        ASSERT_NE(mProximity, nullptr);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+        ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mGyroscope, kPeriodUs, 0), 0);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    void send(const std::vector<Event> &events) {
+        if (GetParam()) {
+            EXPECT_TRUE(mServiceQueue->writeEvents(events));
+        } else {
+            sp<IEventQueueCallback> callback =
+                    IEventQueueCallback::castFrom(mServiceQueue->getCallback());
+            ASSERT_NE(callback, nullptr);
+            callback->onEvents(events);
+        }
+    }
+
+    size_t drain() {
+        ASensorEvent buffer[32];
+        ssize_t n = ASensorEventQueue_getEvents(mQueue, buffer, 32);
+        EXPECT_GE(n, 0);
+        return n;
+    }
+
+    ASensorEventQueueStats getStats() {
+        ASensorEventQueueStats stats;
+        EXPECT_EQ(ASensorEventQueue_getStats(mQueue, &stats), 0);
+        return stats;
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mGyroscope;
+    ASensorRef mProximity;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_P(QueueStatsTest, CountsReceivedAndDelivered) {
+    send(makeGyroscopeEvents(1, 5));
+    send(makeGyroscopeEvents(1 + 5 * kPeriodNs, 3));
+    EXPECT_EQ(drain(), 8u);
+
+    ASensorEventQueueStats stats = getStats();
+    EXPECT_EQ(stats.received, 8u);
+    EXPECT_EQ(stats.delivered, 8u);
+    EXPECT_EQ(stats.overflowed, 0u);
+    EXPECT_EQ(stats.decimated, 0u);
+    EXPECT_EQ(stats.gaps, 0u);
+    EXPECT_EQ(stats.missedSamples, 0u);
+    EXPECT_EQ(stats.maxDepth, 8u);
+}
+
+TEST_P(QueueStatsTest, DetectsGaps) {
+    // The third and fourth, and then the seventh sample never arrive.
+    std::vector<Event> events = makeGyroscopeEvents(1, 8);
+    events.erase(events.begin() + 6);
+    events.erase(events.begin() + 2, events.begin() + 4);
+    send(events);
+    EXPECT_EQ(drain(), 5u);
+
+    ASensorEventQueueStats stats = getStats();
+    EXPECT_EQ(stats.received, 5u);
+    EXPECT_EQ(stats.gaps, 2u);
+    EXPECT_EQ(stats.missedSamples, 3u);
+}
+
+TEST_P(QueueStatsTest, ToleratesJitter) {
+    std::vector<Event> events = makeGyroscopeEvents(1, 4);
+    events[1].timestamp += kPeriodNs / 2;
+    events[2].timestamp -= kPeriodNs / 4;
+    send(events);
+    EXPECT_EQ(drain(), 4u);
+
+    EXPECT_EQ(getStats().gaps, 0u);
+}
+
+TEST_P(QueueStatsTest, RestartsGapDetectionWhenReenabled) {
+    send(makeGyroscopeEvents(1, 2));
+    EXPECT_EQ(drain(), 2u);
+    ASSERT_EQ(ASensorEventQueue_disableSensor(mQueue, mGyroscope), 0);
+    ASSERT_EQ(ASensorEventQueue_enableSensor(mQueue, mGyroscope), 0);
+    send(makeGyroscopeEvents(1 + 100 * kPeriodNs, 2));
+    EXPECT_EQ(drain(), 2u);
+
+    EXPECT_EQ(getStats().gaps, 0u);
+}
+
+TEST_P(QueueStatsTest, IgnoresOnChangeSensors) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mProximity, kPeriodUs, 0), 0);
+    send({
+            makeEvent(kProximity, SensorType::PROXIMITY, 1),
+            makeEvent(kProximity, SensorType::PROXIMITY, 1 + 10 * kPeriodNs),
+    });
+    EXPECT_EQ(drain(), 2u);
+
+    EXPECT_EQ(getStats().gaps, 0u);
+}
+
+TEST_P(QueueStatsTest, CountsDecimatedEvents) {
+    ASSERT_EQ(ASensorEventQueue_setDecimation(
+                      mQueue, mGyroscope, ASENSOR_DECIMATION_KEEP_NTH, 4),
+              0);
+    send(makeGyroscopeEvents(1, 8));
+    EXPECT_EQ(drain(), 2u);
+
+    ASensorEventQueueStats stats = getStats();
+    EXPECT_EQ(stats.received, 8u);
+    EXPECT_EQ(stats.decimated, 6u);
+    EXPECT_EQ(stats.delivered, 2u);
+    // Decimation doesn't look like loss.
+    EXPECT_EQ(stats.gaps, 0u);
+}
+
+TEST_P(QueueStatsTest, CountsFilteredAdditionalInfo) {
+    std::vector<Event> events = makeGyroscopeEvents(1, 3);
+    events.insert(events.begin() + 1, makeEvent(kGyroscope, SensorType::ADDITIONAL_INFO, 2));
+    send(events);
+    // A batch with nothing left after filtering is accounted for too.
+    send({makeEvent(kGyroscope, SensorType::ADDITIONAL_INFO, 3)});
+    EXPECT_EQ(drain(), 3u);
+
+    ASensorEventQueueStats stats = getStats();
+    EXPECT_EQ(stats.received, 5u);
+    EXPECT_EQ(stats.filtered, 2u);
+    EXPECT_EQ(stats.delivered, 3u);
+}
+
+TEST_P(QueueStatsTest, DumpIncludesStats) {
+    std::vector<Event> events = makeGyroscopeEvents(1, 4);
+    events.erase(events.begin() + 1);
+    send(events);
+    EXPECT_EQ(drain(), 3u);
+
+    FILE *file = tmpfile();
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(ASensorEventQueue_dump(mQueue, fileno(file)), 0);
+
+    std::string out;
+    rewind(file);
+    ASSERT_TRUE(android::base::ReadFdToString(fileno(file), &out));
+    fclose(file);
+
+    EXPECT_NE(out.find("events received 3 delivered 3 overflowed 0"), std::string::npos) << out;
+    EXPECT_NE(out.find("gaps of 0x00000002: 1, 1 samples missed"), std::string::npos) << out;
+}
+
+TEST_P(QueueStatsTest, RejectsNullStats) {
+    EXPECT_LT(ASensorEventQueue_getStats(mQueue, NULL), 0);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, QueueStatsTest, ::testing::Bool());
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <utils/Mutex.h>
+
+using android::Mutex;
+using android::sp;
+
+static constexpr int kIdent = 3;
+static constexpr int kTimeoutMillis = 1000;
+
+// Runs the bridge against a stand-in service that can be killed and
+// restarted. The restarted service is handed out by the getter the manager
+// reconnects with.
+class ReconnectTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeGyroscope()}, GetParam());
+        mManager.reset(new ASensorManager(mService, [this] { return getRestartedService(); }));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        ASensorList list;
+        ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 1);
+        mSensor = list[0];
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+        mManager.reset();
+    }
+
+    sp<FakeSensorManager> getRestartedService() {
+        Mutex::Autolock autoLock(mLock);
+        return mRestartedService;
+    }
+
+    void killService() {
+        mService->kill();
+        mManager->onServiceDied();
+    }
+
+    sp<FakeSensorManager> restartService() {
+        return restartService(new FakeSensorManager({makeGyroscope()}, GetParam()));
+    }
+
+    sp<FakeSensorManager> restartService(const sp<FakeSensorManager> &service) {
+        Mutex::Autolock autoLock(mLock);
+        mRestartedService = service;
+        return service;
+    }
+
+    bool waitForReconnects(uint32_t reconnects) {
+        for (int i = 0; i < kTimeoutMillis; ++i) {
+            ASensorManagerReconnectStats stats;
+            if (ASensorManager_getReconnectStats(mManager.get(), &stats) == 0
+                    && stats.reconnects >= reconnects) {
+                return true;
+            }
+            usleep(1000);
+        }
+        return false;
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mSensor;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+
+    Mutex mLock;
+    sp<FakeSensorManager> mRestartedService;
+};
+
+TEST_P(ReconnectTest, RestoresQueueAfterServiceDeath) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+
+    killService();
+    sp<FakeSensorManager> restarted = restartService();
+    ASSERT_TRUE(waitForReconnects(1));
+
+    sp<FakeEventQueue> serviceQueue = restarted->getLastEventQueue();
+    ASSERT_NE(serviceQueue, nullptr);
+    EXPECT_EQ(serviceQueue->getEventQueue() != nullptr, GetParam());
+
+    int32_t samplingPeriodUs;
+    int64_t maxBatchReportLatencyUs;
+    ASSERT_TRUE(serviceQueue->getSensorConfig(
+            kGyroscopeHandle, &samplingPeriodUs, &maxBatchReportLatencyUs));
+    EXPECT_EQ(samplingPeriodUs, 5000);
+    EXPECT_EQ(maxBatchReportLatencyUs, 100000);
+
+    ASSERT_TRUE(deliver(serviceQueue, {makeGyroscopeEvent(1234)}));
+    EXPECT_EQ(mLooper->pollOnce(kTimeoutMillis, NULL, NULL, NULL), kIdent);
+
+    ASensorEvent event;
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, &event, 1), 1);
+    EXPECT_EQ(event.timestamp, 1234);
+
+    ASensorManagerReconnectStats stats;
+    ASSERT_EQ(ASensorManager_getReconnectStats(mManager.get(), &stats), 0);
+    EXPECT_EQ(stats.serviceDeaths, 1u);
+    EXPECT_EQ(stats.reconnects, 1u);
+    EXPECT_GT(stats.lastReconnectLatencyNs, 0);
+    EXPECT_EQ(stats.maxReconnectLatencyNs, stats.lastReconnectLatencyNs);
+}
+
+TEST_P(ReconnectTest, AppliesChangesMadeWhileDisconnected) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+
+    // Nothing to reconnect to until restartService.
+    killService();
+    EXPECT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 2000, 50000), 0);
+    usleep(20000);
+
+    sp<FakeSensorManager> restarted = restartService();
+    ASSERT_TRUE(waitForReconnects(1));
+
+    sp<FakeEventQueue> serviceQueue = restarted->getLastEventQueue();
+    ASSERT_NE(serviceQueue, nullptr);
+
+    int32_t samplingPeriodUs;
+    int64_t maxBatchReportLatencyUs;
+    ASSERT_TRUE(serviceQueue->getSensorConfig(
+            kGyroscopeHandle, &samplingPeriodUs, &maxBatchReportLatencyUs));
+    EXPECT_EQ(samplingPeriodUs, 2000);
+    EXPECT_EQ(maxBatchReportLatencyUs, 50000);
+}
+
+TEST_P(ReconnectTest, DoesNotRestoreDisabledSensors) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 0), 0);
+    ASSERT_EQ(ASensorEventQueue_disableSensor(mQueue, mSensor), 0);
+
+    killService();
+    sp<FakeSensorManager> restarted = restartService();
+    ASSERT_TRUE(waitForReconnects(1));
+
+    sp<FakeEventQueue> serviceQueue = restarted->getLastEventQueue();
+    ASSERT_NE(serviceQueue, nullptr);
+
+    int32_t samplingPeriodUs;
+    int64_t maxBatchReportLatencyUs;
+    EXPECT_FALSE(serviceQueue->getSensorConfig(
+            kGyroscopeHandle, &samplingPeriodUs, &maxBatchReportLatencyUs));
+}
+
+TEST_P(ReconnectTest, KeepsSensorReferences) {
+    ASensorList before;
+    ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &before), 1);
+
+    killService();
+    sp<FakeSensorManager> restarted = restartService();
+    ASSERT_TRUE(waitForReconnects(1));
+
+    ASensorList after;
+    ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &after), 1);
+    EXPECT_EQ(after, before);
+    EXPECT_EQ(after[0], mSensor);
+    EXPECT_EQ(ASensor_getHandle(mSensor), kGyroscopeHandle);
+    EXPECT_EQ(mManager->getSensorByHandle(kGyroscopeHandle), mSensor);
+    EXPECT_STREQ(ASensor_getStringType(mSensor), "android.sensor.gyroscope");
+    EXPECT_EQ(restarted->getSensorListCallCount(), 0);
+
+    // Queues created after the restart use the new service.
+    ASensorEventQueue *queue = ASensorManager_createEventQueue(
+            mManager.get(), mLooper.get(), kIdent + 1, NULL /* callback */, NULL /* data */);
+    ASSERT_NE(queue, nullptr);
+    ASSERT_EQ(ASensorEventQueue_enableSensor(queue, mSensor), 0);
+    EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+}
+
+TEST_P(ReconnectTest, FallsBackToCallbacks) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 0), 0);
+
+    killService();
+    sp<FakeSensorManager> restarted =
+            restartService(new FakeSensorManager({makeGyroscope()}, false /* supportsFmq */));
+    ASSERT_TRUE(waitForReconnects(1));
+
+    sp<FakeEventQueue> serviceQueue = restarted->getLastEventQueue();
+    ASSERT_NE(serviceQueue, nullptr);
+    EXPECT_EQ(serviceQueue->getEventQueue(), nullptr);
+    EXPECT_EQ(restarted->getEventQueueCount(), 1u);
+
+    ASSERT_TRUE(deliver(serviceQueue, {makeGyroscopeEvent(1234)}));
+    EXPECT_EQ(mLooper->pollOnce(kTimeoutMillis, NULL, NULL, NULL), kIdent);
+
+    ASensorEvent event;
+    ASSERT_EQ(ASensorEventQueue_getEvents(mQueue, &event, 1), 1);
+    EXPECT_EQ(event.timestamp, 1234);
+}
+
+TEST_P(ReconnectTest, KeepsQueuesConnectedByFailedAttempts) {
+    ASensorEventQueue *queue = ASensorManager_createEventQueue(
+            mManager.get(), mLooper.get(), kIdent + 1, NULL /* callback */, NULL /* data */);
+    ASSERT_NE(queue, nullptr);
+
+    // Only one of the queues fits, attempts fail until the limit is raised.
+    killService();
+    sp<FakeSensorManager> service = new FakeSensorManager({makeGyroscope()}, GetParam());
+    service->setMaxEventQueues(1);
+    restartService(service);
+    for (int i = 0; i < kTimeoutMillis && service->getEventQueueCount() == 0; ++i) {
+        usleep(1000);
+    }
+    ASSERT_EQ(service->getEventQueueCount(), 1u);
+    // Long enough for a few retries.
+    usleep(50000);
+
+    service->setMaxEventQueues(2);
+    ASSERT_TRUE(waitForReconnects(1));
+    EXPECT_EQ(service->getEventQueueCount(), 2u);
+
+    EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, ReconnectTest, ::testing::Bool());
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ReplaySensorManager.h"
+
+#include <sensors/convert.h>
+#include <unistd.h>
+#include <utils/SystemClock.h>
+
+#include <vector>
+
+using android::hardware::hidl_vec;
+using android::hardware::sensors::V1_0::Event;
+using android::sp;
+
+// How long a shared memory queue may stay full before replay gives up.
+static constexpr int64_t kStallTimeoutNs = 1000000000;
+
+ReplaySensorManager::ReplaySensorManager(const SensorTraceReader &trace, bool supportsFmq)
+    : FakeSensorManager(trace.getSensors(), supportsFmq), mTrace(trace) {}
+
+// Waits until the batch recorded at arrivalNs is due.
+static void waitUntilDue(int64_t startNs, int64_t firstArrivalNs, int64_t arrivalNs,
+                         double speed) {
+    if (speed <= 0) {
+        return;
+    }
+
+    int64_t dueNs = startNs + static_cast<int64_t>((arrivalNs - firstArrivalNs) / speed);
+    int64_t nowNs = android::elapsedRealtimeNano();
+    if (dueNs > nowNs) {
+        usleep((dueNs - nowNs) / 1000);
+    }
+}
+
+size_t ReplaySensorManager::replay(const sp<FakeEventQueue> &queue, double speed) {
+    const size_t recordCount = mTrace.getRecordCount();
+    if (recordCount == 0) {
+        return 0;
+    }
+
+    sp<IEventQueueCallback_1_1> callback_1_1;
+    if (queue->getEventQueue() == NULL) {
+        callback_1_1 = IEventQueueCallback_1_1::castFrom(queue->getCallback());
+    }
+
+    const int64_t startNs = android::elapsedRealtimeNano();
+    const int64_t firstArrivalNs = mTrace.getRecord(0).arrivalNs;
+    std::vector<Event> batch;
+    size_t delivered = 0;
+    size_t i = 0;
+    while (i < recordCount) {
+        int64_t arrivalNs = mTrace.getRecord(i).arrivalNs;
+        batch.clear();
+        for (; i < recordCount && mTrace.getRecord(i).arrivalNs == arrivalNs; ++i) {
+            batch.emplace_back();
+            android::hardware::sensors::V1_0::implementation::convertFromSensorEvent(
+                    mTrace.getRecord(i).event, &batch.back());
+        }
+
+        waitUntilDue(startNs, firstArrivalNs, arrivalNs, speed);
+
+        if (queue->getEventQueue() != NULL) {
+            // Wait for the client to make room rather than lose events.
+            int64_t stallStartNs = android::elapsedRealtimeNano();
+            while (!queue->writeEvents(batch)) {
+                if (android::elapsedRealtimeNano() - stallStartNs > kStallTimeoutNs) {
+                    return delivered;
+                }
+                usleep(100);
+            }
+        } else if (callback_1_1 != NULL) {
+            hidl_vec<Event> events;
+            events.setToExternal(batch.data(), batch.size());
+            callback_1_1->onEvents(events);
+        } else {
+            for (const Event &event : batch) {
+                queue->getCallback()->onEvent(event);
+            }
+        }
+        delivered += batch.size();
+    }
+
+    return delivered;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REPLAY_SENSOR_MANAGER_H_
+
+#define REPLAY_SENSOR_MANAGER_H_
+
+#include "FakeSensorManager.h"
+#include "SensorTrace.h"
+
+// A stand-in for the sensor service that plays back a trace recorded with
+// ASensorManager_startEventQueueRecording: it has the sensors listed in the
+// trace, and delivers the events of the trace to its queues the way the
+// service delivered them while recording, to reproduce a client's input or
+// benchmark the bridge at production rates without a device.
+struct ReplaySensorManager : public FakeSensorManager {
+    // trace must outlive the manager.
+    explicit ReplaySensorManager(const SensorTraceReader &trace, bool supportsFmq = true);
+
+    // Delivers the events of the trace to queue, in the batches they arrived
+    // in. speed scales the pace: 1 keeps the intervals between batches of the
+    // recording, 2 halves them, 0 delivers as fast as the queue takes the
+    // events. Blocks until done and returns the number of events delivered,
+    // which is less than in the trace if the queue stopped taking them.
+    size_t replay(const android::sp<FakeEventQueue> &queue, double speed);
+
+private:
+    const SensorTraceReader &mTrace;
+
+    DISALLOW_COPY_AND_ASSIGN(ReplaySensorManager);
+};
+
+#endif  // REPLAY_SENSOR_MANAGER_H_
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <dirent.h>
+#include <gtest/gtest.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr int kIdent = 6;
+static constexpr int32_t kHandle = 2;
+
+static SensorInfo makeStepCounter() {
+    SensorInfo info;
+    info.sensorHandle = kHandle;
+    info.name = "step counter";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = SensorType::STEP_COUNTER;
+    info.typeAsString = "android.sensor.step_counter";
+    info.maxRange = 1e9f;
+    info.resolution = 1.0f;
+    info.power = 0.01f;
+    info.minDelay = 0;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 64;
+    info.maxDelay = 0;
+    info.flags = 0;
+    return info;
+}
+
+static Event makeStepCounterEvent(int64_t timestamp, uint64_t steps) {
+    Event event;
+    event.sensorHandle = kHandle;
+    event.sensorType = SensorType::STEP_COUNTER;
+    event.timestamp = timestamp;
+    event.u.stepCount = steps;
+    return event;
+}
+
+class SchedulingTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeStepCounter()}, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        ASSERT_EQ(sched_getaffinity(0 /* pid */, sizeof(mSavedCpus), &mSavedCpus), 0);
+    }
+
+    void TearDown() override {
+        sched_setaffinity(0 /* pid */, sizeof(mSavedCpus), &mSavedCpus);
+    }
+
+    ASensorEventQueue *createQueue(int policy, int priority, uint64_t cpuMask) {
+        ASensorEventQueueScheduling scheduling;
+        scheduling.policy = policy;
+        scheduling.priority = priority;
+        scheduling.cpuMask = cpuMask;
+        return ASensorManager_createEventQueueWithScheduling(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */,
+                &scheduling);
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    sp<ALooper> mLooper;
+    cpu_set_t mSavedCpus;
+};
+
+TEST_P(SchedulingTest, RejectsInvalidScheduling) {
+    EXPECT_EQ(ASensorManager_createEventQueueWithScheduling(
+                      mManager.get(), mLooper.get(), kIdent, NULL /* callback */,
+                      NULL /* data */, NULL /* scheduling */),
+              nullptr);
+    EXPECT_EQ(createQueue(-1, 0, 0), nullptr);
+    EXPECT_EQ(createQueue(SCHED_FIFO, 0, 0), nullptr);
+    EXPECT_EQ(createQueue(SCHED_RR, 100, 0), nullptr);
+    EXPECT_EQ(createQueue(SCHED_OTHER, 20, 0), nullptr);
+    EXPECT_EQ(createQueue(SCHED_OTHER, -21, 0), nullptr);
+}
+
+TEST_P(SchedulingTest, DeliversEvents) {
+    ASensorEventQueue *queue = createQueue(SCHED_OTHER, 0 /* priority */, 0 /* cpuMask */);
+    ASSERT_NE(queue, nullptr);
+    ASSERT_EQ(ASensorEventQueue_enableSensor(queue, mManager->getSensorByHandle(kHandle)), 0);
+
+    sp<FakeEventQueue> serviceQueue = mService->getLastEventQueue();
+    ASSERT_NE(serviceQueue, nullptr);
+    ASSERT_TRUE(deliver(serviceQueue, {makeStepCounterEvent(1000, 42)}));
+
+    int fd;
+    int events;
+    ASSERT_EQ(mLooper->pollOnce(1000 /* timeoutMillis */, &fd, &events, NULL), kIdent);
+    ASensorEvent event;
+    ASSERT_EQ(ASensorEventQueue_getEvents(queue, &event, 1), 1);
+    EXPECT_EQ(event.u64.step_counter, 42u);
+
+    EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+}
+
+// Returns the number of threads of this process that may only run on CPU 0.
+static int countThreadsPinnedToCpu0() {
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL) {
+        return -1;
+    }
+    int count = 0;
+    while (struct dirent *entry = readdir(dir)) {
+        pid_t tid = atoi(entry->d_name);
+        cpu_set_t cpus;
+        if (tid > 0 && sched_getaffinity(tid, sizeof(cpus), &cpus) == 0
+                && CPU_COUNT(&cpus) == 1 && CPU_ISSET(0, &cpus)) {
+            ++count;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+TEST_P(SchedulingTest, PinsOnlyReaderThread) {
+    if (!GetParam()) {
+        // Callbacks arrive on binder threads, which are never pinned: the
+        // queue is refused, see RejectsCpuMaskWithCallbacks.
+        return;
+    }
+    ASSERT_TRUE(CPU_ISSET(0, &mSavedCpus));
+    if (CPU_COUNT(&mSavedCpus) < 2) {
+        // Every thread already runs on CPU 0 only.
+        return;
+    }
+    ASSERT_EQ(countThreadsPinnedToCpu0(), 0);
+
+    ASensorEventQueue *queue = createQueue(SCHED_OTHER, 0 /* priority */, 1 /* CPU 0 */);
+    ASSERT_NE(queue, nullptr);
+
+    // The client's thread, which the looper belongs to, is left alone.
+    cpu_set_t cpus;
+    ASSERT_EQ(sched_getaffinity(0 /* pid */, sizeof(cpus), &cpus), 0);
+    EXPECT_TRUE(CPU_EQUAL(&cpus, &mSavedCpus));
+
+    // The thread reading shared memory pins itself once it runs.
+    int pinned = 0;
+    for (int i = 0; i < 100 && pinned == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        pinned = countThreadsPinnedToCpu0();
+    }
+    EXPECT_EQ(pinned, 1);
+
+    EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+}
+
+TEST_P(SchedulingTest, RejectsCpuMaskWithCallbacks) {
+    ASensorEventQueue *queue = createQueue(SCHED_OTHER, 0 /* priority */, 1 /* CPU 0 */);
+    EXPECT_EQ(queue != nullptr, GetParam());
+    if (queue != nullptr) {
+        EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+    }
+
+    // Without a mask the queue works with either transport.
+    queue = createQueue(SCHED_OTHER, 0 /* priority */, 0 /* cpuMask */);
+    ASSERT_NE(queue, nullptr);
+    EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), queue), 0);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, SchedulingTest, ::testing::Bool());
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+#include "SensorCatalog.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using android::hardware::sensors::V1_0::SensorFlagBits;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr uint32_t kWakeUp = static_cast<uint32_t>(SensorFlagBits::WAKE_UP);
+static constexpr uint32_t kOnChange = static_cast<uint32_t>(SensorFlagBits::ON_CHANGE_MODE);
+static constexpr uint32_t kOneShot = static_cast<uint32_t>(SensorFlagBits::ONE_SHOT_MODE);
+
+static SensorInfo makeSensor(int32_t handle, SensorType type, const std::string &name,
+                             uint32_t flags) {
+    SensorInfo info;
+    info.sensorHandle = handle;
+    info.name = name;
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = type;
+    info.typeAsString = "";
+    info.maxRange = 1.0f;
+    info.resolution = 1.0f;
+    info.power = 0.1f;
+    info.minDelay = 0;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 0;
+    info.maxDelay = 0;
+    info.flags = flags;
+    return info;
+}
+
+class SensorCatalogTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({
+                makeSensor(1, SensorType::ACCELEROMETER, "accel wakeup", kWakeUp),
+                makeSensor(2, SensorType::ACCELEROMETER, "accel", 0),
+                makeSensor(3, SensorType::ACCELEROMETER, "accel secondary", 0),
+                makeSensor(4, SensorType::PROXIMITY, "proximity", kOnChange),
+                makeSensor(5, SensorType::PROXIMITY, "proximity wakeup", kOnChange | kWakeUp),
+                makeSensor(6, SensorType::SIGNIFICANT_MOTION, "significant motion",
+                           kOneShot | kWakeUp),
+        });
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+};
+
+TEST_F(SensorCatalogTest, DefaultSensorFollowsWakeUpRules) {
+    ASensorRef accel = ASensorManager_getDefaultSensor(mManager.get(), ASENSOR_TYPE_ACCELEROMETER);
+    ASSERT_NE(accel, nullptr);
+    EXPECT_EQ(ASensor_getHandle(accel), 2);
+    EXPECT_FALSE(ASensor_isWakeUpSensor(accel));
+
+    ASensorRef proximity = ASensorManager_getDefaultSensor(mManager.get(), ASENSOR_TYPE_PROXIMITY);
+    ASSERT_NE(proximity, nullptr);
+    EXPECT_EQ(ASensor_getHandle(proximity), 5);
+    EXPECT_TRUE(ASensor_isWakeUpSensor(proximity));
+
+    ASensorRef motion =
+            ASensorManager_getDefaultSensor(mManager.get(), ASENSOR_TYPE_SIGNIFICANT_MOTION);
+    ASSERT_NE(motion, nullptr);
+    EXPECT_EQ(ASensor_getReportingMode(motion), AREPORTING_MODE_ONE_SHOT);
+
+    EXPECT_EQ(ASensorManager_getDefaultSensor(mManager.get(), ASENSOR_TYPE_GYROSCOPE), nullptr);
+}
+
+TEST_F(SensorCatalogTest, DefaultSensorEx) {
+    ASensorRef accelWakeUp =
+            ASensorManager_getDefaultSensorEx(mManager.get(), ASENSOR_TYPE_ACCELEROMETER, true);
+    ASSERT_NE(accelWakeUp, nullptr);
+    EXPECT_EQ(ASensor_getHandle(accelWakeUp), 1);
+    EXPECT_EQ(ASensor_getReportingMode(accelWakeUp), AREPORTING_MODE_CONTINUOUS);
+
+    ASensorRef proximity =
+            ASensorManager_getDefaultSensorEx(mManager.get(), ASENSOR_TYPE_PROXIMITY, false);
+    ASSERT_NE(proximity, nullptr);
+    EXPECT_EQ(ASensor_getHandle(proximity), 4);
+    EXPECT_EQ(ASensor_getReportingMode(proximity), AREPORTING_MODE_ON_CHANGE);
+
+    EXPECT_EQ(ASensorManager_getDefaultSensorEx(
+            mManager.get(), ASENSOR_TYPE_SIGNIFICANT_MOTION, false), nullptr);
+}
+
+TEST_F(SensorCatalogTest, SensorByHandle) {
+    ASensorRef sensor = mManager->getSensorByHandle(3);
+    ASSERT_NE(sensor, nullptr);
+    EXPECT_STREQ(ASensor_getName(sensor), "accel secondary");
+    EXPECT_EQ(mManager->getSensorByHandle(42), nullptr);
+}
+
+TEST_F(SensorCatalogTest, FetchesCatalogOnce) {
+    ASensorList list;
+    ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 6);
+    for (int type : {ASENSOR_TYPE_ACCELEROMETER, ASENSOR_TYPE_PROXIMITY,
+                     ASENSOR_TYPE_SIGNIFICANT_MOTION, ASENSOR_TYPE_GYROSCOPE}) {
+        (void)ASensorManager_getDefaultSensor(mManager.get(), type);
+        (void)ASensorManager_getDefaultSensorEx(mManager.get(), type, true);
+    }
+    (void)mManager->getSensorByHandle(1);
+
+    // References stay valid, the list isn't fetched again.
+    ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 6);
+    EXPECT_EQ(ASensor_getHandle(list[0]), 1);
+
+    EXPECT_EQ(mService->getSensorListCallCount(), 1);
+    EXPECT_EQ(mService->getDefaultSensorCallCount(), 0);
+}
+
+TEST_F(SensorCatalogTest, StoresEachStringOnce) {
+    ASensorList list;
+    ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 6);
+
+    // All sensors share their vendor and empty strings.
+    for (int i = 1; i < 6; ++i) {
+        EXPECT_EQ(ASensor_getVendor(list[i]), ASensor_getVendor(list[0]));
+        EXPECT_EQ(ASensor_getStringType(list[i]), ASensor_getStringType(list[0]));
+    }
+    EXPECT_STREQ(ASensor_getVendor(list[0]), "fake");
+    EXPECT_STREQ(ASensor_getName(list[1]), "accel");
+    EXPECT_STREQ(ASensor_getStringType(list[0]), "");
+}
+
+TEST(SensorCatalog, CopiesSensorInfos) {
+    SensorInfo accel = makeSensor(7, SensorType::ACCELEROMETER, "accel", kWakeUp);
+    accel.typeAsString = "android.sensor.accelerometer";
+    accel.maxRange = 78.4f;
+    accel.resolution = 0.002f;
+    accel.minDelay = 2500;
+    accel.maxDelay = 500000;
+    accel.fifoReservedEventCount = 300;
+    accel.fifoMaxEventCount = 3000;
+    accel.requiredPermission = "android.permission.BODY_SENSORS";
+    SensorInfo proximity = makeSensor(8, SensorType::PROXIMITY, "proximity", kOnChange);
+
+    SensorCatalog catalog({accel, proximity});
+    ASSERT_EQ(catalog.size(), 2u);
+
+    const SensorRecord *record = asSensorRecord(catalog.getList()[0]);
+    EXPECT_EQ(record, &catalog.at(0));
+    EXPECT_EQ(record->sensorHandle, 7);
+    EXPECT_EQ(record->type, ASENSOR_TYPE_ACCELEROMETER);
+    EXPECT_EQ(record->flags, kWakeUp);
+    EXPECT_EQ(record->minDelay, 2500);
+    EXPECT_EQ(record->maxDelay, 500000);
+    EXPECT_EQ(record->fifoReservedEventCount, 300u);
+    EXPECT_EQ(record->fifoMaxEventCount, 3000u);
+    EXPECT_FLOAT_EQ(record->maxRange, 78.4f);
+    EXPECT_FLOAT_EQ(record->resolution, 0.002f);
+    EXPECT_STREQ(record->name, "accel");
+    EXPECT_STREQ(record->typeAsString, "android.sensor.accelerometer");
+    EXPECT_STREQ(record->requiredPermission, "android.permission.BODY_SENSORS");
+    EXPECT_STREQ(catalog.at(1).requiredPermission, "");
+
+    android::hardware::hidl_vec<SensorInfo> sensors = catalog.toSensorInfos();
+    ASSERT_EQ(sensors.size(), 2u);
+    EXPECT_EQ(sensors[0], accel);
+    EXPECT_EQ(sensors[1], proximity);
+}
+
+TEST(SensorCatalog, Empty) {
+    SensorCatalog catalog(android::hardware::hidl_vec<SensorInfo>{});
+    EXPECT_EQ(catalog.size(), 0u);
+    EXPECT_NE(catalog.getList(), nullptr);
+}
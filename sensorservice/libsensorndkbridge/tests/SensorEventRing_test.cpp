@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SensorEventRing.h"
+
+#include <gtest/gtest.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static sensors_event_t makeEvent(int64_t timestamp) {
+    sensors_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.timestamp = timestamp;
+    // Both ends of the payload, to catch torn copies.
+    event.data[0] = timestamp;
+    event.data[15] = timestamp;
+    return event;
+}
+
+// Writes the events with timestamps first to first + count - 1 as one batch,
+// and returns the number of events the ring took.
+static size_t writeBatch(SensorEventRing *ring, int64_t first, size_t count) {
+    size_t skip;
+    size_t n = ring->beginWriteBatch(count, &skip);
+    for (size_t i = 0; i < n; ++i) {
+        *ring->slotAt(i) = makeEvent(first + skip + i);
+    }
+    ring->endWriteBatch(n);
+    return n;
+}
+
+static std::vector<int64_t> readAll(SensorEventRing *ring) {
+    std::vector<int64_t> timestamps;
+    sensors_event_t events[16];
+    while (size_t n = ring->read(events, 16)) {
+        for (size_t i = 0; i < n; ++i) {
+            timestamps.push_back(events[i].timestamp);
+        }
+    }
+    return timestamps;
+}
+
+TEST(SensorEventRingTest, RoundsCapacityUpToPowerOfTwo) {
+    EXPECT_EQ(SensorEventRing(0).capacity(), 1u);
+    EXPECT_EQ(SensorEventRing(1).capacity(), 1u);
+    EXPECT_EQ(SensorEventRing(5).capacity(), 8u);
+    EXPECT_EQ(SensorEventRing(64).capacity(), 64u);
+}
+
+TEST(SensorEventRingTest, ReadsInOrderAcrossWrapAround) {
+    SensorEventRing ring(4);
+    EXPECT_EQ(writeBatch(&ring, 0, 3), 3u);
+
+    sensors_event_t events[4];
+    ASSERT_EQ(ring.read(events, 2), 2u);
+    EXPECT_EQ(events[0].timestamp, 0);
+    EXPECT_EQ(events[1].timestamp, 1);
+
+    // Slots 3, 0 and 1: the batch wraps after its first slot.
+    size_t skip;
+    ASSERT_EQ(ring.beginWriteBatch(3, &skip), 3u);
+    EXPECT_EQ(skip, 0u);
+    EXPECT_EQ(ring.contiguousSlotsAt(0), 1u);
+    EXPECT_EQ(ring.contiguousSlotsAt(1), 4u);
+    for (size_t i = 0; i < 3; ++i) {
+        *ring.slotAt(i) = makeEvent(3 + i);
+    }
+    ring.endWriteBatch(3);
+    EXPECT_EQ(ring.size(), 4u);
+
+    ASSERT_EQ(ring.read(events, 4), 4u);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(events[i].timestamp, 2 + i);
+        EXPECT_EQ(events[i].data[15], 2 + i);
+    }
+    EXPECT_TRUE(ring.empty());
+    EXPECT_EQ(ring.read(events, 4), 0u);
+    EXPECT_EQ(ring.overflowCount(), 0u);
+}
+
+TEST(SensorEventRingTest, DropOldestKeepsNewestEvents) {
+    SensorEventRing ring(4);
+    EXPECT_EQ(ring.overflowPolicy(), SensorEventRing::DROP_OLDEST);
+    for (int64_t t = 0; t < 6; ++t) {
+        sensors_event_t *slot = ring.beginWrite();
+        ASSERT_NE(slot, nullptr);
+        *slot = makeEvent(t);
+        ring.endWrite();
+    }
+
+    EXPECT_EQ(readAll(&ring), std::vector<int64_t>({2, 3, 4, 5}));
+    EXPECT_EQ(ring.overflowCount(), 2u);
+}
+
+TEST(SensorEventRingTest, DropNewestKeepsOldestEvents) {
+    SensorEventRing ring(4);
+    ring.setOverflowPolicy(SensorEventRing::DROP_NEWEST);
+    for (int64_t t = 0; t < 6; ++t) {
+        sensors_event_t *slot = ring.beginWrite();
+        if (t < 4) {
+            ASSERT_NE(slot, nullptr);
+            *slot = makeEvent(t);
+            ring.endWrite();
+        } else {
+            EXPECT_EQ(slot, nullptr);
+        }
+    }
+
+    EXPECT_EQ(readAll(&ring), std::vector<int64_t>({0, 1, 2, 3}));
+    EXPECT_EQ(ring.overflowCount(), 2u);
+}
+
+TEST(SensorEventRingTest, AppliesPolicyToWholeBatch) {
+    SensorEventRing oldest(4);
+    EXPECT_EQ(writeBatch(&oldest, 0, 3), 3u);
+    // Evicts 0 to 2, then skips 10 to 15 of the batch.
+    EXPECT_EQ(writeBatch(&oldest, 10, 10), 4u);
+    EXPECT_EQ(readAll(&oldest), std::vector<int64_t>({16, 17, 18, 19}));
+    EXPECT_EQ(oldest.overflowCount(), 9u);
+
+    SensorEventRing newest(4);
+    newest.setOverflowPolicy(SensorEventRing::DROP_NEWEST);
+    EXPECT_EQ(writeBatch(&newest, 0, 3), 3u);
+    EXPECT_EQ(writeBatch(&newest, 10, 10), 1u);
+    EXPECT_EQ(readAll(&newest), std::vector<int64_t>({0, 1, 2, 10}));
+    EXPECT_EQ(newest.overflowCount(), 9u);
+}
+
+// One producer thread writing batches of various sizes while the test thread
+// reads with various counts. Whatever the policy drops, events come out whole
+// and in order, and every event is either read or counted as overflow.
+class SensorEventRingStressTest
+    : public ::testing::TestWithParam<SensorEventRing::OverflowPolicy> {};
+
+TEST_P(SensorEventRingStressTest, KeepsOrderAndAccounting) {
+    static constexpr int64_t kEventCount = 200000;
+
+    for (size_t capacity : {4u, 64u}) {
+        for (size_t batch : {1u, 7u, 64u}) {
+            SensorEventRing ring(capacity);
+            ring.setOverflowPolicy(GetParam());
+            std::atomic<bool> done(false);
+
+            std::thread producer([&ring, &done, batch] {
+                for (int64_t next = 0; next < kEventCount;) {
+                    size_t count = std::min<int64_t>(batch, kEventCount - next);
+                    writeBatch(&ring, next, count);
+                    next += count;
+                }
+                done.store(true);
+            });
+
+            int64_t last = -1;
+            bool intact = true;
+            uint64_t read = 0;
+            sensors_event_t events[16];
+            for (bool finished = false; !finished && intact;) {
+                // Checked before reading, so the last read sees every event.
+                finished = done.load();
+                size_t n = ring.read(events, 1 + read % 16);
+                for (size_t i = 0; i < n; ++i) {
+                    intact = intact && events[i].timestamp > last
+                            && events[i].data[0] == events[i].timestamp
+                            && events[i].data[15] == events[i].timestamp;
+                    last = events[i].timestamp;
+                }
+                read += n;
+                finished = finished && n == 0;
+            }
+            // The producer never blocks, so it finishes even if we stopped early.
+            producer.join();
+
+            EXPECT_TRUE(intact) << "capacity " << capacity << ", batch " << batch
+                                << ": event " << last << " out of order or torn";
+            EXPECT_EQ(read + ring.overflowCount(), static_cast<uint64_t>(kEventCount))
+                    << "capacity " << capacity << ", batch " << batch;
+        }
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(Policies, SensorEventRingStressTest,
+                        ::testing::Values(SensorEventRing::DROP_OLDEST,
+                                          SensorEventRing::DROP_NEWEST));
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "EventConversion.h"
+#include "FakeSensorManager.h"
+#include "ReplaySensorManager.h"
+#include "SensorTrace.h"
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using android::frameworks::sensorservice::V1_1::IEventQueueCallback;
+using android::hardware::hidl_vec;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+static constexpr int kIdent = 5;
+static constexpr int32_t kAccelerometerHandle = 1;
+
+static SensorInfo makeSensor(int32_t handle, SensorType type, const char *name) {
+    SensorInfo info;
+    info.sensorHandle = handle;
+    info.name = name;
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = type;
+    info.typeAsString = "android.sensor.fake";
+    info.maxRange = 34.9f;
+    info.resolution = 0.001f;
+    info.power = 0.1f;
+    info.minDelay = 1000;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 512;
+    info.maxDelay = 1000000;
+    info.flags = 0;
+    return info;
+}
+
+static std::vector<SensorInfo> makeSensors() {
+    return {makeSensor(kAccelerometerHandle, SensorType::ACCELEROMETER, "accelerometer"),
+            makeSensor(kGyroscopeHandle, SensorType::GYROSCOPE, "gyroscope")};
+}
+
+static Event makeEvent(int32_t handle, SensorType type, int64_t timestamp) {
+    Event event;
+    event.sensorHandle = handle;
+    event.sensorType = type;
+    event.timestamp = timestamp;
+    event.u.vec3.x = timestamp * 0.5f;
+    event.u.vec3.y = 1.0f;
+    event.u.vec3.z = -1.0f;
+    event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    return event;
+}
+
+static void expectSameEvent(const sensors_event_t &actual, const Event &expected) {
+    sensors_event_t converted;
+    convertSensorEvent(expected, &converted);
+    EXPECT_EQ(actual.sensor, converted.sensor);
+    EXPECT_EQ(actual.type, converted.type);
+    EXPECT_EQ(actual.timestamp, converted.timestamp);
+    EXPECT_EQ(memcmp(actual.data, converted.data, 3 * sizeof(float)), 0);
+    EXPECT_EQ(actual.acceleration.status, converted.acceleration.status);
+}
+
+TEST(SensorTraceTest, RoundTrip) {
+    TemporaryFile file;
+    std::vector<Event> batch = {
+            makeEvent(kAccelerometerHandle, SensorType::ACCELEROMETER, 10),
+            makeEvent(kGyroscopeHandle, SensorType::GYROSCOPE, 11),
+    };
+    {
+        SensorTraceWriter writer(file.path, makeSensors(), 16 /* maxRecords */);
+        ASSERT_EQ(writer.initCheck(), android::OK);
+        writer.append(batch.data(), batch.size(), 1000 /* arrivalNs */);
+        writer.append(&batch[0], 1, 2000 /* arrivalNs */);
+        EXPECT_EQ(writer.getRecordCount(), 3u);
+    }
+
+    SensorTraceReader reader(file.path);
+    ASSERT_EQ(reader.initCheck(), android::OK);
+
+    ASSERT_EQ(reader.getSensors().size(), 2u);
+    EXPECT_EQ(reader.getSensors()[1].sensorHandle, kGyroscopeHandle);
+    EXPECT_EQ(reader.getSensors()[1].type, SensorType::GYROSCOPE);
+    EXPECT_EQ(reader.getSensors()[1].name, "gyroscope");
+    EXPECT_EQ(reader.getSensors()[1].fifoMaxEventCount, 512u);
+
+    ASSERT_EQ(reader.getRecordCount(), 3u);
+    EXPECT_EQ(reader.getRecord(0).arrivalNs, 1000);
+    EXPECT_EQ(reader.getRecord(1).arrivalNs, 1000);
+    EXPECT_EQ(reader.getRecord(2).arrivalNs, 2000);
+    expectSameEvent(reader.getRecord(0).event, batch[0]);
+    expectSameEvent(reader.getRecord(1).event, batch[1]);
+    expectSameEvent(reader.getRecord(2).event, batch[0]);
+}
+
+TEST(SensorTraceTest, DropsEventsPastCapacity) {
+    TemporaryFile file;
+    std::vector<Event> batch(5, makeEvent(kAccelerometerHandle, SensorType::ACCELEROMETER, 1));
+    {
+        SensorTraceWriter writer(file.path, makeSensors(), 3 /* maxRecords */);
+        ASSERT_EQ(writer.initCheck(), android::OK);
+        writer.append(batch.data(), batch.size(), 1000 /* arrivalNs */);
+        EXPECT_EQ(writer.getRecordCount(), 3u);
+        EXPECT_EQ(writer.getDroppedCount(), 2u);
+    }
+
+    SensorTraceReader reader(file.path);
+    ASSERT_EQ(reader.initCheck(), android::OK);
+    EXPECT_EQ(reader.getRecordCount(), 3u);
+}
+
+TEST(SensorTraceTest, RejectsBadCapacity) {
+    TemporaryFile file;
+    SensorTraceWriter empty(file.path, makeSensors(), 0 /* maxRecords */);
+    EXPECT_EQ(empty.initCheck(), android::BAD_VALUE);
+    SensorTraceWriter huge(file.path, makeSensors(), SIZE_MAX / 2 /* maxRecords */);
+    EXPECT_EQ(huge.initCheck(), android::BAD_VALUE);
+}
+
+TEST(SensorTraceTest, RejectsOtherFiles) {
+    TemporaryFile file;
+    ASSERT_TRUE(android::base::WriteStringToFd(std::string(4096, 'x'), file.fd));
+    SensorTraceReader reader(file.path);
+    EXPECT_EQ(reader.initCheck(), android::BAD_VALUE);
+}
+
+TEST(SensorTraceTest, RejectsTruncatedOrCorruptHeaders) {
+    TemporaryFile file;
+    {
+        SensorTraceWriter writer(file.path, makeSensors(), 16 /* maxRecords */);
+        ASSERT_EQ(writer.initCheck(), android::OK);
+    }
+    std::string trace;
+    ASSERT_TRUE(android::base::ReadFileToString(file.path, &trace));
+
+    // Cut before the end of the header, and inside the sensor table.
+    for (size_t size : {sizeof(SensorTraceHeader) - 1, sizeof(SensorTraceHeader),
+                        sizeof(SensorTraceHeader) + sizeof(SensorTraceSensor)}) {
+        ASSERT_LT(size, trace.size());
+        ASSERT_TRUE(android::base::WriteStringToFile(trace.substr(0, size), file.path));
+        SensorTraceReader reader(file.path);
+        EXPECT_EQ(reader.initCheck(), android::BAD_VALUE) << "truncated to " << size;
+    }
+
+    // More sensors than the file holds, whatever the record offset says.
+    for (uint32_t sensorCount : {3u, UINT32_MAX}) {
+        SensorTraceHeader header;
+        memcpy(&header, trace.data(), sizeof(header));
+        header.sensorCount = sensorCount;
+        std::string corrupt = trace;
+        memcpy(&corrupt[0], &header, sizeof(header));
+        ASSERT_TRUE(android::base::WriteStringToFile(corrupt, file.path));
+        SensorTraceReader reader(file.path);
+        EXPECT_EQ(reader.initCheck(), android::BAD_VALUE) << sensorCount << " sensors";
+    }
+}
+
+class RecordAndReplayTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    // A bridge over service with one queue that has both sensors enabled.
+    struct Bridge {
+        explicit Bridge(const sp<FakeSensorManager> &service)
+            : manager(new ASensorManager(service)),
+              looper(new ALooper(true /* allowNonCallbacks */)) {
+            queue = ASensorManager_createEventQueue(
+                    manager.get(), looper.get(), kIdent, NULL /* callback */, NULL /* data */);
+            ASensorEventQueue_enableSensor(queue, manager->getSensorByHandle(kAccelerometerHandle));
+            ASensorEventQueue_enableSensor(queue, manager->getSensorByHandle(kGyroscopeHandle));
+            serviceQueue = service->getLastEventQueue();
+        }
+
+        ~Bridge() {
+            ASensorManager_destroyEventQueue(manager.get(), queue);
+        }
+
+        std::unique_ptr<ASensorManager> manager;
+        sp<ALooper> looper;
+        ASensorEventQueue *queue;
+        sp<FakeEventQueue> serviceQueue;
+    };
+
+    void deliver(Bridge *bridge, const std::vector<Event> &events) {
+        if (GetParam()) {
+            EXPECT_TRUE(bridge->serviceQueue->writeEvents(events));
+        } else {
+            hidl_vec<Event> batch(events);
+            IEventQueueCallback::castFrom(bridge->serviceQueue->getCallback())->onEvents(batch);
+        }
+    }
+
+    TemporaryFile mFile;
+};
+
+TEST_P(RecordAndReplayTest, ReplaysWhatWasRecorded) {
+    std::vector<Event> first = {
+            makeEvent(kAccelerometerHandle, SensorType::ACCELEROMETER, 100),
+            makeEvent(kGyroscopeHandle, SensorType::GYROSCOPE, 101),
+    };
+    std::vector<Event> second = {makeEvent(kAccelerometerHandle, SensorType::ACCELEROMETER, 200)};
+
+    ASensorEvent recorded[8];
+    ssize_t recordedCount;
+    {
+        sp<FakeSensorManager> service = new FakeSensorManager(makeSensors(), GetParam());
+        Bridge bridge(service);
+        ASSERT_EQ(ASensorManager_startEventQueueRecording(
+                          bridge.manager.get(), bridge.queue, mFile.path, 64 /* maxEvents */),
+                  0);
+
+        deliver(&bridge, first);
+        recordedCount = ASensorEventQueue_getEvents(bridge.queue, recorded, 8);
+        deliver(&bridge, second);
+        recordedCount += ASensorEventQueue_getEvents(
+                bridge.queue, recorded + recordedCount, 8 - recordedCount);
+        ASSERT_EQ(recordedCount, 3);
+
+        EXPECT_EQ(ASensorEventQueue_stopRecording(bridge.queue), 0);
+        // Not recorded anymore.
+        deliver(&bridge, second);
+    }
+
+    SensorTraceReader trace(mFile.path);
+    ASSERT_EQ(trace.initCheck(), android::OK);
+    ASSERT_EQ(trace.getRecordCount(), 3u);
+    EXPECT_EQ(trace.getRecord(0).arrivalNs, trace.getRecord(1).arrivalNs);
+    EXPECT_LE(trace.getRecord(1).arrivalNs, trace.getRecord(2).arrivalNs);
+
+    sp<ReplaySensorManager> replayService = new ReplaySensorManager(trace, GetParam());
+    Bridge bridge(replayService);
+    EXPECT_EQ(replayService->replay(bridge.serviceQueue, 0 /* speed */), 3u);
+
+    ASensorEvent replayed[8];
+    ASSERT_EQ(ASensorEventQueue_getEvents(bridge.queue, replayed, 8), 3);
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(replayed[i].sensor, recorded[i].sensor);
+        EXPECT_EQ(replayed[i].type, recorded[i].type);
+        EXPECT_EQ(replayed[i].timestamp, recorded[i].timestamp);
+        EXPECT_EQ(memcmp(replayed[i].data, recorded[i].data, 3 * sizeof(float)), 0);
+        EXPECT_EQ(replayed[i].acceleration.status, recorded[i].acceleration.status);
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, RecordAndReplayTest, ::testing::Bool());
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "FakeSensorManager.h"
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+
+#include <string>
+
+using android::sp;
+
+static constexpr int kIdent = 7;
+
+class SubscriptionTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mService = new FakeSensorManager({makeGyroscope()});
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        ASensorList list;
+        ASSERT_EQ(ASensorManager_getSensorList(mManager.get(), &list), 1);
+        mSensor = list[0];
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+
+        mServiceQueue = mService->getLastEventQueue();
+        ASSERT_NE(mServiceQueue, nullptr);
+    }
+
+    void TearDown() override {
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    void expectServiceConfig(int32_t samplingPeriodUs, int64_t maxBatchReportLatencyUs) {
+        int32_t actualSamplingPeriodUs;
+        int64_t actualMaxBatchReportLatencyUs;
+        ASSERT_TRUE(mServiceQueue->getSensorConfig(
+                kGyroscopeHandle, &actualSamplingPeriodUs, &actualMaxBatchReportLatencyUs));
+        EXPECT_EQ(actualSamplingPeriodUs, samplingPeriodUs);
+        EXPECT_EQ(actualMaxBatchReportLatencyUs, maxBatchReportLatencyUs);
+    }
+
+    bool isEnabledOnService() {
+        int32_t samplingPeriodUs;
+        int64_t maxBatchReportLatencyUs;
+        return mServiceQueue->getSensorConfig(
+                kGyroscopeHandle, &samplingPeriodUs, &maxBatchReportLatencyUs);
+    }
+
+    sp<FakeSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    ASensorRef mSensor;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+    sp<FakeEventQueue> mServiceQueue;
+};
+
+TEST_F(SubscriptionTest, SetEventRateKeepsBatching) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+    ASSERT_EQ(ASensorEventQueue_setEventRate(mQueue, mSensor, 20000), 0);
+    expectServiceConfig(20000, 100000);
+}
+
+TEST_F(SubscriptionTest, EnableAfterDisableRestoresConfig) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+    ASSERT_EQ(ASensorEventQueue_disableSensor(mQueue, mSensor), 0);
+    EXPECT_FALSE(isEnabledOnService());
+
+    ASSERT_EQ(ASensorEventQueue_enableSensor(mQueue, mSensor), 0);
+    expectServiceConfig(5000, 100000);
+}
+
+TEST_F(SubscriptionTest, SkipsRedundantCalls) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+    EXPECT_EQ(mServiceQueue->getConfigCallCount(), 1);
+
+    EXPECT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+    EXPECT_EQ(ASensorEventQueue_enableSensor(mQueue, mSensor), 0);
+    EXPECT_EQ(ASensorEventQueue_setEventRate(mQueue, mSensor, 5000), 0);
+    EXPECT_EQ(mServiceQueue->getConfigCallCount(), 1);
+
+    EXPECT_EQ(ASensorEventQueue_disableSensor(mQueue, mSensor), 0);
+    EXPECT_EQ(ASensorEventQueue_disableSensor(mQueue, mSensor), 0);
+    EXPECT_EQ(mServiceQueue->getConfigCallCount(), 2);
+}
+
+TEST_F(SubscriptionTest, SetEventRateDoesNotEnable) {
+    ASSERT_EQ(ASensorEventQueue_setEventRate(mQueue, mSensor, 20000), 0);
+    EXPECT_FALSE(isEnabledOnService());
+    EXPECT_EQ(mServiceQueue->getConfigCallCount(), 0);
+
+    ASSERT_EQ(ASensorEventQueue_enableSensor(mQueue, mSensor), 0);
+    expectServiceConfig(20000, 0);
+}
+
+TEST_F(SubscriptionTest, ClampsSamplingPeriod) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 10, 0), 0);
+    expectServiceConfig(1000, 0);
+
+    ASSERT_EQ(ASensorEventQueue_setEventRate(mQueue, mSensor, 5000000), 0);
+    expectServiceConfig(1000000, 0);
+
+    EXPECT_LT(ASensorEventQueue_setEventRate(mQueue, mSensor, -1), 0);
+    EXPECT_LT(ASensorEventQueue_registerSensor(mQueue, mSensor, 1000, -1), 0);
+    expectServiceConfig(1000000, 0);
+}
+
+TEST_F(SubscriptionTest, DumpListsSubscriptions) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(mQueue, mSensor, 5000, 100000), 0);
+
+    FILE *file = tmpfile();
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(ASensorEventQueue_dump(mQueue, fileno(file)), 0);
+
+    std::string out;
+    rewind(file);
+    ASSERT_TRUE(android::base::ReadFdToString(fileno(file), &out));
+    fclose(file);
+
+    EXPECT_NE(out.find("1 subscriptions"), std::string::npos) << out;
+    EXPECT_NE(out.find("gyroscope"), std::string::npos) << out;
+    EXPECT_NE(out.find("enabled"), std::string::npos) << out;
+    EXPECT_NE(out.find("period 5000 us"), std::string::npos) << out;
+    EXPECT_NE(out.find("max batch latency 100000 us"), std::string::npos) << out;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorManager.h"
+#include "SyntheticSensorManager.h"
+
+#include <gtest/gtest.h>
+#include <utils/SystemClock.h>
+
+using android::sp;
+
+static constexpr int kIdent = 7;
+static constexpr int64_t kMillisNs = 1000000;
+
+class SyntheticLoadTest : public ::testing::TestWithParam<bool /* supportsFmq */> {
+  protected:
+    void SetUp() override {
+        SyntheticSensorManager::Config config;
+        config.sensorCount = 4;
+        config.minDelayUs = 1000;
+        config.burstSize = 8;
+        mService = new SyntheticSensorManager(config, GetParam());
+        mManager.reset(new ASensorManager(mService));
+        ASSERT_EQ(mManager->initCheck(), android::OK);
+
+        mLooper = new ALooper(true /* allowNonCallbacks */);
+        mQueue = ASensorManager_createEventQueue(
+                mManager.get(), mLooper.get(), kIdent, NULL /* callback */, NULL /* data */);
+        ASSERT_NE(mQueue, nullptr);
+    }
+
+    void TearDown() override {
+        mService->stop();
+        if (mQueue != nullptr) {
+            EXPECT_EQ(ASensorManager_destroyEventQueue(mManager.get(), mQueue), 0);
+        }
+    }
+
+    // Drains the queue for durationNs, then stops the service and drains what
+    // is left. Returns the number of events received per sensor handle.
+    std::vector<size_t> run(int64_t durationNs) {
+        std::vector<size_t> received(5, 0);
+        ASensorEvent events[64];
+        auto drain = [&] {
+            ssize_t n;
+            while ((n = ASensorEventQueue_getEvents(mQueue, events, 64)) > 0) {
+                for (ssize_t i = 0; i < n; ++i) {
+                    ++received[events[i].sensor];
+                }
+            }
+        };
+
+        mService->start(mService->getLastEventQueue());
+        int64_t endNs = android::elapsedRealtimeNano() + durationNs;
+        while (android::elapsedRealtimeNano() < endNs) {
+            int fd;
+            int pollEvents;
+            mLooper->pollOnce(10 /* timeoutMillis */, &fd, &pollEvents, NULL);
+            drain();
+        }
+        mService->stop();
+        drain();
+        return received;
+    }
+
+    sp<SyntheticSensorManager> mService;
+    std::unique_ptr<ASensorManager> mManager;
+    sp<ALooper> mLooper;
+    ASensorEventQueue *mQueue = nullptr;
+};
+
+TEST_P(SyntheticLoadTest, AccountsForEveryEvent) {
+    for (int32_t handle = 1; handle <= 4; ++handle) {
+        ASSERT_EQ(ASensorEventQueue_registerSensor(
+                          mQueue, mManager->getSensorByHandle(handle), 1000 /* samplingPeriodUs */,
+                          0 /* maxBatchReportLatencyUs */),
+                  0);
+    }
+
+    std::vector<size_t> received = run(300 * kMillisNs);
+
+    size_t total = 0;
+    for (size_t count : received) {
+        total += count;
+    }
+    // 4 sensors at 1 kHz for 300 ms, give or take scheduling.
+    EXPECT_GT(mService->getGeneratedCount(), 600u);
+    EXPECT_LT(mService->getGeneratedCount(), 1800u);
+    EXPECT_EQ(total + mService->getRejectedCount() + ASensorEventQueue_getOverflowCount(mQueue),
+              mService->getGeneratedCount());
+    // Bursts are delivered whole.
+    EXPECT_EQ(mService->getGeneratedCount() % 8, 0u);
+}
+
+TEST_P(SyntheticLoadTest, FollowsSensorConfig) {
+    ASSERT_EQ(ASensorEventQueue_registerSensor(
+                      mQueue, mManager->getSensorByHandle(1), 1000 /* samplingPeriodUs */,
+                      0 /* maxBatchReportLatencyUs */),
+              0);
+    ASSERT_EQ(ASensorEventQueue_registerSensor(
+                      mQueue, mManager->getSensorByHandle(2), 10000 /* samplingPeriodUs */,
+                      0 /* maxBatchReportLatencyUs */),
+              0);
+
+    std::vector<size_t> received = run(300 * kMillisNs);
+
+    EXPECT_EQ(received[3], 0u);
+    EXPECT_EQ(received[4], 0u);
+    EXPECT_GT(received[2], 0u);
+    // 10 times the rate, less what is still pending in a burst.
+    EXPECT_GT(received[1], 5 * received[2]);
+}
+
+INSTANTIATE_TEST_CASE_P(Transports, SyntheticLoadTest, ::testing::Bool());
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SyntheticSensorManager.h"
+
+#include <unistd.h>
+#include <utils/SystemClock.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using android::hardware::hidl_vec;
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+// How often the sensor configs are looked up again.
+static constexpr int64_t kConfigRefreshNs = 10000000;
+// Shorter waits spin, sleeping is too coarse at tens of kHz.
+static constexpr int64_t kMinSleepNs = 100000;
+
+SyntheticSensorManager::SyntheticSensorManager(const Config &config, bool supportsFmq)
+    : FakeSensorManager(makeSensors(config), supportsFmq),
+      mConfig(config),
+      mStop(false),
+      mGeneratedCount(0),
+      mRejectedCount(0) {}
+
+SyntheticSensorManager::~SyntheticSensorManager() {
+    stop();
+}
+
+// static
+std::vector<SensorInfo> SyntheticSensorManager::makeSensors(const Config &config) {
+    std::vector<SensorInfo> sensors;
+    for (size_t i = 0; i < config.sensorCount; ++i) {
+        SensorInfo info;
+        info.sensorHandle = i + 1;
+        info.name = ("synthetic accelerometer " + std::to_string(i + 1)).c_str();
+        info.vendor = "fake";
+        info.version = 1;
+        info.type = SensorType::ACCELEROMETER;
+        info.typeAsString = "android.sensor.accelerometer";
+        info.maxRange = 39.2f;
+        info.resolution = 0.001f;
+        info.power = 0.1f;
+        info.minDelay = config.minDelayUs;
+        info.fifoReservedEventCount = 0;
+        info.fifoMaxEventCount = std::max<size_t>(config.burstSize, 1024);
+        info.maxDelay = 1000000;
+        info.flags = 0;
+        sensors.push_back(info);
+    }
+    return sensors;
+}
+
+void SyntheticSensorManager::start(const sp<FakeEventQueue> &queue) {
+    stop();
+    mStop = false;
+    mThread = std::thread(&SyntheticSensorManager::generate, this, queue);
+}
+
+void SyntheticSensorManager::stop() {
+    mStop = true;
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void SyntheticSensorManager::generate(sp<FakeEventQueue> queue) {
+    struct Sensor {
+        int32_t handle;
+        int64_t periodNs;  // 0 while disabled
+        int64_t nextSampleNs;
+        std::vector<Event> pending;
+    };
+
+    std::vector<Sensor> sensors(mConfig.sensorCount);
+    for (size_t i = 0; i < sensors.size(); ++i) {
+        sensors[i].handle = i + 1;
+        sensors[i].periodNs = 0;
+    }
+
+    sp<IEventQueueCallback_1_1> callback_1_1;
+    if (queue->getEventQueue() == NULL) {
+        callback_1_1 = IEventQueueCallback_1_1::castFrom(queue->getCallback());
+    }
+
+    const size_t burstSize = std::max<size_t>(mConfig.burstSize, 1);
+    int64_t nextRefreshNs = 0;
+    std::vector<Event> batch;
+    while (!mStop.load()) {
+        int64_t nowNs = android::elapsedRealtimeNano();
+
+        if (nowNs >= nextRefreshNs) {
+            for (Sensor &sensor : sensors) {
+                int32_t samplingPeriodUs;
+                int64_t maxBatchReportLatencyUs;
+                int64_t periodNs = 0;
+                if (queue->getSensorConfig(
+                            sensor.handle, &samplingPeriodUs, &maxBatchReportLatencyUs)) {
+                    periodNs = std::max(samplingPeriodUs, mConfig.minDelayUs) * 1000ll;
+                }
+                if (periodNs != sensor.periodNs) {
+                    sensor.periodNs = periodNs;
+                    sensor.nextSampleNs = nowNs;
+                    sensor.pending.clear();
+                }
+            }
+            nextRefreshNs = nowNs + kConfigRefreshNs;
+        }
+
+        // Sample every sensor up to now, and flush the full bursts.
+        batch.clear();
+        int64_t nextDueNs = nextRefreshNs;
+        for (Sensor &sensor : sensors) {
+            if (sensor.periodNs == 0) {
+                continue;
+            }
+            for (; sensor.nextSampleNs <= nowNs; sensor.nextSampleNs += sensor.periodNs) {
+                Event event;
+                event.sensorHandle = sensor.handle;
+                event.sensorType = SensorType::ACCELEROMETER;
+                event.timestamp = sensor.nextSampleNs;
+                event.u.vec3.x = 0.0f;
+                event.u.vec3.y = 0.0f;
+                event.u.vec3.z = 9.81f;
+                event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+                sensor.pending.push_back(event);
+                if (sensor.pending.size() == burstSize) {
+                    batch.insert(batch.end(), sensor.pending.begin(), sensor.pending.end());
+                    sensor.pending.clear();
+                }
+            }
+            // The burst completes when its last sample is taken.
+            int64_t burstDueNs =
+                    sensor.nextSampleNs + (burstSize - 1 - sensor.pending.size()) * sensor.periodNs;
+            nextDueNs = std::min(nextDueNs, burstDueNs);
+        }
+
+        if (!batch.empty()) {
+            mGeneratedCount += batch.size();
+            if (queue->getEventQueue() != NULL) {
+                if (!queue->writeEvents(batch)) {
+                    mRejectedCount += batch.size();
+                }
+            } else if (callback_1_1 != NULL) {
+                hidl_vec<Event> events;
+                events.setToExternal(batch.data(), batch.size());
+                callback_1_1->onEvents(events);
+            } else {
+                for (const Event &event : batch) {
+                    queue->getCallback()->onEvent(event);
+                }
+            }
+        }
+
+        int64_t waitNs = nextDueNs - android::elapsedRealtimeNano();
+        if (waitNs >= kMinSleepNs) {
+            usleep(waitNs / 1000);
+        } else if (waitNs > 0) {
+            std::this_thread::yield();
+        }
+    }
+}
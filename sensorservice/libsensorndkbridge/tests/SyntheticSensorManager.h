@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SYNTHETIC_SENSOR_MANAGER_H_
+
+#define SYNTHETIC_SENSOR_MANAGER_H_
+
+#include "FakeSensorManager.h"
+
+#include <atomic>
+#include <thread>
+
+// A stand-in for the sensor service generating events at high rates, to
+// measure the throughput ceiling and event loss of the bridge end to end
+// without a device.
+//
+// It has sensorCount accelerometers with handles 1 to sensorCount. Once
+// started on a queue, a thread samples each sensor enabled on it at the
+// sampling period it was enabled with, and delivers the samples in bursts
+// of burstSize, the way a hardware FIFO is flushed. Samples of all sensors
+// that are due together go in one batch.
+struct SyntheticSensorManager : public FakeSensorManager {
+    struct Config {
+        size_t sensorCount;
+        // Shortest sampling period of the sensors.
+        int32_t minDelayUs;
+        // 1 delivers every sample as soon as it is taken.
+        size_t burstSize;
+    };
+
+    explicit SyntheticSensorManager(const Config &config, bool supportsFmq = true);
+    ~SyntheticSensorManager();
+
+    // Starts generating events for queue, the only queue generated for.
+    void start(const android::sp<FakeEventQueue> &queue);
+    void stop();
+
+    // Samples delivered so far, or rejected. Samples waiting for their burst
+    // to fill up aren't counted yet.
+    uint64_t getGeneratedCount() const { return mGeneratedCount.load(); }
+    // Samples that didn't fit into a shared memory queue, the service drops
+    // them.
+    uint64_t getRejectedCount() const { return mRejectedCount.load(); }
+
+private:
+    static std::vector<SensorInfo> makeSensors(const Config &config);
+
+    void generate(android::sp<FakeEventQueue> queue);
+
+    const Config mConfig;
+    std::thread mThread;
+    std::atomic_bool mStop;
+    std::atomic<uint64_t> mGeneratedCount;
+    std::atomic<uint64_t> mRejectedCount;
+
+    DISALLOW_COPY_AND_ASSIGN(SyntheticSensorManager);
+};
+
+#endif  // SYNTHETIC_SENSOR_MANAGER_H_
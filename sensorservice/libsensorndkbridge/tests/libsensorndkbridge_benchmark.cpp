@@ -0,0 +1,591 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ALooper.h"
+#include "ASensorEventQueue.h"
+#include "ASensorManager.h"
+#include "EventConversion.h"
+#include "FakeSensorManager.h"
+#include "LatencyStats.h"
+#include "ReplaySensorManager.h"
+#include "SensorCatalog.h"
+#include "SensorTrace.h"
+#include "SyntheticSensorManager.h"
+
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+#include <sched.h>
+#include <sensorndkbridge/DirectReportReader.h>
+#include <sensorndkbridge/sensor_bridge.h>
+#include <sensors/convert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utils/SystemClock.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using android::hardware::sensors::V1_0::Event;
+using android::hardware::sensors::V1_0::SensorInfo;
+using android::hardware::sensors::V1_0::SensorStatus;
+using android::hardware::sensors::V1_0::SensorType;
+using android::sp;
+
+// Counts heap allocations of the whole process, the bridge included, so that
+// benchmarks can report allocations per event on the hot paths.
+static std::atomic<uint64_t> gAllocationCount(0);
+
+void *operator new(size_t size) {
+    gAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size);
+    if (p == NULL) {
+        abort();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+static void reportAllocations(benchmark::State& state, uint64_t allocationsBefore,
+                              size_t events) {
+    state.counters["allocs_per_event"] =
+            static_cast<double>(gAllocationCount.load() - allocationsBefore)
+            / std::max<size_t>(events, 1);
+}
+
+static Event makeAccelerometerEvent(int64_t timestamp) {
+    Event event;
+    event.timestamp = timestamp;
+    event.sensorHandle = 1;
+    event.sensorType = SensorType::ACCELEROMETER;
+    event.u.vec3.x = 0.1f;
+    event.u.vec3.y = 0.2f;
+    event.u.vec3.z = 9.8f;
+    event.u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    return event;
+}
+
+// Delivers events to a queue and drains it every state.range(0) events,
+// reporting how many times the queue had to wake up its looper.
+static void BM_OnEventWakeups(benchmark::State& state) {
+    const size_t drainEvery = state.range(0);
+
+    sp<ALooper> looper = new ALooper(false /* allowNonCallbacks */);
+    sp<ASensorEventQueue> queue = new ASensorEventQueue(looper.get(), 1024 /* capacity */);
+    std::vector<ASensorEvent> events(drainEvery);
+
+    Event event = makeAccelerometerEvent(0);
+    size_t delivered = 0;
+    for (auto _ : state) {
+        event.timestamp++;
+        queue->onEvent(event);
+        if (++delivered % drainEvery == 0) {
+            queue->getEvents(events.data(), events.size());
+        }
+    }
+
+    state.SetItemsProcessed(delivered);
+    state.counters["wakeups_per_1000_events"] =
+            1000.0 * queue->getWakeupCount() / std::max<size_t>(delivered, 1);
+
+    queue->invalidate();
+}
+BENCHMARK(BM_OnEventWakeups)->Arg(1)->Arg(8)->Arg(64);
+
+// Decodes a direct report region filled with state.range(0) records into an
+// ASensorEvent array, as a consumer of a direct channel would.
+static void BM_DirectReportDecode(benchmark::State& state) {
+    const size_t recordCount = state.range(0);
+
+    std::vector<ASensorEvent> region(recordCount);
+    for (size_t i = 0; i < recordCount; ++i) {
+        memset(&region[i], 0, sizeof(ASensorEvent));
+        region[i].version = DirectReportReader::kRecordSize;
+        region[i].sensor = 1;
+        region[i].type = ASENSOR_TYPE_ACCELEROMETER;
+        region[i].reserved0 = i + 1;
+        region[i].timestamp = i;
+    }
+
+    std::vector<ASensorEvent> events(recordCount);
+    size_t decoded = 0;
+    for (auto _ : state) {
+        DirectReportReader reader(region.data(), recordCount * DirectReportReader::kRecordSize);
+        decoded += reader.read(events.data(), events.size());
+        benchmark::DoNotOptimize(events.data());
+    }
+
+    state.SetItemsProcessed(decoded);
+}
+BENCHMARK(BM_DirectReportDecode)->Arg(64)->Arg(1024)->Arg(16384);
+
+// Converts a batch of state.range(1) accelerometer events, one by one with
+// convertToSensorEvent if state.range(0) is 0, in bulk with
+// convertSensorEvents otherwise.
+static void BM_ConvertEvents(benchmark::State& state) {
+    const bool bulk = state.range(0) != 0;
+    const size_t count = state.range(1);
+
+    std::vector<Event> events(count);
+    for (size_t i = 0; i < count; ++i) {
+        events[i].sensorHandle = 1;
+        events[i].sensorType = SensorType::ACCELEROMETER;
+        events[i].timestamp = i;
+        events[i].u.vec3.x = 1.0f;
+        events[i].u.vec3.y = 2.0f;
+        events[i].u.vec3.z = 3.0f;
+        events[i].u.vec3.status = SensorStatus::ACCURACY_HIGH;
+    }
+
+    std::vector<sensors_event_t> converted(count);
+    for (auto _ : state) {
+        if (bulk) {
+            convertSensorEvents(events.data(), count, converted.data());
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                android::hardware::sensors::V1_0::implementation::convertToSensorEvent(
+                        events[i], &converted[i]);
+            }
+        }
+        benchmark::DoNotOptimize(converted.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_ConvertEvents)
+        ->ArgNames({"bulk", "batch"})
+        ->RangeMultiplier(8)
+        ->Ranges({{0, 1}, {1, 512}});
+
+static SensorInfo makeAccelerometer() {
+    SensorInfo info;
+    info.sensorHandle = 1;
+    info.name = "accelerometer";
+    info.vendor = "fake";
+    info.version = 1;
+    info.type = SensorType::ACCELEROMETER;
+    info.typeAsString = "android.sensor.accelerometer";
+    info.maxRange = 39.2f;
+    info.resolution = 0.001f;
+    info.power = 0.1f;
+    info.minDelay = 1000;
+    info.fifoReservedEventCount = 0;
+    info.fifoMaxEventCount = 1024;
+    info.maxDelay = 1000000;
+    info.flags = 0;
+    return info;
+}
+
+// A bridge talking to an in-process stand-in for the sensor service, with
+// queueCount queues on one looper that doesn't use callbacks. The queues
+// receive events through shared memory if useFmq is set, through callbacks
+// otherwise.
+struct Bridge {
+    Bridge(bool useFmq, size_t queueCount,
+           const ASensorEventQueueScheduling *scheduling = NULL)
+        : service(new FakeSensorManager({makeAccelerometer()}, useFmq)),
+          manager(new ASensorManager(service)),
+          looper(new ALooper(true /* allowNonCallbacks */)) {
+        ASensorRef sensor = manager->getSensorByHandle(1);
+        for (size_t i = 0; i < queueCount; ++i) {
+            ASensorEventQueue *queue = manager->createEventQueue(
+                    looper.get(), i /* ident */, NULL /* callback */, NULL /* data */,
+                    0 /* maxDeliveryLatencyUs */, scheduling);
+            queue->enableSensor(sensor);
+            queues.push_back(queue);
+            serviceQueues.push_back(service->getLastEventQueue());
+        }
+    }
+
+    ~Bridge() {
+        for (ASensorEventQueue *queue : queues) {
+            manager->destroyEventQueue(queue);
+        }
+    }
+
+    // Delivers events to the index-th queue like the service does.
+    void deliver(size_t index, const std::vector<Event> &events) {
+        if (serviceQueues[index]->getEventQueue() != NULL) {
+            serviceQueues[index]->writeEvents(events);
+        } else {
+            // Wrap rather than copy, so that only the bridge allocates.
+            android::hardware::hidl_vec<Event> batch;
+            batch.setToExternal(const_cast<Event *>(events.data()), events.size());
+            queues[index]->onEvents(batch);
+        }
+    }
+
+    sp<FakeSensorManager> service;
+    std::unique_ptr<ASensorManager> manager;
+    sp<ALooper> looper;
+    std::vector<ASensorEventQueue *> queues;
+    std::vector<sp<FakeEventQueue>> serviceQueues;
+};
+
+// Delivers batches of state.range(1) events and drains them, through shared
+// memory if state.range(0) is set and callbacks otherwise.
+static void BM_DeliverAndDrain(benchmark::State& state) {
+    const size_t batchSize = state.range(1);
+    Bridge bridge(state.range(0) != 0, 1 /* queueCount */);
+
+    std::vector<Event> batch;
+    for (size_t i = 0; i < batchSize; ++i) {
+        batch.push_back(makeAccelerometerEvent(i));
+    }
+    std::vector<ASensorEvent> events(batchSize);
+
+    size_t drained = 0;
+    uint64_t allocationsBefore = gAllocationCount.load();
+    for (auto _ : state) {
+        bridge.deliver(0, batch);
+        drained += bridge.queues[0]->getEvents(events.data(), events.size());
+        benchmark::DoNotOptimize(events.data());
+    }
+
+    state.SetItemsProcessed(drained);
+    state.SetBytesProcessed(drained * sizeof(ASensorEvent));
+    reportAllocations(state, allocationsBefore, drained);
+}
+BENCHMARK(BM_DeliverAndDrain)
+        ->ArgNames({"fmq", "batch"})
+        ->RangeMultiplier(8)
+        ->Ranges({{0, 1}, {1, 256}});
+
+// Signals state.range(0) queues sharing a looper and services them the way
+// a client does: pollOnce, then drain the queue it returned.
+static void BM_PollOnce(benchmark::State& state) {
+    const size_t queueCount = state.range(0);
+    Bridge bridge(false /* useFmq */, queueCount);
+    std::vector<Event> batch = {makeAccelerometerEvent(0)};
+    ASensorEvent events[4];
+
+    size_t wakeups = 0;
+    uint64_t allocationsBefore = gAllocationCount.load();
+    for (auto _ : state) {
+        for (size_t i = 0; i < queueCount; ++i) {
+            bridge.deliver(i, batch);
+        }
+
+        int fd;
+        int pollEvents;
+        for (size_t i = 0; i < queueCount; ++i) {
+            int ident = bridge.looper->pollOnce(0 /* timeoutMillis */, &fd, &pollEvents, NULL);
+            if (ident < 0 || static_cast<size_t>(ident) >= queueCount) {
+                state.SkipWithError("pollOnce didn't return a queue");
+                return;
+            }
+            bridge.queues[ident]->getEvents(events, 4);
+            ++wakeups;
+        }
+    }
+
+    state.SetItemsProcessed(wakeups);
+    reportAllocations(state, allocationsBefore, wakeups);
+}
+BENCHMARK(BM_PollOnce)->ArgName("queues")->Arg(1)->Arg(4)->Arg(16);
+
+// Runs a producer thread delivering an event every state.range(0)
+// microseconds, 0 for as fast as it can, to a client blocked in pollOnce.
+// Reports the latency from delivery to drain measured by the queue.
+static void BM_ProducerToConsumerLatency(benchmark::State& state) {
+    const int64_t intervalUs = state.range(0);
+    Bridge bridge(false /* useFmq */, 1 /* queueCount */);
+    ASensorEventQueue *queue = bridge.queues[0];
+    queue->setLatencyTracking(true);
+
+    std::atomic_bool stop(false);
+    std::thread producer([&] {
+        while (!stop.load()) {
+            bridge.deliver(0, {makeAccelerometerEvent(android::elapsedRealtimeNano())});
+            if (intervalUs > 0) {
+                usleep(intervalUs);
+            }
+        }
+    });
+
+    ASensorEvent events[64];
+    size_t drained = 0;
+    for (auto _ : state) {
+        int fd;
+        int pollEvents;
+        bridge.looper->pollOnce(100 /* timeoutMillis */, &fd, &pollEvents, NULL);
+        drained += queue->getEvents(events, 64);
+    }
+
+    stop = true;
+    producer.join();
+
+    ASensorLatencySummary drain;
+    if (queue->getLatencyStats(bridge.manager->getSensorByHandle(1), NULL, &drain) == 0) {
+        state.counters["drain_p50_us"] = drain.p50Ns / 1000.0;
+        state.counters["drain_p99_us"] = drain.p99Ns / 1000.0;
+    }
+    state.SetItemsProcessed(drained);
+}
+BENCHMARK(BM_ProducerToConsumerLatency)
+        ->ArgName("interval_us")
+        ->Arg(0)->Arg(100)->Arg(1000)
+        ->UseRealTime()
+        ->Iterations(2000);
+
+static void pinToCpu0() {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    sched_setaffinity(0 /* pid */, sizeof(cpus), &cpus);
+}
+
+// Delivers an event every millisecond through shared memory, so that the
+// bridge's own thread hands it to the looper, while state.range(1) threads
+// spin on CPU 0. The bridge's thread is pinned to CPU 0 through the queue's
+// scheduling, the client pins itself. If state.range(0) is set, the thread
+// delivering events and the client run SCHED_FIFO, as for a control loop,
+// SCHED_OTHER otherwise.
+// Reports the distribution of the latency from delivery to the client
+// getting the event.
+static void BM_CallbackJitter(benchmark::State& state) {
+    const bool realTime = state.range(0) != 0;
+    const size_t loadThreads = state.range(1);
+
+    // The client's thread is the looper's, restored afterwards.
+    cpu_set_t savedCpus;
+    sched_getaffinity(0 /* pid */, sizeof(savedCpus), &savedCpus);
+    int savedPolicy = sched_getscheduler(0 /* pid */);
+    struct sched_param savedParam;
+    sched_getparam(0 /* pid */, &savedParam);
+
+    ASensorEventQueueScheduling scheduling;
+    scheduling.policy = realTime ? SCHED_FIFO : SCHED_OTHER;
+    scheduling.priority = realTime ? 10 : 0;
+    scheduling.cpuMask = 1;  // CPU 0, shared with the load
+
+    // Started before the client switches policy, so they don't inherit it.
+    std::atomic_bool stop(false);
+    std::vector<std::thread> load;
+    for (size_t i = 0; i < loadThreads; ++i) {
+        load.emplace_back([&] {
+            pinToCpu0();
+            while (!stop.load(std::memory_order_relaxed)) {
+            }
+        });
+    }
+
+    pinToCpu0();
+    struct sched_param param;
+    param.sched_priority = realTime ? scheduling.priority : 0;
+    sched_setscheduler(0 /* pid */, scheduling.policy, &param);
+    state.counters["rt_applied"] = sched_getscheduler(0 /* pid */) == SCHED_FIFO;
+
+    {
+        Bridge bridge(true /* useFmq */, 1 /* queueCount */, &scheduling);
+        ASensorEventQueue *queue = bridge.queues[0];
+
+        std::thread producer([&] {
+            // Stands in for the service, not part of the client.
+            struct sched_param otherParam;
+            otherParam.sched_priority = 0;
+            sched_setscheduler(0 /* pid */, SCHED_OTHER, &otherParam);
+            while (!stop.load()) {
+                bridge.deliver(0, {makeAccelerometerEvent(android::elapsedRealtimeNano())});
+                usleep(1000);
+            }
+        });
+
+        LatencyHistogram latencies;
+        ASensorEvent events[16];
+        for (auto _ : state) {
+            int fd;
+            int pollEvents;
+            bridge.looper->pollOnce(100 /* timeoutMillis */, &fd, &pollEvents, NULL);
+            ssize_t n = queue->getEvents(events, 16);
+            int64_t nowNs = android::elapsedRealtimeNano();
+            for (ssize_t i = 0; i < n; ++i) {
+                latencies.record(nowNs - events[i].timestamp);
+            }
+        }
+
+        stop = true;
+        producer.join();
+
+        ASensorLatencySummary summary;
+        latencies.getSummary(&summary);
+        state.counters["p50_us"] = summary.p50Ns / 1000.0;
+        state.counters["p99_us"] = summary.p99Ns / 1000.0;
+        state.counters["max_us"] = summary.maxNs / 1000.0;
+    }
+
+    for (std::thread &thread : load) {
+        thread.join();
+    }
+    sched_setscheduler(0 /* pid */, savedPolicy, &savedParam);
+    sched_setaffinity(0 /* pid */, sizeof(savedCpus), &savedCpus);
+}
+BENCHMARK(BM_CallbackJitter)
+        ->ArgNames({"rt", "load_threads"})
+        ->Args({0, 0})->Args({0, 4})->Args({1, 0})->Args({1, 4})
+        ->UseRealTime()
+        ->Iterations(1000);
+
+// Replays a trace of accelerometer events recorded in batches of
+// state.range(1), through shared memory if state.range(0) is set, as fast as
+// the client drains them. The trace is synthetic here, a recording from the
+// field replays the same way.
+static void BM_ReplayTrace(benchmark::State& state) {
+    static constexpr size_t kEventCount = 4096;
+    const bool useFmq = state.range(0) != 0;
+    const size_t batchSize = state.range(1);
+
+    TemporaryFile file;
+    {
+        android::hardware::hidl_vec<SensorInfo> sensors = {makeAccelerometer()};
+        SensorTraceWriter writer(file.path, sensors, kEventCount);
+        std::vector<Event> batch(batchSize);
+        for (size_t i = 0; i < kEventCount; i += batchSize) {
+            for (size_t j = 0; j < batchSize; ++j) {
+                batch[j] = makeAccelerometerEvent(i + j);
+            }
+            writer.append(batch.data(), batchSize, i * 1000000 /* arrivalNs */);
+        }
+    }
+
+    SensorTraceReader trace(file.path);
+    sp<ReplaySensorManager> service = new ReplaySensorManager(trace, useFmq);
+    ASensorManager manager(service);
+    sp<ALooper> looper = new ALooper(true /* allowNonCallbacks */);
+    ASensorEventQueue *queue = manager.createEventQueue(
+            looper.get(), 0 /* ident */, NULL /* callback */, NULL /* data */);
+    queue->enableSensor(manager.getSensorByHandle(1));
+    sp<FakeEventQueue> serviceQueue = service->getLastEventQueue();
+
+    ASensorEvent events[256];
+    size_t drained = 0;
+    for (auto _ : state) {
+        std::atomic_bool done(false);
+        std::thread producer([&] {
+            service->replay(serviceQueue, 0 /* speed */);
+            done = true;
+        });
+
+        while (!done.load() || queue->hasEvents() > 0) {
+            int fd;
+            int pollEvents;
+            looper->pollOnce(10 /* timeoutMillis */, &fd, &pollEvents, NULL);
+            ssize_t n = queue->getEvents(events, 256);
+            if (n > 0) {
+                drained += n;
+            }
+        }
+        producer.join();
+    }
+
+    manager.destroyEventQueue(queue);
+    state.SetItemsProcessed(drained);
+}
+BENCHMARK(BM_ReplayTrace)
+        ->ArgNames({"fmq", "batch"})
+        ->Args({0, 1})->Args({0, 16})->Args({1, 1})->Args({1, 16})
+        ->UseRealTime();
+
+// Runs state.range(1) synthetic sensors sampling every state.range(2)
+// microseconds, delivered in bursts of state.range(3), through shared memory
+// if state.range(0) is set. The client drains the queue as fast as it can
+// for 100ms per iteration. Reports the events received per second and the
+// fraction of the events generated that were lost on the way.
+static void BM_SyntheticLoad(benchmark::State& state) {
+    const bool useFmq = state.range(0) != 0;
+    SyntheticSensorManager::Config config;
+    config.sensorCount = state.range(1);
+    config.minDelayUs = state.range(2);
+    config.burstSize = state.range(3);
+
+    sp<SyntheticSensorManager> service = new SyntheticSensorManager(config, useFmq);
+    ASensorManager manager(service);
+    sp<ALooper> looper = new ALooper(true /* allowNonCallbacks */);
+    ASensorEventQueue *queue = manager.createEventQueue(
+            looper.get(), 0 /* ident */, NULL /* callback */, NULL /* data */);
+    for (size_t i = 1; i <= config.sensorCount; ++i) {
+        queue->registerSensor(manager.getSensorByHandle(i), config.minDelayUs,
+                              0 /* maxBatchReportLatencyUs */);
+    }
+    service->start(service->getLastEventQueue());
+
+    ASensorEvent events[256];
+    size_t received = 0;
+    for (auto _ : state) {
+        int64_t endNs = android::elapsedRealtimeNano() + 100000000;
+        while (android::elapsedRealtimeNano() < endNs) {
+            int fd;
+            int pollEvents;
+            looper->pollOnce(10 /* timeoutMillis */, &fd, &pollEvents, NULL);
+            ssize_t n;
+            while ((n = queue->getEvents(events, 256)) > 0) {
+                received += n;
+            }
+        }
+    }
+
+    service->stop();
+    ssize_t n;
+    while ((n = queue->getEvents(events, 256)) > 0) {
+        received += n;
+    }
+
+    uint64_t generated = service->getGeneratedCount();
+    state.counters["loss"] = generated > 0 ? 1.0 - static_cast<double>(received) / generated : 0;
+    state.SetItemsProcessed(received);
+    manager.destroyEventQueue(queue);
+}
+BENCHMARK(BM_SyntheticLoad)
+        ->ArgNames({"fmq", "sensors", "period_us", "burst"})
+        ->Args({0, 4, 1000, 1})->Args({1, 4, 1000, 1})
+        ->Args({0, 8, 200, 1})->Args({1, 8, 200, 1})
+        ->Args({0, 8, 200, 64})->Args({1, 8, 200, 64})
+        ->Args({0, 16, 100, 64})->Args({1, 16, 100, 64})
+        ->UseRealTime();
+
+// Walks a catalog of state.range(0) sensors through the NDK accessors, the
+// way clients look for the sensor they want. Reports the size of the arena.
+static void BM_SensorCatalogScan(benchmark::State& state) {
+    android::hardware::hidl_vec<SensorInfo> sensors;
+    sensors.resize(state.range(0));
+    for (size_t i = 0; i < sensors.size(); ++i) {
+        sensors[i] = makeAccelerometer();
+        sensors[i].sensorHandle = i + 1;
+        sensors[i].name = "accelerometer " + std::to_string(i);
+    }
+    SensorCatalog catalog(sensors);
+
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (size_t i = 0; i < catalog.size(); ++i) {
+            ASensorRef sensor = catalog.getList()[i];
+            sum += ASensor_getType(sensor) + ASensor_getMinDelay(sensor)
+                    + ASensor_getHandle(sensor) + ASensor_getName(sensor)[0];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    state.counters["arena_bytes"] = catalog.getArenaSize();
+    state.SetItemsProcessed(state.iterations() * catalog.size());
+}
+BENCHMARK(BM_SensorCatalogScan)->Arg(16)->Arg(64)->Arg(256);
+
+BENCHMARK_MAIN();